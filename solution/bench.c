@@ -0,0 +1,321 @@
+#include "engine.h"
+#include "parity.h"
+#include "utility.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+  Microbenchmarks for libwfs. Formats scratch disk images, fills the data
+  region to a controlled level and times the engine functions directly,
+  with no FUSE mount or kernel round-trip in the measurement.
+*/
+
+#define BENCH_MAX_FILLS 8
+
+struct bench_config {
+  int raid_mode;
+  int num_disks;
+  int chunk_blocks;
+  int meta_copies;     //0 keeps a metadata copy on every disk
+  size_t window_bytes; //nonzero maps the images in windows of this size
+  size_t num_inodes;
+  size_t num_data_blocks;
+  int iterations;
+  const char *dir;
+  int fills[BENCH_MAX_FILLS];
+  int num_fills;
+};
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void report(const char *name, int fill, long long elapsed_ns, int iterations) {
+  printf("%-28s fill=%3d%%  %8d iters  %12.1f ns/op\n", name, fill, iterations,
+         (double)elapsed_ns / iterations);
+}
+
+static void print_usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-r 0|1|1v|5|10] [-n disks] [-c chunk_bytes] [-m meta_copies] [-i inodes] [-b blocks] "
+                  "[-w window_bytes] [-N iterations] [-f fill%%]... [-d scratch_dir]\n", name);
+}
+
+//Create and format the scratch images, then map them into ctx
+static int format_images(const struct bench_config *cfg, char **paths, struct wfs_ctx *ctx) {
+  size_t required_size = calc_size(cfg->num_inodes, cfg->num_data_blocks);
+  uint8_t fs_uuid[WFS_UUID_BYTES];
+  generate_fs_uuid(fs_uuid);
+  for (int i = 0; i < cfg->num_disks; i++) {
+    int fd = open(paths[i], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, required_size) != 0) {
+      perror("Error creating scratch image");
+      if (fd >= 0) {
+        close(fd);
+      }
+      return -1;
+    }
+    close(fd);
+    if (disk_initialize(paths[i], cfg->num_inodes, cfg->num_data_blocks, required_size,
+                        cfg->raid_mode, i, cfg->num_disks, cfg->chunk_blocks, cfg->meta_copies, NULL, fs_uuid, 0) != 0) {
+      fprintf(stderr, "Error formatting %s\n", paths[i]);
+      return -1;
+    }
+  }
+  return wfs_ctx_open_windowed(ctx, paths, cfg->num_disks, cfg->window_bytes,
+                               cfg->window_bytes ? WFS_WINDOW_DEFAULT_MAX : 0);
+}
+
+//Allocate data blocks until the requested share of the data region is in use
+static int fill_data_blocks(struct wfs_ctx *ctx, int fill) {
+  int data_disks = IS_MIRRORED(ctx)                 ? 1
+                   : ctx->sb.raid_mode == RAID_5  ? ctx->num_disks - 1
+                   : ctx->sb.raid_mode == RAID_10 ? ctx->num_disks / 2
+                                                  : ctx->num_disks;
+  size_t capacity = ctx->sb.num_data_blocks * data_disks;
+  size_t used = 0;
+  while (used * 100 < capacity * fill) {
+    if (get_data_block(ctx) < 0) {
+      return -1;
+    }
+    used++;
+  }
+  return 0;
+}
+
+static void run_fill_level(const struct bench_config *cfg, char **paths, int fill) {
+  struct wfs_ctx ctx;
+  if (format_images(cfg, paths, &ctx) != 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  //Namespace the lookups walk, created before the fill so it sits in the low blocks
+  engine_mkdir(&ctx, "/b0", 0755);
+  engine_mkdir(&ctx, "/b0/b1", 0755);
+  engine_mkdir(&ctx, "/b0/b1/b2", 0755);
+  engine_mkdir(&ctx, "/b0/b1/b2/b3", 0755);
+  engine_mknod(&ctx, "/b0/b1/b2/b3/leaf", 0644 | S_IFREG);
+  engine_mkdir(&ctx, "/entries", 0755);
+  int entries_inode = get_inode_index(&ctx, "/entries");
+  struct wfs_inode entries_dir;
+  load_inode(&ctx, &entries_dir, entries_inode);
+  char name[MAX_NAME];
+  for (int i = 0; i < 64; i++) {
+    snprintf(name, sizeof(name), "entry%d", i);
+    insert_directory_entry(&ctx, &entries_dir, entries_inode, name, 0);
+  }
+  engine_mknod(&ctx, "/data", 0644 | S_IFREG);
+  char io_buf[4096];
+  memset(io_buf, 'x', sizeof(io_buf));
+  engine_write(&ctx, "/data", io_buf, sizeof(io_buf), 0);
+  engine_mknod(&ctx, "/copy", 0644 | S_IFREG);
+  engine_copy_file_range(&ctx, "/data", 0, "/copy", 0, sizeof(io_buf));
+  static char large_buf[32 * 1024];
+  memset(large_buf, 'y', sizeof(large_buf));
+  engine_mknod(&ctx, "/large", 0644 | S_IFREG);
+  engine_write(&ctx, "/large", large_buf, sizeof(large_buf), 0);
+
+  if (fill_data_blocks(&ctx, fill) != 0) {
+    fprintf(stderr, "Could not reach %d%% fill\n", fill);
+    wfs_ctx_close(&ctx);
+    exit(EXIT_FAILURE);
+  }
+
+  int n = cfg->iterations;
+  long long start;
+
+  start = now_ns();
+  for (int i = 0; i < n; i++) {
+    off_t block = get_data_block(&ctx);
+    clear_data_block(&ctx, block);
+  }
+  report("get_data_block+clear", fill, now_ns() - start, n);
+
+  int disk;
+  volatile off_t sink = 0;
+  start = now_ns();
+  for (int i = 0; i < n; i++) {
+    sink += calculate_raid_disk(&ctx, &disk, i);
+  }
+  report("calculate_raid_disk", fill, now_ns() - start, n);
+
+  char block[BLOCK_SIZE];
+  struct wfs_inode data_inode;
+  load_inode(&ctx, &data_inode, get_inode_index(&ctx, "/data"));
+  start = now_ns();
+  for (int i = 0; i < n; i++) {
+    find_majority_block(&ctx, block, data_inode.blocks[i % (N_BLOCKS - 1)]);
+  }
+  report("find_majority_block", fill, now_ns() - start, n);
+
+  start = now_ns();
+  for (int i = 0; i < n; i++) {
+    sink += get_inode_index(&ctx, "/b0/b1/b2/b3/leaf");
+  }
+  report("get_inode_index(depth 5)", fill, now_ns() - start, n);
+
+  start = now_ns();
+  for (int i = 0; i < n; i++) {
+    insert_directory_entry(&ctx, &entries_dir, entries_inode, "scratch", 0);
+    delete_directory_entry(&ctx, entries_inode, "scratch");
+  }
+  report("insert+delete_dir_entry", fill, now_ns() - start, n);
+
+  start = now_ns();
+  for (int i = 0; i < n; i++) {
+    engine_mknod(&ctx, "/entries/scratch", 0644 | S_IFREG);
+    engine_unlink(&ctx, "/entries/scratch");
+  }
+  report("mknod+unlink", fill, now_ns() - start, n);
+
+  start = now_ns();
+  for (int i = 0; i < n; i++) {
+    engine_write(&ctx, "/data", io_buf, sizeof(io_buf), 0);
+  }
+  report("engine_write(4 KiB)", fill, now_ns() - start, n);
+
+  start = now_ns();
+  for (int i = 0; i < n; i++) {
+    engine_read(&ctx, "/data", io_buf, sizeof(io_buf), 0);
+  }
+  report("engine_read(4 KiB)", fill, now_ns() - start, n);
+
+  //The same 4 KiB moved between files: bounced through a buffer, then inside the engine
+  start = now_ns();
+  for (int i = 0; i < n; i++) {
+    engine_read(&ctx, "/data", io_buf, sizeof(io_buf), 0);
+    engine_write(&ctx, "/copy", io_buf, sizeof(io_buf), 0);
+  }
+  report("read+write copy(4 KiB)", fill, now_ns() - start, n);
+
+  start = now_ns();
+  for (int i = 0; i < n; i++) {
+    engine_copy_file_range(&ctx, "/data", 0, "/copy", 0, sizeof(io_buf));
+  }
+  report("copy_file_range(4 KiB)", fill, now_ns() - start, n);
+
+  //A request big enough to split, copied serially and then by the per-disk workers
+  for (int parallel = 0; parallel <= 1; parallel++) {
+    ctx.pio.enabled = parallel;
+    if (parallel && pio_start_workers(&ctx) != 0) {
+      break;
+    }
+    start = now_ns();
+    for (int i = 0; i < n; i++) {
+      engine_write(&ctx, "/large", large_buf, sizeof(large_buf), 0);
+    }
+    report(parallel ? "engine_write(32 KiB, pio)" : "engine_write(32 KiB)", fill, now_ns() - start, n);
+    start = now_ns();
+    for (int i = 0; i < n; i++) {
+      engine_read(&ctx, "/large", large_buf, sizeof(large_buf), 0);
+    }
+    report(parallel ? "engine_read(32 KiB, pio)" : "engine_read(32 KiB)", fill, now_ns() - start, n);
+  }
+  pio_close(&ctx);
+
+  char parity[BLOCK_SIZE] = {0};
+  start = now_ns();
+  for (int i = 0; i < n; i++) {
+    parity_xor(parity, io_buf + (i % 8) * BLOCK_SIZE, BLOCK_SIZE);
+  }
+  report("parity_xor(512 B)", fill, now_ns() - start, n);
+  sink += parity[0];
+
+  (void)sink;
+  wfs_ctx_close(&ctx);
+}
+
+int main(int argc, char *argv[]) {
+  struct bench_config cfg = {
+      .raid_mode = RAID_0,
+      .num_disks = 2,
+      .chunk_blocks = 1,
+      .num_inodes = 256,
+      .num_data_blocks = 1024,
+      .iterations = 1000,
+      .dir = "/tmp",
+      .num_fills = 0,
+  };
+
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    if (strcmp(argv[i], "-r") == 0) {
+      i++;
+      if (strcmp(argv[i], "0") == 0) {
+        cfg.raid_mode = RAID_0;
+      } else if (strcmp(argv[i], "1") == 0) {
+        cfg.raid_mode = RAID_1;
+      } else if (strcmp(argv[i], "1v") == 0) {
+        cfg.raid_mode = RAID_2;
+      } else if (strcmp(argv[i], "5") == 0) {
+        cfg.raid_mode = RAID_5;
+      } else if (strcmp(argv[i], "10") == 0) {
+        cfg.raid_mode = RAID_10;
+      } else {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[i], "-c") == 0) {
+      cfg.chunk_blocks = atoi(argv[++i]) / BLOCK_SIZE;
+    } else if (strcmp(argv[i], "-m") == 0) {
+      cfg.meta_copies = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-n") == 0) {
+      cfg.num_disks = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-i") == 0) {
+      cfg.num_inodes = ROUND32(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "-b") == 0) {
+      cfg.num_data_blocks = ROUND32(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "-w") == 0) {
+      cfg.window_bytes = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-N") == 0) {
+      cfg.iterations = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-f") == 0 && cfg.num_fills < BENCH_MAX_FILLS) {
+      cfg.fills[cfg.num_fills++] = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-d") == 0) {
+      cfg.dir = argv[++i];
+    } else {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (cfg.num_disks < 2 || cfg.num_disks > MAX_DISKS || cfg.iterations <= 0 || cfg.chunk_blocks < 1 ||
+      (cfg.chunk_blocks > 1 && cfg.raid_mode != RAID_0) || cfg.meta_copies < 0 ||
+      (cfg.meta_copies && cfg.meta_copies < cfg.num_disks && cfg.raid_mode != RAID_0) ||
+      cfg.num_inodes <= 0 || cfg.num_data_blocks <= 0 || cfg.window_bytes % sysconf(_SC_PAGESIZE) != 0) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  cfg.num_data_blocks = (cfg.num_data_blocks + cfg.chunk_blocks - 1) / cfg.chunk_blocks * cfg.chunk_blocks;
+  if (cfg.num_fills == 0) {
+    cfg.fills[cfg.num_fills++] = 0;
+    cfg.fills[cfg.num_fills++] = 50;
+    cfg.fills[cfg.num_fills++] = 90;
+  }
+
+  char *paths[MAX_DISKS];
+  for (int i = 0; i < cfg.num_disks; i++) {
+    paths[i] = malloc(PATH_MAX);
+    snprintf(paths[i], PATH_MAX, "%s/wfs-bench-disk%d.img", cfg.dir, i);
+  }
+
+  printf("raid_mode=%d disks=%d chunk_blocks=%d meta_copies=%d inodes=%zu blocks=%zu window_bytes=%zu\n",
+         cfg.raid_mode, cfg.num_disks, cfg.chunk_blocks, cfg.meta_copies, cfg.num_inodes, cfg.num_data_blocks,
+         cfg.window_bytes);
+  for (int i = 0; i < cfg.num_fills; i++) {
+    run_fill_level(&cfg, paths, cfg.fills[i]);
+  }
+
+  for (int i = 0; i < cfg.num_disks; i++) {
+    unlink(paths[i]);
+    free(paths[i]);
+  }
+  return 0;
+}
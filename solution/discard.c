@@ -0,0 +1,179 @@
+#include "discard.h"
+#include "engine.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+//The flusher wakes this often to notice a stop request, and flushes every DISCARD_INTERVAL_US
+#define DISCARD_TICK_US 100000
+#define DISCARD_INTERVAL_US 1000000
+
+static int test_bit(const char *bits, size_t bit) {
+  return bits[bit / 8] & (1 << (bit % 8));
+}
+
+//Whether block local holds nothing on any of the disks it goes with
+static int local_free(struct wfs_ctx *ctx, const int *disks, int num_copies, size_t local) {
+  for (int copy = 0; copy < num_copies; copy++) {
+    int holder = ctx->layout->bitmap_disk(ctx, disks[copy]);
+    if (test_bit(DISK_PTR(ctx, holder, DATA_BITMAP_OFFSET(ctx)), local)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+//Punch the page-aligned part of every free run among blocks [start, end) of one disk.
+//Returns the bytes punched.
+static size_t punch_free_runs(struct wfs_ctx *ctx, int disk, size_t start, size_t end) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  int disks[MAX_DISKS];
+  int num_copies = ctx->layout->copies(ctx, disk, disks);
+  size_t punched = 0;
+  size_t local = start;
+  while (local < end && ctx->discard.enabled) {
+    if (!local_free(ctx, disks, num_copies, local)) {
+      local++;
+      continue;
+    }
+    size_t run_end = local + 1;
+    while (run_end < end && local_free(ctx, disks, num_copies, run_end)) {
+      run_end++;
+    }
+    off_t first = (DATA_BLOCK_OFFSET(ctx, local) + page_size - 1) / page_size * page_size;
+    off_t last = DATA_BLOCK_OFFSET(ctx, run_end) / page_size * page_size;
+    if (last > first) {
+      //A crash partway would leave the copies of a free range differing
+      if (num_copies > 1) {
+        intent_mark(ctx, first, last - first);
+      }
+      if (mapping_punch(ctx, disk, first, last - first) == 0) {
+        punched += last - first;
+        STATS_ADD(ctx->stats.discard_punches, 1);
+        STATS_ADD(ctx->stats.discard_bytes, last - first);
+      } else if (errno == EOPNOTSUPP) {
+        fprintf(stderr, "Disk %d cannot punch holes: discard turned off\n", disk);
+        ctx->discard.enabled = 0;
+      }
+    }
+    local = run_end;
+  }
+  return punched;
+}
+
+static int compare_offsets(const void *a, const void *b) {
+  return (*(const off_t *)a > *(const off_t *)b) - (*(const off_t *)a < *(const off_t *)b);
+}
+
+//Queue a block the allocator just freed. Caller holds ctx->lock.
+void discard_block(struct wfs_ctx *ctx, off_t block_id) {
+  struct wfs_discard *discard = &ctx->discard;
+  if (!discard->enabled) {
+    return;
+  }
+  discard->pending[discard->count++] = block_id;
+  if (discard->count == WFS_DISCARD_BATCH) {
+    discard_flush(ctx);
+  }
+}
+
+//Punch what the queued blocks freed, together with any free blocks sharing their pages.
+//Caller holds ctx->lock. Returns the bytes punched.
+size_t discard_flush(struct wfs_ctx *ctx) {
+  struct wfs_discard *discard = &ctx->discard;
+  if (!discard->count) {
+    return 0;
+  }
+  long page_blocks = MAX(sysconf(_SC_PAGESIZE) / BLOCK_SIZE, 1);
+  off_t locals[MAX_DISKS][WFS_DISCARD_BATCH];
+  int counts[MAX_DISKS] = {0};
+  for (int i = 0; i < discard->count; i++) {
+    int disk;
+    off_t local = calculate_raid_disk(ctx, &disk, discard->pending[i]);
+    int disks[MAX_DISKS];
+    int num_copies = ctx->layout->copies(ctx, disk, disks);
+    for (int copy = 0; copy < num_copies; copy++) {
+      locals[disks[copy]][counts[disks[copy]]++] = local;
+    }
+  }
+  discard->count = 0;
+
+  size_t punched = 0;
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    qsort(locals[disk], counts[disk], sizeof(off_t), compare_offsets);
+    //Widen each block to the blocks that can share a page with it, then merge overlapping spans
+    size_t span_start = 0;
+    size_t span_end = 0;
+    for (int i = 0; i <= counts[disk]; i++) {
+      size_t start = 0;
+      size_t end = 0;
+      if (i < counts[disk]) {
+        start = locals[disk][i] >= page_blocks ? locals[disk][i] - page_blocks + 1 : 0;
+        end = MIN(locals[disk][i] + page_blocks, ctx->sb.num_data_blocks);
+        if (start <= span_end && span_end > span_start) {
+          span_end = MAX(span_end, end);
+          continue;
+        }
+      }
+      if (span_end > span_start) {
+        punched += punch_free_runs(ctx, disk, span_start, span_end);
+      }
+      span_start = start;
+      span_end = end;
+    }
+  }
+  return punched;
+}
+
+//fstrim: punch every page-aligned free run of the data region. Caller holds ctx->lock.
+//Returns the bytes punched.
+size_t discard_trim(struct wfs_ctx *ctx) {
+  size_t punched = 0;
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    punched += punch_free_runs(ctx, disk, 0, ctx->sb.num_data_blocks);
+  }
+  return punched;
+}
+
+static void *flusher_thread(void *arg) {
+  struct wfs_ctx *ctx = arg;
+  long waited = 0;
+  while (!__atomic_load_n(&ctx->discard.flusher_stop, __ATOMIC_ACQUIRE)) {
+    usleep(DISCARD_TICK_US);
+    waited += DISCARD_TICK_US;
+    if (waited >= DISCARD_INTERVAL_US) {
+      pthread_mutex_lock(&ctx->lock);
+      discard_flush(ctx);
+      pthread_mutex_unlock(&ctx->lock);
+      waited = 0;
+    }
+  }
+  return NULL;
+}
+
+//Start flushing the queue in the background; a no-op unless discard is on
+int discard_start_flusher(struct wfs_ctx *ctx) {
+  if (!ctx->discard.enabled || ctx->discard.flusher_running || ctx->missing_disk >= 0) {
+    return 0;
+  }
+  if (pthread_create(&ctx->discard.flusher_thread, NULL, flusher_thread, ctx) != 0) {
+    return -1;
+  }
+  ctx->discard.flusher_running = 1;
+  return 0;
+}
+
+//Stop the flusher and punch whatever is still queued
+void discard_close(struct wfs_ctx *ctx) {
+  struct wfs_discard *discard = &ctx->discard;
+  if (discard->flusher_running) {
+    __atomic_store_n(&discard->flusher_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(discard->flusher_thread, NULL);
+    discard->flusher_running = 0;
+  }
+  discard_flush(ctx);
+}
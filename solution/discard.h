@@ -0,0 +1,41 @@
+#ifndef DISCARD_H
+#define DISCARD_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+  Discard of freed data blocks. With `wfs --discard` every block the
+  allocator frees is queued, and the queue is flushed when it fills, once
+  a second in the background, and at unmount. A flush sorts the blocks by
+  disk, widens each stretch to the pages around it and punches a hole in
+  the image for every page-aligned run that is still free, so the host
+  gets the space back and a run of small frees becomes one punch. Blocks
+  reallocated since they were queued are skipped by the same check.
+  Mirrored copies are punched together; RAID 5 only punches rows with no
+  block in use, parity included, so parity never has to be rewritten.
+  discard_trim does the same for every free run of the data region.
+*/
+
+#define WFS_DISCARD_BATCH 256
+
+struct wfs_discard {
+  int enabled;
+  off_t pending[WFS_DISCARD_BATCH]; //freed block ids
+  int count;
+  pthread_t flusher_thread;
+  int flusher_running;
+  int flusher_stop;
+};
+
+struct wfs_ctx;
+
+void discard_block(struct wfs_ctx *ctx, off_t block_id);
+size_t discard_flush(struct wfs_ctx *ctx);
+size_t discard_trim(struct wfs_ctx *ctx);
+int discard_start_flusher(struct wfs_ctx *ctx);
+void discard_close(struct wfs_ctx *ctx);
+
+#endif
@@ -0,0 +1,1853 @@
+#include "engine.h"
+#include "lz.h"
+#include "utility.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+//Inode blocks zeroed per lock hold, and the pause between batches, for the background pass
+#define LAZY_INIT_BATCH 256
+#define LAZY_INIT_INTERVAL_US 10000
+
+//Operations related to the context:
+
+//Update the superblock flags on every disk
+static void write_sb_flags(struct wfs_ctx *ctx, uint32_t flags) {
+    ctx->sb.flags = flags;
+    for (int disk = 0; disk < ctx->num_disks; disk++) {
+        ((struct wfs_sb *)DISK_PTR(ctx, disk, 0))->flags = flags;
+        IO_WRITE(ctx, disk, offsetof(struct wfs_sb, flags), sizeof(flags));
+    }
+}
+
+//mkfs -L skipped the data bitmaps; nothing can have been allocated before the first mount
+static void init_data_bitmaps(struct wfs_ctx *ctx) {
+    size_t bitmap_size = (ctx->sb.num_data_blocks + 7) / 8;
+    intent_mark(ctx, DATA_BITMAP_OFFSET(ctx), bitmap_size);
+    for (int disk = 0; disk < ctx->num_disks; disk++) {
+        memset(DISK_PTR(ctx, disk, DATA_BITMAP_OFFSET(ctx)), 0, bitmap_size);
+        IO_WRITE(ctx, disk, DATA_BITMAP_OFFSET(ctx), bitmap_size);
+    }
+    write_sb_flags(ctx, ctx->sb.flags & ~WFS_SB_DBITMAP_UNINIT);
+}
+
+static void close_fds(int *fds) {
+    for (int disk = 0; disk < MAX_DISKS; disk++) {
+        if (fds[disk] >= 0) {
+            close(fds[disk]);
+            fds[disk] = -1;
+        }
+    }
+}
+
+/*
+  Every disk must carry the UUID of the filesystem in ctx->sb, and a disk
+  more than one generation behind it missed a whole write-intent update
+  or unmount, so none of its copies can be trusted. A stale mirror is
+  resynced from the fresh copies when intent_open runs; a stale RAID 5
+  disk is left out and read back from parity. RAID 0 has nothing to
+  rebuild one from. Only the superblocks are read. Returns the mask of
+  stale disks, or -1 when the filesystem cannot be mounted with them.
+*/
+static int check_generations(const struct wfs_ctx *ctx, const int *fds, const struct wfs_sb *disk_sbs,
+                             const char **paths) {
+    const struct wfs_sb *sb = &ctx->sb;
+    int stale = 0, num_stale = 0, missing = 0;
+    for (int disk = 0; disk < MAX_DISKS; disk++) {
+        if (fds[disk] < 0) {
+            missing += disk < sb->total_disks;
+            continue;
+        }
+        if (memcmp(disk_sbs[disk].fs_uuid, sb->fs_uuid, WFS_UUID_BYTES) != 0) {
+            fprintf(stderr, "%s belongs to another filesystem\n", paths[disk]);
+            return -1;
+        }
+        if (disk_sbs[disk].generation + 1 < sb->generation) {
+            fprintf(stderr, "%s is stale: generation %llu, filesystem at %llu\n", paths[disk],
+                    (unsigned long long)disk_sbs[disk].generation, (unsigned long long)sb->generation);
+            stale |= 1 << disk;
+            num_stale++;
+        }
+    }
+    if (!stale) {
+        return 0;
+    }
+    int lost_pair = 0;
+    for (int disk = 0; sb->raid_mode == RAID_10 && disk < MAX_DISKS; disk += 2) {
+        lost_pair |= ((stale >> disk) & 3) == 3;
+    }
+    if (sb->raid_mode == RAID_0 || missing || lost_pair || (sb->raid_mode == RAID_5 && num_stale > 1)) {
+        fprintf(stderr, "No fresh copy of the stale disks' data: refusing to mount\n");
+        return -1;
+    }
+    return stale;
+}
+
+//Open and map every disk image whole
+int wfs_ctx_open(struct wfs_ctx *ctx, char **disk_paths, int num_disks) {
+    return wfs_ctx_open_windowed(ctx, disk_paths, num_disks, 0, 0);
+}
+
+//Open and map every disk image, placing each at the index recorded in its superblock.
+//Any filesystem but RAID 0 may be opened with one disk missing; it then runs degraded and read-only.
+//A nonzero window_bytes maps data on demand in at most max_windows windows (see mapping.h).
+int wfs_ctx_open_windowed(struct wfs_ctx *ctx, char **disk_paths, int num_disks,
+                          size_t window_bytes, int max_windows) {
+    memset(ctx, 0, sizeof(*ctx));
+    pthread_mutex_init(&ctx->lock, NULL);
+    ctx->missing_disk = -1;
+    ctx->mapping.window_bytes = window_bytes;
+    ctx->mapping.max_windows = max_windows;
+    for (int disk = 0; disk < MAX_DISKS; disk++) {
+        ctx->mapping.fds[disk] = -1;
+    }
+    //Sized for the largest array until the superblock says how many disks there are
+    ctx->disk_mmaps = calloc(MAX_DISKS, sizeof(void *));
+    ctx->disk_sizes = calloc(MAX_DISKS, sizeof(size_t));
+    ctx->num_disks = MAX_DISKS;
+    if (!ctx->disk_mmaps || !ctx->disk_sizes) {
+        perror("Error allocating memory for disk mappings or sizes");
+        wfs_ctx_close(ctx);
+        return -1;
+    }
+
+    //Every superblock is read before anything is mapped, so a disk that is not fit to use is never touched
+    int fds[MAX_DISKS];
+    size_t sizes[MAX_DISKS];
+    struct wfs_sb disk_sbs[MAX_DISKS] = {0};
+    const char *paths[MAX_DISKS];
+    for (int disk = 0; disk < MAX_DISKS; disk++) {
+        fds[disk] = -1;
+    }
+    for (int i = 0; i < num_disks; i++) {
+        int fd = open(disk_paths[i], O_RDWR);
+        if (fd < 0) {
+            perror("Error opening disk file");
+            close_fds(fds);
+            wfs_ctx_close(ctx);
+            return -1;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            perror("Error getting disk size");
+            close(fd);
+            close_fds(fds);
+            wfs_ctx_close(ctx);
+            return -1;
+        }
+
+        struct wfs_sb disk_sb;
+        if (pread(fd, &disk_sb, sizeof(disk_sb), 0) != sizeof(disk_sb) ||
+            disk_sb.total_disks < 1 || disk_sb.disk_index < 0 || disk_sb.disk_index >= MAX_DISKS ||
+            fds[disk_sb.disk_index] >= 0) {
+            fprintf(stderr, "Invalid or duplicate disk index in %s\n", disk_paths[i]);
+            close(fd);
+            close_fds(fds);
+            wfs_ctx_close(ctx);
+            return -1;
+        }
+        int disk_index = disk_sb.disk_index;
+        grow_fixup_superblock(&disk_sb);
+        intent_fixup_superblock(&disk_sb);
+        fds[disk_index] = fd;
+        sizes[disk_index] = st.st_size;
+        disk_sbs[disk_index] = disk_sb;
+        paths[disk_index] = disk_paths[i];
+        if (i == 0) {
+            ctx->meta_disk = disk_index;
+        }
+    }
+
+    //The freshest superblock is the filesystem's; a grow stopped partway through updating
+    //the superblocks left the larger disk count on some of the same generation
+    for (int disk = 0; disk < MAX_DISKS; disk++) {
+        const struct wfs_sb *fresh = &disk_sbs[ctx->meta_disk];
+        if (fds[disk] >= 0 && (disk_sbs[disk].generation > fresh->generation ||
+                               (disk_sbs[disk].generation == fresh->generation &&
+                                disk_sbs[disk].total_disks > fresh->total_disks))) {
+            ctx->meta_disk = disk;
+        }
+    }
+    ctx->sb = disk_sbs[ctx->meta_disk];
+    int stale = check_generations(ctx, fds, disk_sbs, paths);
+    if (stale < 0) {
+        close_fds(fds);
+        wfs_ctx_close(ctx);
+        return -1;
+    }
+    //A RAID 5 disk's data bitmap has no copy to resync it from, so a stale one runs as missing
+    if (stale && ctx->sb.raid_mode == RAID_5) {
+        int disk = __builtin_ctz(stale);
+        close(fds[disk]);
+        fds[disk] = -1;
+        stale = 0;
+    }
+    ctx->intent.stale_disks = stale;
+
+    for (int disk = 0; disk < MAX_DISKS; disk++) {
+        if (fds[disk] < 0) {
+            continue;
+        }
+        void *map = mapping_open_disk(ctx, disk, fds[disk], sizes[disk], disk_sbs[disk].d_blocks_ptr);
+        fds[disk] = -1;
+        if (!map) {
+            close_fds(fds);
+            wfs_ctx_close(ctx);
+            return -1;
+        }
+        ctx->disk_sizes[disk] = sizes[disk];
+        ctx->disk_mmaps[disk] = map;
+    }
+
+    ctx->layout = layout_select(&ctx->sb);
+    if (!ctx->layout) {
+        fprintf(stderr, "Unknown RAID mode %d\n", ctx->sb.raid_mode);
+        wfs_ctx_close(ctx);
+        return -1;
+    }
+    int total_disks = ctx->sb.total_disks;
+    int missing = -1;
+    for (int disk = 0; disk < MAX_DISKS; disk++) {
+        if (disk >= total_disks && ctx->disk_mmaps[disk]) {
+            total_disks = -1;
+            break;
+        }
+        if (disk < total_disks && !ctx->disk_mmaps[disk]) {
+            missing = missing < 0 ? disk : MAX_DISKS;
+        }
+    }
+    if (total_disks < 1 || total_disks > MAX_DISKS ||
+        (missing >= 0 && (ctx->sb.raid_mode == RAID_0 || missing == MAX_DISKS))) {
+        fprintf(stderr, "Filesystem needs its %d disks, %d given\n", ctx->sb.total_disks, num_disks);
+        wfs_ctx_close(ctx);
+        return -1;
+    }
+    ctx->num_disks = total_disks;
+    ctx->meta_copies = meta_copies_of(&ctx->sb, total_disks);
+    if (missing >= 0) {
+        ctx->missing_disk = missing;
+        fprintf(stderr, "Disk %d is missing: running degraded and read-only\n", missing);
+    }
+    grow_open(ctx);
+    if (tier_open(ctx) != 0) {
+        perror("Error allocating the tier heat table");
+        wfs_ctx_close(ctx);
+        return -1;
+    }
+
+    intent_open(ctx);
+    if ((ctx->sb.flags & WFS_SB_DBITMAP_UNINIT) && missing < 0) {
+        init_data_bitmaps(ctx);
+    }
+    mapping_release(ctx);
+    return 0;
+}
+
+//Unmap the disks and release the context
+void wfs_ctx_close(struct wfs_ctx *ctx) {
+    if (ctx->lazy_init_running) {
+        __atomic_store_n(&ctx->lazy_init_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(ctx->lazy_init_thread, NULL);
+        ctx->lazy_init_running = 0;
+    }
+    pio_close(ctx);
+    grow_close(ctx);
+    tier_close(ctx);
+    discard_close(ctx);
+    intent_close(ctx);
+    mapping_close(ctx);
+    free(ctx->disk_mmaps);
+    free(ctx->disk_sizes);
+    ctx->disk_mmaps = NULL;
+    ctx->disk_sizes = NULL;
+    pthread_mutex_destroy(&ctx->lock);
+}
+
+//Zero one batch of the inode table mkfs left uninitialised, skipping allocated inodes.
+//Caller holds ctx->lock. Returns 1 while work remains.
+int wfs_lazy_init_step(struct wfs_ctx *ctx, size_t max_inodes) {
+    if (!(ctx->sb.flags & WFS_SB_ITABLE_UNINIT)) {
+        return 0;
+    }
+
+    size_t end = MIN(ctx->lazy_init_cursor + max_inodes, ctx->sb.num_inodes);
+    intent_mark(ctx, INODE_OFFSET(ctx, ctx->lazy_init_cursor), (end - ctx->lazy_init_cursor) * BLOCK_SIZE);
+    for (size_t i = ctx->lazy_init_cursor; i < end; i++) {
+        if (inode_allocated(ctx, i)) {
+            continue;
+        }
+        for (int copy = 0; copy < ctx->meta_copies; copy++) {
+            int disk = meta_copy_disk(ctx, INODE_OFFSET(ctx, i), copy);
+            memset(DISK_PTR(ctx, disk, INODE_OFFSET(ctx, i)), 0, BLOCK_SIZE);
+            IO_WRITE(ctx, disk, INODE_OFFSET(ctx, i), BLOCK_SIZE);
+        }
+    }
+    ctx->lazy_init_cursor = end;
+
+    if (end < ctx->sb.num_inodes) {
+        return 1;
+    }
+    write_sb_flags(ctx, ctx->sb.flags & ~WFS_SB_ITABLE_UNINIT);
+    return 0;
+}
+
+static void *lazy_init_thread(void *arg) {
+    struct wfs_ctx *ctx = arg;
+    int more = 1;
+    while (more && !__atomic_load_n(&ctx->lazy_init_stop, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&ctx->lock);
+        more = wfs_lazy_init_step(ctx, LAZY_INIT_BATCH);
+        mapping_release(ctx);
+        pthread_mutex_unlock(&ctx->lock);
+        if (more) {
+            usleep(LAZY_INIT_INTERVAL_US);
+        }
+    }
+    return NULL;
+}
+
+//Finish mkfs's deferred inode table work in the background; a no-op once it is done
+int wfs_lazy_init_start(struct wfs_ctx *ctx) {
+    if (!(ctx->sb.flags & WFS_SB_ITABLE_UNINIT) || ctx->lazy_init_running || ctx->missing_disk >= 0) {
+        return 0;
+    }
+    if (pthread_create(&ctx->lazy_init_thread, NULL, lazy_init_thread, ctx) != 0) {
+        return -1;
+    }
+    ctx->lazy_init_running = 1;
+    return 0;
+}
+
+//Account one access to a mapped disk in the stats and, when enabled, the block trace
+void account_io(struct wfs_ctx *ctx, int disk, off_t offset, size_t bytes, int op) {
+    if (op == TRACE_OP_READ) {
+        STATS_ADD(ctx->stats.disk_bytes_read[disk], bytes);
+    } else {
+        STATS_ADD(ctx->stats.disk_bytes_written[disk], bytes);
+    }
+    if (ctx->trace) {
+        trace_record(ctx->trace, disk, offset, bytes, op);
+    }
+}
+
+//Operations related to data-blocks:
+
+//Pointer to the primary copy of a data block, accounted as a block read.
+//A block of a missing RAID 5 disk is rebuilt into a per-thread buffer valid until the next call.
+char *data_block_ptr(struct wfs_ctx *ctx, off_t block_index) {
+    int disk_idx;
+    off_t local_block_idx = ctx->layout->map(ctx, &disk_idx, block_index);
+    disk_idx = ctx->layout->read_disk(ctx, disk_idx, local_block_idx);
+    if (disk_idx == ctx->missing_disk) {
+        static _Thread_local char rebuilt[BLOCK_SIZE];
+        ctx->layout->reconstruct(ctx, rebuilt, local_block_idx);
+        return rebuilt;
+    }
+    IO_READ(ctx, disk_idx, DATA_BLOCK_OFFSET(ctx, local_block_idx), BLOCK_SIZE);
+    return DISK_PTR(ctx, disk_idx, DATA_BLOCK_OFFSET(ctx, local_block_idx));
+}
+
+//Reading a data block
+void read_data_block(struct wfs_ctx *ctx, void *block, size_t block_index) {
+    memcpy(block, data_block_ptr(ctx, block_index), BLOCK_SIZE);
+}
+
+//Writing a data block
+void write_data_block(struct wfs_ctx *ctx, const void *block, size_t block_index) {
+    int target_disk_idx;
+    off_t local_block_idx = ctx->layout->map(ctx, &target_disk_idx, block_index);
+    ctx->layout->write_range(ctx, target_disk_idx, local_block_idx, 0, block, BLOCK_SIZE);
+}
+
+//size may cover a run of blocks (see flush_block_writes)
+static int write_to_data_block(struct wfs_ctx *ctx, off_t block_num, const char *buf, size_t size, size_t offset) {
+    int disk_index;
+    off_t block_index_within_disk = ctx->layout->map(ctx, &disk_index, block_num);
+    ctx->layout->write_range(ctx, disk_index, block_index_within_disk, offset, buf, size);
+    return size;
+}
+
+//Copy one block's worth of file data out, voting across mirrors in raid1v
+//and rebuilding blocks of a missing disk in raid5
+static void read_from_data_block(struct wfs_ctx *ctx, off_t block_num, char *buf, size_t size, size_t offset) {
+    int disk_index;
+    off_t block_index_within_disk = ctx->layout->map(ctx, &disk_index, block_num);
+    ctx->layout->read_range(ctx, disk_index, block_index_within_disk, offset, size, buf);
+}
+
+//For indirect block:
+void set_indirect_block(struct wfs_ctx *ctx, off_t block_num) {
+    off_t indirect_block[BLOCK_SIZE / sizeof(off_t)];
+    memset(indirect_block, -1, BLOCK_SIZE);
+    write_data_block(ctx, indirect_block, block_num);
+}
+
+static int test_bit(const char *bits, off_t bit) {
+    return bits[bit / 8] & (1 << (bit % 8));
+}
+
+//Set (value 1) or clear the data bitmap bits of count block ids, in place on the disks holding
+//them, and copy the bytes that changed to the disks that mirror those
+static void put_data_bits(struct wfs_ctx *ctx, const off_t *ids, int count, int value) {
+    off_t first[MAX_DISKS], last[MAX_DISKS];
+    for (int disk = 0; disk < MAX_DISKS; disk++) {
+        first[disk] = -1;
+        last[disk] = -1;
+    }
+    for (int i = 0; i < count; i++) {
+        int disk;
+        off_t byte = ctx->layout->map(ctx, &disk, ids[i]) / 8;
+        first[disk] = first[disk] < 0 ? byte : MIN(first[disk], byte);
+        last[disk] = MAX(last[disk], byte);
+    }
+    if (ctx->layout->data_copies) {
+        for (int disk = 0; disk < ctx->num_disks; disk++) {
+            if (first[disk] >= 0) {
+                intent_mark(ctx, DATA_BITMAP_OFFSET(ctx) + first[disk], last[disk] - first[disk] + 1);
+            }
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        int disk;
+        off_t local = ctx->layout->map(ctx, &disk, ids[i]);
+        char *byte = DISK_PTR(ctx, disk, DATA_BITMAP_OFFSET(ctx) + local / 8);
+        *byte = value ? *byte | (1 << (local % 8)) : *byte & ~(1 << (local % 8));
+    }
+    for (int disk = 0; disk < ctx->num_disks; disk++) {
+        if (first[disk] < 0) {
+            continue;
+        }
+        off_t offset = DATA_BITMAP_OFFSET(ctx) + first[disk];
+        size_t size = last[disk] - first[disk] + 1;
+        IO_WRITE(ctx, disk, offset, size);
+        ctx->layout->replicate(ctx, DISK_PTR(ctx, disk, offset), offset, size, disk);
+    }
+}
+
+//Allocate count data blocks in one pass, in block id order so consecutive allocations fill
+//a RAID 0 chunk before moving to the next disk. The bitmaps are probed where they are mapped
+//and only the bytes of the bits taken are written back.
+//All or nothing: returns 0 with the ids in ids[], or -ENOSPC with nothing allocated.
+int get_data_blocks(struct wfs_ctx *ctx, int count, off_t *ids) {
+    return get_tier_blocks(ctx, count, ids, -1, 0);
+}
+
+//get_data_blocks preferring blocks of one tier (see tier.h): those come first, then, unless
+//strict, the other tier's. A tier of -1, or a layout that cannot place by tier, takes any block.
+//Every id below ctx->free_block_hint is in use, so the scan starts there.
+int get_tier_blocks(struct wfs_ctx *ctx, int count, off_t *ids, int tier, int strict) {
+    const char *bitmaps[MAX_DISKS] = {0};
+    int readers[MAX_DISKS];
+    off_t first[MAX_DISKS], last[MAX_DISKS];
+    int found = 0;
+    int ret = 0;
+
+    if (!ctx->tier.placement) {
+        tier = -1;
+    }
+    off_t num_ids = num_block_ids(ctx);
+    off_t start = MIN(ctx->free_block_hint, num_ids);
+    int passes = tier < 0 || strict ? 1 : 2;
+    for (int pass = 0; pass < passes && found < count; pass++) {
+        for (off_t id = start; id < num_ids && found < count; id++) {
+            int disk;
+            off_t block = ctx->layout->map(ctx, &disk, id);
+            //The first pass takes the wanted tier only, the second the rest
+            if (tier >= 0 && (ctx->tier.block_tier[disk] == tier) != (pass == 0)) {
+                continue;
+            }
+            if (ctx->layout->allocates && !ctx->layout->allocates(ctx, id, disk, block)) {
+                continue;
+            }
+            if (!bitmaps[disk]) {
+                readers[disk] = ctx->layout->bitmap_disk(ctx, disk);
+                bitmaps[disk] = DISK_PTR(ctx, readers[disk], DATA_BITMAP_OFFSET(ctx));
+                first[disk] = block / 8;
+                last[disk] = block / 8;
+            }
+            first[disk] = MIN(first[disk], block / 8);
+            last[disk] = MAX(last[disk], block / 8);
+            STATS_ADD(ctx->stats.block_alloc_probes, 1);
+            if (!test_bit(bitmaps[disk], block)) {
+                ids[found++] = id;
+            }
+        }
+    }
+    for (int disk = 0; disk < ctx->num_disks; disk++) {
+        if (bitmaps[disk]) {
+            IO_READ(ctx, readers[disk], DATA_BITMAP_OFFSET(ctx) + first[disk], last[disk] - first[disk] + 1);
+        }
+    }
+
+    if (found < count) {
+        if (tier < 0) {
+            ctx->free_block_hint = found ? ids[0] : num_ids;
+        }
+        ret = -ENOSPC;
+        STATS_ADD(ctx->stats.block_alloc_failures, 1);
+    } else {
+        ctx->layout->allocated(ctx, ids, found);
+        put_data_bits(ctx, ids, found, 1);
+        if (tier < 0 && found) {
+            ctx->free_block_hint = ids[found - 1] + 1;
+        }
+        STATS_ADD(ctx->stats.blocks_allocated, found);
+    }
+    return ret;
+}
+
+//Get free data block
+off_t get_data_block(struct wfs_ctx *ctx) {
+    off_t id;
+    int ret = get_data_blocks(ctx, 1, &id);
+    return ret < 0 ? ret : id;
+}
+
+//Free the data block:
+void clear_data_block(struct wfs_ctx *ctx, off_t index) {
+    if (index < 0 || index >= num_block_ids(ctx)) {
+        return;
+    }
+
+    put_data_bits(ctx, &index, 1, 0);
+    ctx->free_block_hint = MIN(ctx->free_block_hint, index);
+    STATS_ADD(ctx->stats.blocks_freed, 1);
+    discard_block(ctx, index);
+}
+
+//The directory listing cache only ever holds names seen in a readdir since the last change
+static void dir_cache_drop(struct wfs_ctx *ctx) {
+    ctx->dir_cache.count = 0;
+    ctx->dir_cache.path_len = 0;
+    ctx->dir_cache.path[0] = '\0';
+}
+
+//Inode of path if it names an entry of the cached directory, or -1 to walk as usual
+static int dir_cache_lookup(struct wfs_ctx *ctx, const char *path) {
+    struct wfs_dir_cache *cache = &ctx->dir_cache;
+    if (cache->count == 0 || strncmp(path, cache->path, cache->path_len) != 0) {
+        return -1;
+    }
+    const char *name = path + cache->path_len;
+    //"/" is its own separator; any other directory needs one after it
+    if (cache->path_len > 1) {
+        if (*name != '/') {
+            return -1;
+        }
+        name++;
+    }
+    if (*name == '\0' || strchr(name, '/')) {
+        return -1;
+    }
+    for (int i = 0; i < cache->count; i++) {
+        if (strcmp(cache->entries[i].name, name) == 0) {
+            return cache->entries[i].num;
+        }
+    }
+    return -1;
+}
+
+//Add the directory entry inside the parent
+int insert_directory_entry(struct wfs_ctx *ctx, struct wfs_inode *dir_inode, int dir_inode_num, const char *entry_name, int file_inode_num) {
+    dir_cache_drop(ctx);
+    off_t block_num = -1;
+    for (int i = 0; i < N_BLOCKS; i++) {
+        if (dir_inode->blocks[i] == -1) {
+            int ret = get_tier_blocks(ctx, 1, &block_num, WFS_TIER_FAST, 0);
+            if (ret < 0) {
+                return ret;
+            }
+            dir_inode->blocks[i] = block_num;
+            struct wfs_dentry new_entry[BLOCK_SIZE / sizeof(struct wfs_dentry)];
+            memset(new_entry, -1, sizeof(new_entry));
+            new_entry[0].num = file_inode_num;
+            strncpy(new_entry[0].name, entry_name, MAX_NAME);
+
+            write_data_block(ctx, new_entry, block_num);
+            write_inode(ctx, dir_inode, dir_inode_num);
+            return 0;
+        }
+
+        const struct wfs_dentry *dir_block = (const struct wfs_dentry *)data_block_ptr(ctx, dir_inode->blocks[i]);
+        for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++) {
+            if (dir_block[j].num == -1) {
+                //Written as a separate entry so RAID 5 still sees the old contents for parity
+                struct wfs_dentry entry = {.num = file_inode_num};
+                strncpy(entry.name, entry_name, MAX_NAME);
+
+                write_to_data_block(ctx, dir_inode->blocks[i], (const char *)&entry, sizeof(entry), j * sizeof(entry));
+                write_inode(ctx, dir_inode, dir_inode_num);
+                return 0;
+            }
+        }
+    }
+    return -ENOSPC;
+}
+
+//Find if directory entry already exists
+int find_duplicate_directory_entry(struct wfs_ctx *ctx, const struct wfs_inode *dir_inode, const char *entry_name) {
+    for (int i = 0; i < N_BLOCKS && dir_inode->blocks[i] != -1; i++) {
+        struct wfs_dentry *entry = (struct wfs_dentry *)data_block_ptr(ctx, dir_inode->blocks[i]);
+
+        for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++) {
+            if (entry[j].num != -1 && strcmp(entry[j].name, entry_name) == 0) {
+                return 0;
+            }
+        }
+    }
+    return -ENOENT;
+}
+
+//Operations related to inode:
+
+//Copies of the inode bitmap and of each inode a filesystem keeps
+int meta_copies_of(const struct wfs_sb *sb, int num_disks) {
+    //Images formatted before the field existed keep their inode bitmap where it would be
+    if (sb->raid_mode == RAID_0 && sb->meta_copies > 0 && (int)sb->meta_copies < num_disks &&
+        sb->i_bitmap_ptr >= (off_t)(offsetof(struct wfs_sb, meta_copies) + sizeof(sb->meta_copies))) {
+        return sb->meta_copies;
+    }
+    return num_disks;
+}
+
+/*
+  Metadata placement. The inode bitmap and table have ctx->meta_copies
+  copies: one per disk unless a RAID 0 mkfs asked for fewer with -m. Then
+  inode i's copies sit on the disks from i % num_disks on and the inode
+  bitmap's on the disks from 0 on, so inode writes spread over the stripe.
+*/
+int meta_copy_disk(const struct wfs_ctx *ctx, off_t offset, int copy) {
+    if (ctx->meta_copies >= ctx->num_disks) {
+        return copy;
+    }
+    size_t key = offset < ctx->sb.i_blocks_ptr ? 0 : (offset - ctx->sb.i_blocks_ptr) / BLOCK_SIZE;
+    return (key + copy) % ctx->num_disks;
+}
+
+//Where metadata at offset is read from: any present disk when all have a copy (a fast one when
+//tagged, see tier_open), else its first copy on a fast disk, else its first copy
+static int meta_read_disk(const struct wfs_ctx *ctx, off_t offset) {
+    if (ctx->meta_copies >= ctx->num_disks) {
+        return ctx->meta_disk;
+    }
+    for (int copy = 0; copy < ctx->meta_copies; copy++) {
+        int disk = meta_copy_disk(ctx, offset, copy);
+        if (tier_of_disk(&ctx->sb, disk) == WFS_TIER_FAST) {
+            return disk;
+        }
+    }
+    return meta_copy_disk(ctx, offset, 0);
+}
+
+//Store [offset, offset + size) of the inode bitmap or table on every present disk with a copy.
+//data may itself point into one of the copies.
+void write_metadata(struct wfs_ctx *ctx, const void *data, off_t offset, size_t size) {
+    for (int copy = 0; copy < ctx->meta_copies; copy++) {
+        int disk = meta_copy_disk(ctx, offset, copy);
+        if (!ctx->disk_mmaps[disk]) {
+            continue;
+        }
+        char *target = DISK_PTR(ctx, disk, offset);
+        if (target != data) {
+            memcpy(target, data, size);
+            IO_WRITE(ctx, disk, offset, size);
+        }
+    }
+}
+
+//Initialise the inode
+void load_inode(struct wfs_ctx *ctx, struct wfs_inode *inode, size_t index) {
+    int disk = meta_read_disk(ctx, INODE_OFFSET(ctx, index));
+    memcpy(inode, DISK_PTR(ctx, disk, INODE_OFFSET(ctx, index)), sizeof(struct wfs_inode));
+    IO_READ(ctx, disk, INODE_OFFSET(ctx, index), sizeof(struct wfs_inode));
+}
+
+//Write inode
+void write_inode(struct wfs_ctx *ctx, const struct wfs_inode *inode, size_t inode_index) {
+    off_t offset = INODE_OFFSET(ctx, inode_index);
+    intent_mark(ctx, offset, sizeof(struct wfs_inode));
+    write_metadata(ctx, inode, offset, sizeof(struct wfs_inode));
+}
+
+//Whether inode i is in use, read from the mapped inode bitmap
+int inode_allocated(struct wfs_ctx *ctx, size_t i) {
+    off_t offset = INODE_BITMAP_OFFSET(ctx) + i / 8;
+    int disk = meta_read_disk(ctx, offset);
+    IO_READ(ctx, disk, offset, 1);
+    return *DISK_PTR(ctx, disk, offset) & (1 << (i % 8));
+}
+
+//Set (value 1) or clear the bit of inode i in every copy of the inode bitmap
+static void put_inode_bit(struct wfs_ctx *ctx, size_t i, int value) {
+    off_t offset = INODE_BITMAP_OFFSET(ctx) + i / 8;
+    char byte = *DISK_PTR(ctx, meta_read_disk(ctx, offset), offset);
+    byte = value ? byte | (1 << (i % 8)) : byte & ~(1 << (i % 8));
+    intent_mark(ctx, offset, 1);
+    write_metadata(ctx, &byte, offset, 1);
+}
+
+//Get the next available inode, scanning the mapped bitmap from ctx->free_inode_hint, below
+//which every inode is in use
+int get_free_inode(struct wfs_ctx *ctx) {
+    int disk = meta_read_disk(ctx, INODE_BITMAP_OFFSET(ctx));
+    const char *inode_bitmap = DISK_PTR(ctx, disk, INODE_BITMAP_OFFSET(ctx));
+    size_t start = ctx->free_inode_hint;
+    for (size_t i = start; i < ctx->sb.num_inodes; i++) {
+            if (!(inode_bitmap[i / 8] & (1 << (i % 8)))) {
+                    IO_READ(ctx, disk, INODE_BITMAP_OFFSET(ctx) + start / 8, i / 8 - start / 8 + 1);
+                    put_inode_bit(ctx, i, 1);
+                    ctx->free_inode_hint = i + 1;
+                    STATS_ADD(ctx->stats.inodes_allocated, 1);
+                    return i;
+            }
+    }
+    IO_READ(ctx, disk, INODE_BITMAP_OFFSET(ctx) + start / 8, (ctx->sb.num_inodes + 7) / 8 - start / 8);
+    ctx->free_inode_hint = ctx->sb.num_inodes;
+    STATS_ADD(ctx->stats.inode_alloc_failures, 1);
+    return -ENOSPC;
+}
+
+//Initialise inode
+int setup_inode(struct wfs_ctx *ctx, mode_t mode, mode_t type_flag) {
+    int inode_num = get_free_inode(ctx);
+    if (inode_num < 0) {
+        return inode_num;
+    }
+
+    struct wfs_inode new_inode = {
+            .num = inode_num,
+            .mode = mode | type_flag,
+            .nlinks = (type_flag == S_IFDIR) ? 2 : 1,
+            .size = 0,
+            .uid = getuid(),
+            .gid = getgid(),
+            .atim = time(NULL),
+            .mtim = time(NULL),
+            .ctim = time(NULL),
+            .flags = (type_flag == S_IFREG && ctx->compress_new_files) ? WFS_INODE_COMPRESSED : 0,
+        };
+
+    for (int i = 0; i < N_BLOCKS; i++) {
+        new_inode.blocks[i] = -1;
+    }
+
+    write_inode(ctx, &new_inode, inode_num);
+    return inode_num;
+}
+
+//Clear the inode
+void free_inode(struct wfs_ctx *ctx, int inode_index) {
+    put_inode_bit(ctx, inode_index, 0);
+    ctx->free_inode_hint = MIN(ctx->free_inode_hint, (size_t)inode_index);
+    STATS_ADD(ctx->stats.inodes_freed, 1);
+}
+
+//Check the directory inside the inode
+int find_dir_entry_in_inode(struct wfs_ctx *ctx, int parent_inode_num, const char *name) {
+    struct wfs_inode parent_inode;
+    load_inode(ctx, &parent_inode, parent_inode_num);
+
+    for (int i = 0; i < N_BLOCKS; i++) {
+        if (parent_inode.blocks[i] == -1) {
+            continue;
+        }
+
+        size_t num_entries = BLOCK_SIZE / sizeof(struct wfs_dentry);
+        const struct wfs_dentry *entry = (const struct wfs_dentry *)data_block_ptr(ctx, parent_inode.blocks[i]);
+
+        for (size_t j = 0; j < num_entries; j++) {
+            if (entry[j].num != -1){
+                if (strcmp(entry[j].name, name) == 0) {
+                    return entry[j].num;
+                }
+            }
+        }
+    }
+    return -ENOENT;
+}
+
+//Remove dir entry
+int delete_directory_entry(struct wfs_ctx *ctx, int parent_inode_id, const char *entry_name) {
+    dir_cache_drop(ctx);
+    struct wfs_inode parent_node;
+    load_inode(ctx, &parent_node, parent_inode_id);
+
+    for (int block_idx = 0; block_idx < N_BLOCKS; block_idx++) {
+        if (parent_node.blocks[block_idx] == -1) {
+            continue;
+        }
+
+        size_t entries_per_block = BLOCK_SIZE / sizeof(struct wfs_dentry);
+        int raid_disk_id;
+        off_t block_index_within_disk = calculate_raid_disk(ctx, &raid_disk_id, parent_node.blocks[block_idx]);
+
+        for (size_t entry_idx = 0; entry_idx < entries_per_block; entry_idx++) {
+            off_t entry_offset = DIRENTRY_OFFSET(ctx, block_index_within_disk, entry_idx);
+            struct wfs_dentry *current_entry = (struct wfs_dentry *)DISK_PTR(ctx, raid_disk_id, entry_offset);
+
+            if (current_entry->num != -1 && strcmp(current_entry->name, entry_name) == 0) {
+                struct wfs_dentry empty;
+                memset(&empty, -1, sizeof(empty));
+                write_to_data_block(ctx, parent_node.blocks[block_idx], (const char *)&empty, sizeof(empty),
+                                    entry_idx * sizeof(empty));
+                return 0;
+            }
+        }
+    }
+
+    printf("Entry not found in directory: %s\n", entry_name);
+    return -ENOENT;
+}
+
+
+//Find the index of inode
+int get_inode_index(struct wfs_ctx *ctx, const char *path) {
+    if (strcmp(path, "/") == 0) {
+        return 0;
+    }
+    int cached = dir_cache_lookup(ctx, path);
+    if (cached >= 0) {
+        STATS_ADD(ctx->stats.lookup_cache_hits, 1);
+        return cached;
+    }
+    STATS_ADD(ctx->stats.lookup_walks, 1);
+
+    char *path_copy = strdup(path);
+    char *save_ptr;
+    char *component = strtok_r(path_copy, "/", &save_ptr);
+    int parent_inode_num = 0;
+    int result = 0;
+
+    while (component != NULL) {
+        result = find_dir_entry_in_inode(ctx, parent_inode_num, component);
+        if (result < 0) {
+            free(path_copy);
+            return result;
+        }
+
+        parent_inode_num = result;
+        component = strtok_r(NULL, "/", &save_ptr);
+    }
+
+    free(path_copy);
+    return parent_inode_num;
+}
+
+//Operations related to raid:
+
+//Block ids the allocator hands out; the disk a grow added only adds its share once rebalanced
+off_t num_block_ids(const struct wfs_ctx *ctx) {
+    int num_disks = ctx->sb.grow_from_disks ? (int)ctx->sb.grow_from_disks : ctx->num_disks;
+    return (off_t)ctx->sb.num_data_blocks * num_disks;
+}
+
+//Filesystem operations:
+int engine_mknod(struct wfs_ctx *ctx, const char *path, mode_t mode) {
+    if (ctx->missing_disk >= 0) {
+        return -EROFS;
+    }
+
+    char parent_path[PATH_MAX];
+    char filename[MAX_NAME];
+    split_path(path, parent_path, filename);
+
+    int parent_inode_num = get_inode_index(ctx, parent_path);
+    if (parent_inode_num == -ENOENT) {
+        return -ENOENT;
+    }
+
+    struct wfs_inode parent_inode;
+    load_inode(ctx, &parent_inode, parent_inode_num);
+
+    if (!S_ISDIR(parent_inode.mode)) {
+        return -ENOTDIR;
+    }
+
+    if (find_duplicate_directory_entry(ctx, &parent_inode, filename) == 0) {
+        return -EEXIST;
+    }
+
+    int inode_num = setup_inode(ctx, mode, S_IFREG);
+    if (inode_num < 0) {
+        return inode_num;
+    }
+
+    if (insert_directory_entry(ctx, &parent_inode, parent_inode_num, filename, inode_num) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+int engine_mkdir(struct wfs_ctx *ctx, const char *path, mode_t mode) {
+    if (ctx->missing_disk >= 0) {
+        return -EROFS;
+    }
+
+    char parent_path[PATH_MAX];
+    char dirname[MAX_NAME];
+    split_path(path, parent_path, dirname);
+
+    int parent_inode_num = get_inode_index(ctx, parent_path);
+    if (parent_inode_num == -ENOENT) {
+        return -ENOENT;
+    }
+
+    struct wfs_inode parent_inode;
+    load_inode(ctx, &parent_inode, parent_inode_num);
+
+    if (!S_ISDIR(parent_inode.mode)) {
+        return -ENOTDIR;
+    }
+
+    if (find_duplicate_directory_entry(ctx, &parent_inode, dirname) == 0) {
+        return -EEXIST;
+    }
+
+    int inode_num = setup_inode(ctx, mode, S_IFDIR);
+    if (inode_num < 0) {
+        return inode_num;
+    }
+
+    if (insert_directory_entry(ctx, &parent_inode, parent_inode_num, dirname, inode_num) < 0) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static void fill_stat(const struct wfs_inode *inode, int inode_num, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = inode_num;
+    stbuf->st_mode = inode->mode;
+    stbuf->st_nlink = inode->nlinks;
+    stbuf->st_size = inode->size;
+    stbuf->st_atime = inode->atim;
+    stbuf->st_mtime = inode->mtim;
+    stbuf->st_ctime = inode->ctim;
+}
+
+/*
+  List a directory from offset on. Every entry is keyed by its dentry's
+  position (block slot * entries per block + index), with "." and ".."
+  after the last possible slot, and handed to filler with the key of the
+  next one and its stat. A filler that returns nonzero has a full buffer:
+  the listing stops and the next call resumes at the offset it was given,
+  so a large directory takes one pass over its dentry blocks however many
+  calls it is read in. Offset 0 starts the lookup cache over for path.
+*/
+int engine_readdir(struct wfs_ctx *ctx, const char *path, void *buf, wfs_filler_t filler, off_t offset) {
+    int inode_num = get_inode_index(ctx, path);
+    if (inode_num == -ENOENT) {
+        return -ENOENT;
+    }
+
+    struct wfs_inode dir_inode;
+    load_inode(ctx, &dir_inode, inode_num);
+
+    if (!S_ISDIR(dir_inode.mode)) {
+        return -ENOTDIR;
+    }
+
+    struct wfs_dir_cache *cache = &ctx->dir_cache;
+    size_t path_len = strlen(path);
+    if (offset == 0 && path_len < sizeof(cache->path)) {
+        memcpy(cache->path, path, path_len + 1);
+        cache->path_len = path_len;
+        cache->count = 0;
+    }
+    int caching = cache->path_len == path_len && strcmp(cache->path, path) == 0;
+
+    const off_t entries_per_block = BLOCK_SIZE / sizeof(struct wfs_dentry);
+    const off_t dots = N_BLOCKS * entries_per_block;
+    struct stat st;
+    struct wfs_inode entry_inode;
+
+    for (off_t i = offset / entries_per_block; offset < dots && i < N_BLOCKS && dir_inode.blocks[i] != -1; i++) {
+        struct wfs_dentry *dentry = (struct wfs_dentry *)data_block_ptr(ctx, dir_inode.blocks[i]);
+        for (off_t entry_idx = 0; entry_idx < entries_per_block; entry_idx++) {
+            off_t key = i * entries_per_block + entry_idx;
+            if (key < offset || dentry[entry_idx].num == -1) {
+                continue;
+            }
+            load_inode(ctx, &entry_inode, dentry[entry_idx].num);
+            fill_stat(&entry_inode, dentry[entry_idx].num, &st);
+            if (caching && cache->count < (int)DIR_CACHE_ENTRIES) {
+                strncpy(cache->entries[cache->count].name, dentry[entry_idx].name, MAX_NAME);
+                cache->entries[cache->count].num = dentry[entry_idx].num;
+                cache->count++;
+            }
+            if (filler(buf, dentry[entry_idx].name, &st, key + 1)) {
+                return 0;
+            }
+        }
+    }
+
+    if (offset <= dots) {
+        fill_stat(&dir_inode, inode_num, &st);
+        if (filler(buf, ".", &st, dots + 1)) {
+            return 0;
+        }
+    }
+    if (offset <= dots + 1) {
+        //The parent of "/" is itself
+        char parent_path[PATH_MAX];
+        char name[MAX_NAME];
+        int parent_num = 0;
+        if (strcmp(path, "/") != 0 && split_path(path, parent_path, name) == 0) {
+            parent_num = get_inode_index(ctx, parent_path);
+        }
+        if (parent_num >= 0) {
+            load_inode(ctx, &entry_inode, parent_num);
+            fill_stat(&entry_inode, parent_num, &st);
+        }
+        filler(buf, "..", parent_num >= 0 ? &st : NULL, dots + 2);
+    }
+
+    return 0;
+}
+
+int engine_getattr(struct wfs_ctx *ctx, const char *path, struct stat *stbuf) {
+    int inode_num = get_inode_index(ctx, path);
+    if (inode_num == -ENOENT) {
+        return -ENOENT;
+    }
+    struct wfs_inode inode;
+    load_inode(ctx, &inode, inode_num);
+    fill_stat(&inode, inode_num, stbuf);
+
+    return 0;
+}
+
+//Data block writes of one engine_write call, issued together so RAID 5 can spot whole rows
+struct block_writes {
+    int count;
+    struct {
+        off_t block_num;
+        const char *buf;
+        size_t size;
+        size_t offset;
+    } writes[MAX_FILE_BLOCKS];
+};
+
+static void queue_block_write(struct block_writes *pending, off_t block_num, const char *buf, size_t size, size_t offset) {
+    pending->writes[pending->count].block_num = block_num;
+    pending->writes[pending->count].buf = buf;
+    pending->writes[pending->count].size = size;
+    pending->writes[pending->count].offset = offset;
+    pending->count++;
+}
+
+//Rows the call overwrites completely go out as full-stripe writes, everything else block by block
+static int flush_block_writes(struct wfs_ctx *ctx, const struct block_writes *pending) {
+    int num_disks = ctx->num_disks;
+    char done[MAX_FILE_BLOCKS] = {0};
+
+    //A row with parity holds a data block on every disk but one
+    for (int i = 0; ctx->layout->write_row && i < pending->count; i++) {
+        if (done[i] || pending->writes[i].size != BLOCK_SIZE) {
+            continue;
+        }
+        int disk;
+        off_t row = ctx->layout->map(ctx, &disk, pending->writes[i].block_num);
+        const char *blocks[MAX_DISKS] = {0};
+        int members[MAX_DISKS];
+        int found = 0;
+        for (int j = i; j < pending->count && found < num_disks - 1; j++) {
+            if (!done[j] && pending->writes[j].size == BLOCK_SIZE &&
+                ctx->layout->map(ctx, &disk, pending->writes[j].block_num) == row && !blocks[disk]) {
+                blocks[disk] = pending->writes[j].buf;
+                members[found++] = j;
+            }
+        }
+        if (found == num_disks - 1) {
+            ctx->layout->write_row(ctx, row, blocks);
+            for (int k = 0; k < found; k++) {
+                done[members[k]] = 1;
+            }
+        }
+    }
+
+    for (int i = 0; i < pending->count; i++) {
+        if (done[i]) {
+            continue;
+        }
+        //Whole blocks that sit back to back on one disk and come from contiguous memory go out
+        //as one copy and one mirror update. RAID 5 rows each have their own parity, so not there.
+        int run = 1;
+        if (!ctx->layout->parity && pending->writes[i].size == BLOCK_SIZE) {
+            int disk, next_disk;
+            off_t local = ctx->layout->map(ctx, &disk, pending->writes[i].block_num);
+            while (i + run < pending->count && pending->writes[i + run].size == BLOCK_SIZE &&
+                   pending->writes[i + run].buf == pending->writes[i].buf + run * BLOCK_SIZE &&
+                   ctx->layout->map(ctx, &next_disk, pending->writes[i + run].block_num) == local + run &&
+                   next_disk == disk) {
+                run++;
+            }
+        }
+        int result = write_to_data_block(ctx, pending->writes[i].block_num, pending->writes[i].buf,
+                                         run * pending->writes[i].size, pending->writes[i].offset);
+        if (result < 0) {
+            return result;
+        }
+        i += run - 1;
+    }
+    return 0;
+}
+
+//A file's data block numbers in file order: the direct pointers, then the indirect block's entries
+static void load_block_map(struct wfs_ctx *ctx, const struct wfs_inode *inode, off_t *map) {
+    memcpy(map, inode->blocks, (N_BLOCKS - 1) * sizeof(off_t));
+    if (inode->blocks[N_BLOCKS - 1] == -1) {
+        memset(map + N_BLOCKS - 1, -1, (MAX_FILE_BLOCKS - (N_BLOCKS - 1)) * sizeof(off_t));
+    } else {
+        read_data_block(ctx, map + N_BLOCKS - 1, inode->blocks[N_BLOCKS - 1]);
+    }
+}
+
+//Write a map from load_block_map back: the direct pointers into the inode, which the caller
+//writes, and the rest into the indirect block, allocated on first use
+static int store_block_map(struct wfs_ctx *ctx, struct wfs_inode *inode, const off_t *map) {
+    memcpy(inode->blocks, map, (N_BLOCKS - 1) * sizeof(off_t));
+    int indirect_used = 0;
+    for (int i = N_BLOCKS - 1; i < MAX_FILE_BLOCKS; i++) {
+        indirect_used |= map[i] != -1;
+    }
+    if (indirect_used && inode->blocks[N_BLOCKS - 1] == -1) {
+        off_t block;
+        int ret = get_tier_blocks(ctx, 1, &block, WFS_TIER_FAST, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        inode->blocks[N_BLOCKS - 1] = block;
+    }
+    if (inode->blocks[N_BLOCKS - 1] != -1) {
+        write_data_block(ctx, map + N_BLOCKS - 1, inode->blocks[N_BLOCKS - 1]);
+    }
+    return 0;
+}
+
+//load_block_map for a range that ends at file block last: the indirect block is only read once the range reaches it
+static void load_range_map(struct wfs_ctx *ctx, const struct wfs_inode *inode, size_t last, off_t *map) {
+    if (last >= N_BLOCKS - 1) {
+        load_block_map(ctx, inode, map);
+    } else {
+        memcpy(map, inode->blocks, (N_BLOCKS - 1) * sizeof(off_t));
+    }
+}
+
+//Give the holes among file blocks first..last of map data blocks in one allocator pass, handed out in
+//file order with the indirect block, when the range needs a new one, taken after the direct blocks.
+//With tiers the direct and indirect blocks come from the fast tier and the rest from the capacity
+//tier, in a pass each. Sets *indirect_changed when the indirect block has to be written back.
+//All or nothing.
+static int allocate_range(struct wfs_ctx *ctx, struct wfs_inode *inode, off_t *map, size_t first, size_t last,
+                          int *indirect_changed) {
+    int new_indirect = last >= N_BLOCKS - 1 && inode->blocks[N_BLOCKS - 1] == -1;
+    int missing = new_indirect;
+    int fast = new_indirect;
+    for (size_t i = first; i <= last; i++) {
+        missing += map[i] == -1;
+        fast += map[i] == -1 && i < N_BLOCKS - 1;
+    }
+    *indirect_changed = new_indirect;
+    if (!missing) {
+        return 0;
+    }
+    off_t new_blocks[MAX_FILE_BLOCKS + 1];
+    int ret;
+    if (!ctx->tier.placement) {
+        ret = get_data_blocks(ctx, missing, new_blocks);
+    } else {
+        ret = get_tier_blocks(ctx, fast, new_blocks, WFS_TIER_FAST, 0);
+        if (ret == 0 && missing > fast) {
+            ret = get_tier_blocks(ctx, missing - fast, new_blocks + fast, WFS_TIER_CAPACITY, 0);
+            for (int i = 0; ret < 0 && i < fast; i++) {
+                clear_data_block(ctx, new_blocks[i]);
+            }
+        }
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    int next = 0;
+    for (size_t i = first; i <= last && i < N_BLOCKS - 1; i++) {
+        if (map[i] == -1) {
+            map[i] = new_blocks[next++];
+        }
+    }
+    if (new_indirect) {
+        inode->blocks[N_BLOCKS - 1] = new_blocks[next++];
+    }
+    for (size_t i = MAX(first, N_BLOCKS - 1); i <= last; i++) {
+        if (map[i] == -1) {
+            map[i] = new_blocks[next++];
+            *indirect_changed = 1;
+        }
+    }
+    return 0;
+}
+
+/*
+  Range mapping: a byte range of a file cut into runs, each a stretch
+  of blocks that sit back to back on one disk (or of holes), so a run
+  moves with one copy however many blocks it spans. RAID 1v votes
+  across the mirrors block by block, so its runs never grow past one.
+*/
+struct block_run {
+    off_t block_num;   //first block, -1 for a hole
+    int disk;
+    off_t local;       //first block's index on disk
+    size_t offset;     //into the first block
+    size_t size;
+    size_t buf_offset; //into the caller's buffer
+};
+
+static int map_range(struct wfs_ctx *ctx, const off_t *map, off_t offset, size_t size, struct block_run *runs) {
+    if (size == 0) {
+        return 0;
+    }
+    size_t first = offset / BLOCK_SIZE;
+    size_t last = (offset + size - 1) / BLOCK_SIZE;
+    int per_block = ctx->layout->votes;
+    struct block_run *run = NULL;
+    int count = 0;
+    int next_disk = -1;
+    off_t next_local = -1; //where a block has to sit to extend run
+
+    for (size_t i = first; i <= last; i++) {
+        int disk = -1;
+        off_t local = map[i] == -1 ? -1 : ctx->layout->map(ctx, &disk, map[i]);
+        if (run && !per_block && (run->block_num == -1) == (map[i] == -1) &&
+            (map[i] == -1 || (disk == next_disk && local == next_local))) {
+            run->size += BLOCK_SIZE;
+        } else {
+            run = &runs[count++];
+            run->block_num = map[i];
+            run->disk = disk;
+            run->local = local;
+            run->offset = i == first ? offset % BLOCK_SIZE : 0;
+            run->size = BLOCK_SIZE - run->offset;
+            run->buf_offset = i == first ? 0 : i * BLOCK_SIZE - offset;
+        }
+        next_disk = disk;
+        next_local = local + 1;
+    }
+    //The range ends partway into its last block
+    run->size -= (last + 1) * BLOCK_SIZE - (offset + size);
+    return count;
+}
+
+//Copy one run out to buf. Holes read as zeros.
+static void read_run(struct wfs_ctx *ctx, const struct block_run *run, char *buf) {
+    if (run->block_num == -1) {
+        memset(buf, 0, run->size);
+        return;
+    }
+    ctx->layout->read_range(ctx, run->disk, run->local, run->offset, run->size, buf);
+}
+
+//Compressed files:
+
+#define CLUSTER_BYTES (WFS_CLUSTER_BLOCKS * BLOCK_SIZE)
+
+//Block slots of a cluster; the last one of a file is cut short by MAX_FILE_BLOCKS
+static size_t cluster_slots(size_t cluster) {
+    return MIN(WFS_CLUSTER_BLOCKS, MAX_FILE_BLOCKS - cluster * WFS_CLUSTER_BLOCKS);
+}
+
+static int is_compressed_ptr(off_t ptr) {
+    return ptr != -1 && (ptr & WFS_BLOCK_COMPRESSED);
+}
+
+//Plain contents of a cluster into plain[CLUSTER_BYTES]; holes and the tail past the data read as zeros
+static int load_cluster(struct wfs_ctx *ctx, const off_t *map, size_t cluster, char *plain) {
+    const off_t *slots = map + cluster * WFS_CLUSTER_BLOCKS;
+    size_t num_slots = cluster_slots(cluster);
+    memset(plain, 0, CLUSTER_BYTES);
+
+    if (!is_compressed_ptr(slots[0])) {
+        for (size_t i = 0; i < num_slots; i++) {
+            if (slots[i] != -1) {
+                read_from_data_block(ctx, slots[i], plain + i * BLOCK_SIZE, BLOCK_SIZE, 0);
+            }
+        }
+        return 0;
+    }
+
+    char stored[CLUSTER_BYTES];
+    size_t used = 0;
+    while (used < num_slots && is_compressed_ptr(slots[used])) {
+        read_from_data_block(ctx, WFS_BLOCK_ID(slots[used]), stored + used * BLOCK_SIZE, BLOCK_SIZE, 0);
+        used++;
+    }
+    uint16_t stored_len;
+    memcpy(&stored_len, stored, sizeof(stored_len));
+    if (stored_len + sizeof(stored_len) > used * BLOCK_SIZE ||
+        lz_decompress(stored + sizeof(stored_len), stored_len, plain, num_slots * BLOCK_SIZE) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+  Store the first len bytes of plain as the cluster's contents: compressed
+  when that saves at least one block, otherwise as plain blocks. Blocks the
+  cluster already owns are reused, the shortfall is allocated in one call
+  and any surplus freed. The caller stores the updated map.
+*/
+static int store_cluster(struct wfs_ctx *ctx, off_t *map, size_t cluster, const char *plain, size_t len) {
+    off_t *slots = map + cluster * WFS_CLUSTER_BLOCKS;
+    size_t num_slots = cluster_slots(cluster);
+    size_t plain_blocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    char stored[CLUSTER_BYTES] = {0};
+    uint16_t stored_len = 0;
+    if (plain_blocks > 1) {
+        stored_len = lz_compress(plain, len, stored + sizeof(stored_len),
+                                 (plain_blocks - 1) * BLOCK_SIZE - sizeof(stored_len));
+    }
+    int compressed = stored_len > 0;
+    size_t needed = plain_blocks;
+    const char *data = plain;
+    if (compressed) {
+        memcpy(stored, &stored_len, sizeof(stored_len));
+        needed = (stored_len + sizeof(stored_len) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        data = stored;
+        STATS_ADD(ctx->stats.clusters_compressed, 1);
+    } else {
+        STATS_ADD(ctx->stats.clusters_stored_plain, 1);
+    }
+    STATS_ADD(ctx->stats.cluster_bytes_in, len);
+    STATS_ADD(ctx->stats.cluster_bytes_stored, needed * BLOCK_SIZE);
+
+    off_t owned[WFS_CLUSTER_BLOCKS];
+    size_t num_owned = 0;
+    for (size_t i = 0; i < num_slots; i++) {
+        if (slots[i] != -1) {
+            owned[num_owned++] = WFS_BLOCK_ID(slots[i]);
+        }
+    }
+    if (needed > num_owned) {
+        int tier = cluster * WFS_CLUSTER_BLOCKS < N_BLOCKS - 1 ? WFS_TIER_FAST : WFS_TIER_CAPACITY;
+        int ret = get_tier_blocks(ctx, needed - num_owned, owned + num_owned, tier, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        num_owned = needed;
+    }
+    for (size_t i = needed; i < num_owned; i++) {
+        clear_data_block(ctx, owned[i]);
+    }
+
+    struct block_writes pending = {0};
+    for (size_t i = 0; i < num_slots; i++) {
+        if (i < needed) {
+            slots[i] = compressed ? owned[i] | WFS_BLOCK_COMPRESSED : owned[i];
+            queue_block_write(&pending, owned[i], data + i * BLOCK_SIZE, BLOCK_SIZE, 0);
+        } else {
+            slots[i] = -1;
+        }
+    }
+    return flush_block_writes(ctx, &pending);
+}
+
+static int compressed_read(struct wfs_ctx *ctx, const struct wfs_inode *inode, char *buf, size_t size, off_t offset) {
+    if (offset >= inode->size) {
+        return 0;
+    }
+    size = MIN(size, (size_t)(inode->size - offset));
+
+    off_t map[MAX_FILE_BLOCKS];
+    load_block_map(ctx, inode, map);
+    size_t done = 0;
+    while (done < size) {
+        size_t cluster = (offset + done) / CLUSTER_BYTES;
+        size_t within = (offset + done) % CLUSTER_BYTES;
+        size_t piece = MIN(CLUSTER_BYTES - within, size - done);
+        char plain[CLUSTER_BYTES];
+        int ret = load_cluster(ctx, map, cluster, plain);
+        if (ret < 0) {
+            return ret;
+        }
+        memcpy(buf + done, plain + within, piece);
+        done += piece;
+    }
+    return done;
+}
+
+//Read-modify-write of every cluster the range touches
+static int compressed_write(struct wfs_ctx *ctx, struct wfs_inode *inode, int inode_num, const char *buf,
+                            size_t size, off_t offset) {
+    off_t max_size = (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE;
+    if (size == 0) {
+        return 0;
+    }
+    if (offset >= max_size) {
+        return -EFBIG;
+    }
+    size = MIN(size, (size_t)(max_size - offset));
+    off_t new_size = MAX(inode->size, offset + (off_t)size);
+
+    off_t map[MAX_FILE_BLOCKS];
+    load_block_map(ctx, inode, map);
+    size_t done = 0;
+    while (done < size) {
+        size_t cluster = (offset + done) / CLUSTER_BYTES;
+        size_t within = (offset + done) % CLUSTER_BYTES;
+        size_t piece = MIN(CLUSTER_BYTES - within, size - done);
+        size_t len = MIN(new_size - cluster * CLUSTER_BYTES, cluster_slots(cluster) * BLOCK_SIZE);
+        char plain[CLUSTER_BYTES];
+        int ret = 0;
+        if (piece < len) {
+            ret = load_cluster(ctx, map, cluster, plain);
+        } else {
+            memset(plain, 0, CLUSTER_BYTES);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        memcpy(plain + within, buf + done, piece);
+        ret = store_cluster(ctx, map, cluster, plain, len);
+        if (ret < 0) {
+            return ret;
+        }
+        done += piece;
+    }
+
+    int ret = store_block_map(ctx, inode, map);
+    if (ret < 0) {
+        return ret;
+    }
+    inode->size = new_size;
+    write_inode(ctx, inode, inode_num);
+    return done;
+}
+
+int engine_write(struct wfs_ctx *ctx, const char *path, const char *buf, size_t size, off_t offset) {
+    if (ctx->missing_disk >= 0) {
+        return -EROFS;
+    }
+
+    int inode_num = get_inode_index(ctx, path);
+    if (inode_num == -ENOENT) {
+        return -ENOENT;
+    }
+
+    struct wfs_inode file_inode;
+    load_inode(ctx, &file_inode, inode_num);
+
+    if (!S_ISREG(file_inode.mode)) {
+        return -EISDIR;
+    }
+    if (file_inode.flags & WFS_INODE_COMPRESSED) {
+        return compressed_write(ctx, &file_inode, inode_num, buf, size, offset);
+    }
+
+    off_t max_size = (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE;
+    if (size == 0) {
+        return 0;
+    }
+    if (offset >= max_size) {
+        return -EFBIG;
+    }
+    size = MIN(size, (size_t)(max_size - offset));
+
+    off_t map[MAX_FILE_BLOCKS];
+    size_t first = offset / BLOCK_SIZE;
+    size_t last = (offset + size - 1) / BLOCK_SIZE;
+    load_range_map(ctx, &file_inode, last, map);
+    int indirect_changed;
+    int result = allocate_range(ctx, &file_inode, map, first, last, &indirect_changed);
+    if (result < 0) {
+        return result;
+    }
+
+    //Queued block by block so RAID 5 can spot whole rows; flush_block_writes coalesces the rest into runs
+    struct block_writes pending = {0};
+    size_t bytes_written = 0;
+    while (bytes_written < size) {
+        size_t block_index = (offset + bytes_written) / BLOCK_SIZE;
+        size_t block_offset = (offset + bytes_written) % BLOCK_SIZE;
+        size_t write_size = MIN(BLOCK_SIZE - block_offset, size - bytes_written);
+        queue_block_write(&pending, map[block_index], buf + bytes_written, write_size, block_offset);
+        bytes_written += write_size;
+    }
+
+    pio_begin(ctx, size);
+    result = flush_block_writes(ctx, &pending);
+    pio_end(ctx);
+    if (result < 0) {
+        return result;
+    }
+
+    memcpy(file_inode.blocks, map, (N_BLOCKS - 1) * sizeof(off_t));
+    if (indirect_changed) {
+        write_data_block(ctx, map + N_BLOCKS - 1, file_inode.blocks[N_BLOCKS - 1]);
+    }
+    file_inode.size = MAX(file_inode.size, offset + bytes_written);
+    write_inode(ctx, &file_inode, inode_num);
+    return bytes_written;
+}
+
+int engine_read(struct wfs_ctx *ctx, const char *path, char *buf, size_t size, off_t offset) {
+    int inode_num = get_inode_index(ctx, path);
+    if (inode_num == -ENOENT) {
+        return -ENOENT;
+    }
+
+    struct wfs_inode file_inode;
+    load_inode(ctx, &file_inode, inode_num);
+
+    if (!S_ISREG(file_inode.mode)) {
+        return -EISDIR;
+    }
+    if (file_inode.flags & WFS_INODE_COMPRESSED) {
+        return compressed_read(ctx, &file_inode, buf, size, offset);
+    }
+
+    if (offset >= file_inode.size || size == 0) {
+        return 0;
+    }
+    size = MIN(size, file_inode.size - offset);
+
+    off_t map[MAX_FILE_BLOCKS];
+    struct block_run runs[MAX_FILE_BLOCKS];
+    load_range_map(ctx, &file_inode, (offset + size - 1) / BLOCK_SIZE, map);
+    tier_note_reads(ctx, map, offset / BLOCK_SIZE, (offset + size - 1) / BLOCK_SIZE);
+    int count = map_range(ctx, map, offset, size, runs);
+    pio_begin(ctx, size);
+    for (int i = 0; i < count; i++) {
+        read_run(ctx, &runs[i], buf + runs[i].buf_offset);
+    }
+    pio_end(ctx);
+    return size;
+}
+
+/*
+  Copy len bytes of src at off_in to dst at off_out without a round trip
+  through a caller's buffer. Destination blocks the range lacks are taken
+  in one allocator pass, data moves straight from the source block's
+  mapping to the destination's, and whole blocks that land together on a
+  disk share one copy and one mirror update. Returns the bytes copied,
+  which stops at the end of src, as copy_file_range does.
+*/
+int engine_copy_file_range(struct wfs_ctx *ctx, const char *src_path, off_t off_in,
+                           const char *dst_path, off_t off_out, size_t len) {
+    if (ctx->missing_disk >= 0) {
+        return -EROFS;
+    }
+    int src_num = get_inode_index(ctx, src_path);
+    int dst_num = get_inode_index(ctx, dst_path);
+    if (src_num < 0 || dst_num < 0) {
+        return -ENOENT;
+    }
+
+    struct wfs_inode src_inode, dst_inode;
+    load_inode(ctx, &src_inode, src_num);
+    load_inode(ctx, &dst_inode, dst_num);
+    if (!S_ISREG(src_inode.mode) || !S_ISREG(dst_inode.mode)) {
+        return -EISDIR;
+    }
+    if (off_in < 0 || off_out < 0) {
+        return -EINVAL;
+    }
+    off_t max_size = (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE;
+    if (off_in >= src_inode.size || len == 0) {
+        return 0;
+    }
+    if (off_out >= max_size) {
+        return -EFBIG;
+    }
+    len = MIN(len, (size_t)(src_inode.size - off_in));
+    len = MIN(len, (size_t)(max_size - off_out));
+    if (src_num == dst_num && off_in < off_out + (off_t)len && off_out < off_in + (off_t)len) {
+        return -EINVAL;
+    }
+    //Compressed clusters cannot be copied block for block; go through the cluster code
+    if ((src_inode.flags | dst_inode.flags) & WFS_INODE_COMPRESSED) {
+        char *bounce = malloc(len);
+        if (!bounce) {
+            return -ENOMEM;
+        }
+        int ret = engine_read(ctx, src_path, bounce, len, off_in);
+        if (ret > 0) {
+            ret = engine_write(ctx, dst_path, bounce, ret, off_out);
+        }
+        free(bounce);
+        return ret;
+    }
+
+    off_t src_map[MAX_FILE_BLOCKS], dst_map[MAX_FILE_BLOCKS];
+    load_block_map(ctx, &src_inode, src_map);
+    load_block_map(ctx, &dst_inode, dst_map);
+
+    size_t first = off_out / BLOCK_SIZE;
+    size_t last = (off_out + len - 1) / BLOCK_SIZE;
+    int indirect_changed;
+    int ret = allocate_range(ctx, &dst_inode, dst_map, first, last, &indirect_changed);
+    if (ret < 0) {
+        return ret;
+    }
+
+    //RAID 1v reads vote across the mirrors, so source blocks are staged; elsewhere they are used in place
+    char (*staged)[BLOCK_SIZE] = NULL;
+    size_t src_first = off_in / BLOCK_SIZE;
+    if (ctx->layout->votes) {
+        staged = malloc(((off_in + len - 1) / BLOCK_SIZE - src_first + 1) * BLOCK_SIZE);
+        if (!staged) {
+            return -ENOMEM;
+        }
+    }
+    static const char zero_block[BLOCK_SIZE];
+    struct block_writes pending = {0};
+    const char *src_block = NULL;
+    int result = 0;
+    size_t copied = 0;
+    while (copied < len && result == 0) {
+        size_t src_index = (off_in + copied) / BLOCK_SIZE;
+        size_t src_offset = (off_in + copied) % BLOCK_SIZE;
+        size_t dst_index = (off_out + copied) / BLOCK_SIZE;
+        size_t dst_offset = (off_out + copied) % BLOCK_SIZE;
+        size_t piece = MIN(MIN(BLOCK_SIZE - src_offset, BLOCK_SIZE - dst_offset), len - copied);
+
+        //A misaligned copy splits each source block over two pieces; it is fetched for the first only
+        if (copied == 0 || src_offset == 0) {
+            if (src_map[src_index] == -1) {
+                src_block = zero_block;
+            } else if (staged) {
+                src_block = staged[src_index - src_first];
+                find_majority_block(ctx, staged[src_index - src_first], src_map[src_index]);
+            } else {
+                src_block = data_block_ptr(ctx, src_map[src_index]);
+            }
+        }
+        queue_block_write(&pending, dst_map[dst_index], src_block + src_offset, piece, dst_offset);
+        copied += piece;
+        if (pending.count == MAX_FILE_BLOCKS || copied == len) {
+            result = flush_block_writes(ctx, &pending);
+            pending.count = 0;
+        }
+    }
+    free(staged);
+    if (result < 0) {
+        return result;
+    }
+
+    memcpy(dst_inode.blocks, dst_map, (N_BLOCKS - 1) * sizeof(off_t));
+    if (indirect_changed) {
+        write_data_block(ctx, dst_map + N_BLOCKS - 1, dst_inode.blocks[N_BLOCKS - 1]);
+    }
+    dst_inode.size = MAX(dst_inode.size, off_out + (off_t)len);
+    write_inode(ctx, &dst_inode, dst_num);
+    return len;
+}
+
+int engine_rmdir(struct wfs_ctx *ctx, const char *path) {
+    if (ctx->missing_disk >= 0) {
+        return -EROFS;
+    }
+
+    int inode_num = get_inode_index(ctx, path);
+    if (inode_num == -ENOENT) {
+        return -ENOENT;
+    }
+
+    struct wfs_inode dir_inode;
+    load_inode(ctx, &dir_inode, inode_num);
+
+    if (!S_ISDIR(dir_inode.mode)) {
+        return -ENOTDIR;
+    }
+
+    char parent_path[PATH_MAX];
+    char dir_name[MAX_NAME];
+    if (split_path(path, parent_path, dir_name) == -1) {
+        return -EINVAL;
+    }
+
+    int parent_inode_num = get_inode_index(ctx, parent_path);
+    if (parent_inode_num == -ENOENT) {
+        return -ENOENT;
+    }
+
+    if (delete_directory_entry(ctx, parent_inode_num, dir_name) != 0) {
+        return -EIO;
+    }
+
+    free_inode(ctx, inode_num);
+
+    return 0;
+}
+
+//Free every data block of a file, the indirect block included, and reset its pointers
+static void free_file_blocks(struct wfs_ctx *ctx, struct wfs_inode *file_inode) {
+    for (int i = 0; i < N_BLOCKS; i++) {
+        if (i == N_BLOCKS-1 && file_inode->blocks[i] != -1){
+            off_t indirect_block[BLOCK_SIZE / sizeof(off_t)];
+            read_data_block(ctx, indirect_block, file_inode->blocks[N_BLOCKS - 1]);
+            for (off_t j=0; j<BLOCK_SIZE/sizeof(off_t); j++){
+                if (indirect_block[j] != -1){
+                    clear_data_block(ctx, WFS_BLOCK_ID(indirect_block[j]));
+                    indirect_block[j] = -1;
+                }
+            }
+            write_data_block(ctx, indirect_block, file_inode->blocks[N_BLOCKS - 1]);
+        }
+        if (file_inode->blocks[i] != -1) {
+            clear_data_block(ctx, WFS_BLOCK_ID(file_inode->blocks[i]));
+            file_inode->blocks[i] = -1;
+        }
+    }
+}
+
+/*
+  Lay size bytes of data out from offset 0 in a file that owns no blocks
+  yet, compressed or plain as inode->flags says. Every block taken is left
+  in map or inode->blocks, on failure too, so the caller can give them back.
+*/
+static int write_fresh_blocks(struct wfs_ctx *ctx, struct wfs_inode *inode, off_t *map, const char *data,
+                              size_t size) {
+    if (inode->flags & WFS_INODE_COMPRESSED) {
+        for (size_t cluster = 0; cluster * CLUSTER_BYTES < size; cluster++) {
+            size_t len = MIN(size - cluster * CLUSTER_BYTES, cluster_slots(cluster) * BLOCK_SIZE);
+            char plain[CLUSTER_BYTES] = {0};
+            memcpy(plain, data + cluster * CLUSTER_BYTES, len);
+            int ret = store_cluster(ctx, map, cluster, plain, len);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        return store_block_map(ctx, inode, map);
+    }
+
+    int indirect_changed;
+    int ret = allocate_range(ctx, inode, map, 0, (size - 1) / BLOCK_SIZE, &indirect_changed);
+    if (ret < 0) {
+        return ret;
+    }
+    struct block_writes pending = {0};
+    for (size_t done = 0; done < size; done += BLOCK_SIZE) {
+        queue_block_write(&pending, map[done / BLOCK_SIZE], data + done, MIN(BLOCK_SIZE, size - done), 0);
+    }
+    pio_begin(ctx, size);
+    ret = flush_block_writes(ctx, &pending);
+    pio_end(ctx);
+    if (ret < 0) {
+        return ret;
+    }
+    memcpy(inode->blocks, map, (N_BLOCKS - 1) * sizeof(off_t));
+    if (indirect_changed) {
+        write_data_block(ctx, map + N_BLOCKS - 1, inode->blocks[N_BLOCKS - 1]);
+    }
+    return 0;
+}
+
+/*
+  Switch a file between plain and compressed storage. The data is written
+  in its new form to newly allocated blocks first; only once that succeeded
+  does the inode take the new pointers and the old blocks get freed, so a
+  full or degraded array leaves the file as it was.
+*/
+int engine_set_compression(struct wfs_ctx *ctx, const char *path, int enable) {
+    if (ctx->missing_disk >= 0) {
+        return -EROFS;
+    }
+    int inode_num = get_inode_index(ctx, path);
+    if (inode_num < 0) {
+        return -ENOENT;
+    }
+    struct wfs_inode file_inode;
+    load_inode(ctx, &file_inode, inode_num);
+    if (!S_ISREG(file_inode.mode)) {
+        return -EISDIR;
+    }
+    uint32_t flags = enable ? file_inode.flags | WFS_INODE_COMPRESSED : file_inode.flags & ~WFS_INODE_COMPRESSED;
+    if (flags == file_inode.flags) {
+        return 0;
+    }
+
+    off_t size = file_inode.size;
+    char *data = malloc(size + 1);
+    if (!data) {
+        return -ENOMEM;
+    }
+    int ret = engine_read(ctx, path, data, size, 0);
+    struct wfs_inode fresh = file_inode;
+    fresh.flags = flags;
+    off_t map[MAX_FILE_BLOCKS];
+    for (int i = 0; i < N_BLOCKS; i++) {
+        fresh.blocks[i] = -1;
+    }
+    for (int i = 0; i < MAX_FILE_BLOCKS; i++) {
+        map[i] = -1;
+    }
+    if (ret >= 0 && size > 0) {
+        ret = write_fresh_blocks(ctx, &fresh, map, data, size);
+    }
+    free(data);
+    if (ret < 0) {
+        for (int i = 0; i < MAX_FILE_BLOCKS; i++) {
+            if (map[i] != -1) {
+                clear_data_block(ctx, WFS_BLOCK_ID(map[i]));
+            }
+        }
+        if (fresh.blocks[N_BLOCKS - 1] != -1) {
+            clear_data_block(ctx, fresh.blocks[N_BLOCKS - 1]);
+        }
+        return ret;
+    }
+
+    write_inode(ctx, &fresh, inode_num);
+    free_file_blocks(ctx, &file_inode);
+    return 0;
+}
+
+int engine_unlink(struct wfs_ctx *ctx, const char *path) {
+    if (ctx->missing_disk >= 0) {
+        return -EROFS;
+    }
+
+    int inode_num = get_inode_index(ctx, path);
+    if (inode_num == -ENOENT) {
+        return -ENOENT;
+    }
+
+    struct wfs_inode file_inode;
+    load_inode(ctx, &file_inode, inode_num);
+
+    if (!S_ISREG(file_inode.mode)) {
+        return -EISDIR;
+    }
+
+    free_file_blocks(ctx, &file_inode);
+
+    memset(&file_inode, -1, sizeof(file_inode));
+    write_inode(ctx, &file_inode, inode_num);
+    free_inode(ctx, inode_num);
+
+    char parent_path[PATH_MAX];
+    char dir_name[MAX_NAME];
+    if (split_path(path, parent_path, dir_name) == -1) {
+        return -EINVAL;
+    }
+
+    int parent_inode_num = get_inode_index(ctx, parent_path);
+    if (parent_inode_num == -ENOENT) {
+        return -ENOENT;
+    }
+
+    if (delete_directory_entry(ctx, parent_inode_num, dir_name) != 0) {
+        return -EIO;
+    }
+
+    return 0;
+}
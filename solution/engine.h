@@ -0,0 +1,170 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "discard.h"
+#include "grow.h"
+#include "intent.h"
+#include "layout.h"
+#include "mapping.h"
+#include "pio.h"
+#include "rebuild.h"
+#include "record.h"
+#include "residency.h"
+#include "stats.h"
+#include "tier.h"
+#include "trace.h"
+#include "wfs.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define RAID_0 0
+#define RAID_1 1
+#define RAID_2 2
+#define RAID_5 3
+#define RAID_10 4
+
+//Most data blocks one file can address: the direct pointers plus one indirect block
+#define MAX_FILE_BLOCKS (N_BLOCKS - 1 + BLOCK_SIZE / sizeof(off_t))
+
+//RAID 10 mirrors disk 2k on disk 2k+1 and stripes blocks over the pairs
+#define RAID10_PARTNER(disk) ((disk) ^ 1)
+
+#define INODE_OFFSET(ctx, i) ((ctx)->sb.i_blocks_ptr + (off_t)(i)*BLOCK_SIZE)
+#define INODE_BITMAP_OFFSET(ctx) ((ctx)->sb.i_bitmap_ptr)
+#define DIRENTRY_OFFSET(ctx, block, i) ((ctx)->sb.d_blocks_ptr + (off_t)(block)*BLOCK_SIZE + (i)*sizeof(struct wfs_dentry))
+#define DATA_BLOCK_OFFSET(ctx, i) ((ctx)->sb.d_blocks_ptr + (off_t)(i)*BLOCK_SIZE)
+#define DATA_BITMAP_OFFSET(ctx) ((ctx)->sb.d_bitmap_ptr)
+
+//Address of [offset, offset + len) of a disk, valid until the next mapping_release. Metadata
+//and whole-image mappings are a plain add; only windowed data goes through the LRU.
+#define DISK_RANGE(ctx, disk, offset, len)                                                 \
+  (!(ctx)->mapping.window_bytes || (size_t)(offset) + (len) <= (ctx)->mapping.meta_bytes    \
+       ? (char *)(ctx)->disk_mmaps[disk] + (offset)                                        \
+       : mapping_window(ctx, disk, offset, len))
+//Windows are block aligned, so one byte's window holds the rest of its block
+#define DISK_PTR(ctx, disk, offset) DISK_RANGE(ctx, disk, offset, 1)
+
+//Every access to a mapped disk goes through one of these so stats and tracing see it
+#define IO_READ(ctx, disk, offset, bytes) account_io(ctx, disk, offset, bytes, TRACE_OP_READ)
+#define IO_WRITE(ctx, disk, offset, bytes) account_io(ctx, disk, offset, bytes, TRACE_OP_WRITE)
+
+//RAID 1 and 1v keep identical copies of all blocks on each disk
+#define IS_MIRRORED(ctx) ((ctx)->layout->mirrored)
+//Data blocks and data bitmaps have a second copy to keep in step (RAID 5 parity aside)
+#define HAS_DATA_COPIES(ctx) ((ctx)->layout->data_copies)
+
+//Entries of the directory listed last. The getattr FUSE issues for each
+//name of a listing is answered from here instead of a walk from the root;
+//any change to a directory drops it.
+#define DIR_CACHE_ENTRIES (N_BLOCKS * (BLOCK_SIZE / sizeof(struct wfs_dentry)))
+
+struct wfs_dir_cache {
+  char path[PATH_MAX]; //directory the entries belong to, "" when empty
+  size_t path_len;
+  int count;
+  struct {
+    char name[MAX_NAME];
+    int num;
+  } entries[DIR_CACHE_ENTRIES];
+};
+
+/*
+  Engine context: the mapped disk images and the superblock they were
+  formatted with. Everything in libwfs operates on one of these, so the
+  engine can be driven by the FUSE callbacks or directly on disk images
+  (bench, tools) without a mount.
+*/
+struct wfs_ctx {
+  void **disk_mmaps; //whole images, or just their metadata prefix when windowed
+  int num_disks;
+  size_t *disk_sizes;
+  struct wfs_sb sb;
+  const struct wfs_layout *layout; //block operations of sb.raid_mode, picked at open
+  int missing_disk; //disk absent at mount (reads do without it, writes fail), or -1
+  int meta_disk;    //present disk the mirrored metadata is read from
+  int meta_copies;  //disks holding each inode and the inode bitmap (see meta_copy_disk)
+  int compress_new_files; //--compress: regular files are created with WFS_INODE_COMPRESSED
+  off_t free_block_hint;  //every block id below is in use, so allocation scans start here
+  size_t free_inode_hint; //likewise for inode numbers
+  struct wfs_stats stats;
+  struct wfs_trace *trace; //NULL unless block tracing is enabled
+  struct wfs_recorder *recorder; //NULL unless workload recording is enabled
+  struct wfs_residency residency; //applied when the filesystem starts serving
+  struct wfs_intent intent;       //regions whose copies may disagree after a crash
+  struct wfs_mapping mapping;     //how the images are mapped
+  struct wfs_dir_cache dir_cache; //names from the last readdir
+  struct wfs_tier tier;           //which disks reads and new blocks prefer
+  struct wfs_discard discard;     //freed blocks waiting to be punched out of the images
+  struct wfs_grow grow;           //rebalance onto a disk added while mounted
+  struct wfs_pio pio;             //per-disk workers splitting large reads and writes
+  pthread_mutex_t lock;     //held by callers around every engine operation
+  //Background zeroing of an inode table mkfs left uninitialised:
+  pthread_t lazy_init_thread;
+  int lazy_init_running;
+  int lazy_init_stop;
+  size_t lazy_init_cursor;
+};
+
+//Same shape as fuse_fill_dir_t so FUSE fillers can be passed straight through
+typedef int (*wfs_filler_t)(void *buf, const char *name, const struct stat *stbuf, off_t off);
+
+//Context setup:
+int wfs_ctx_open(struct wfs_ctx *ctx, char **disk_paths, int num_disks);
+int wfs_ctx_open_windowed(struct wfs_ctx *ctx, char **disk_paths, int num_disks,
+                          size_t window_bytes, int max_windows);
+void wfs_ctx_close(struct wfs_ctx *ctx);
+int wfs_lazy_init_step(struct wfs_ctx *ctx, size_t max_inodes);
+int wfs_lazy_init_start(struct wfs_ctx *ctx);
+
+void account_io(struct wfs_ctx *ctx, int disk, off_t offset, size_t bytes, int op);
+
+//Inodes:
+void load_inode(struct wfs_ctx *ctx, struct wfs_inode *inode, size_t inode_index);
+void write_inode(struct wfs_ctx *ctx, const struct wfs_inode *inode, size_t inode_index);
+int inode_allocated(struct wfs_ctx *ctx, size_t i);
+int meta_copies_of(const struct wfs_sb *sb, int num_disks);
+int meta_copy_disk(const struct wfs_ctx *ctx, off_t offset, int copy);
+void write_metadata(struct wfs_ctx *ctx, const void *data, off_t offset, size_t size);
+int get_free_inode(struct wfs_ctx *ctx);
+int setup_inode(struct wfs_ctx *ctx, mode_t mode, mode_t type_flag);
+void free_inode(struct wfs_ctx *ctx, int inode_index);
+
+//Directories and path lookup:
+int find_dir_entry_in_inode(struct wfs_ctx *ctx, int parent_inode_num, const char *name);
+int delete_directory_entry(struct wfs_ctx *ctx, int parent_inode_num, const char *name);
+int get_inode_index(struct wfs_ctx *ctx, const char *path);
+int find_duplicate_directory_entry(struct wfs_ctx *ctx, const struct wfs_inode *parent_inode, const char *dirname);
+int insert_directory_entry(struct wfs_ctx *ctx, struct wfs_inode *parent_inode, int parent_inode_num, const char *dirname, int inode_num);
+
+//Data blocks and RAID:
+off_t num_block_ids(const struct wfs_ctx *ctx);
+char *data_block_ptr(struct wfs_ctx *ctx, off_t block_index);
+void read_data_block(struct wfs_ctx *ctx, void *block, size_t block_index);
+void write_data_block(struct wfs_ctx *ctx, const void *block, size_t block_index);
+void set_indirect_block(struct wfs_ctx *ctx, off_t block_num);
+off_t get_data_block(struct wfs_ctx *ctx);
+int get_data_blocks(struct wfs_ctx *ctx, int count, off_t *ids);
+int get_tier_blocks(struct wfs_ctx *ctx, int count, off_t *ids, int tier, int strict);
+void clear_data_block(struct wfs_ctx *ctx, off_t block_index);
+
+//Find which disk belongs to:
+static inline off_t calculate_raid_disk(const struct wfs_ctx *ctx, int *disk_index, off_t block_index) {
+  return ctx->layout->map(ctx, disk_index, block_index);
+}
+
+//Filesystem operations, one per FUSE callback:
+int engine_getattr(struct wfs_ctx *ctx, const char *path, struct stat *stbuf);
+int engine_mknod(struct wfs_ctx *ctx, const char *path, mode_t mode);
+int engine_mkdir(struct wfs_ctx *ctx, const char *path, mode_t mode);
+int engine_unlink(struct wfs_ctx *ctx, const char *path);
+int engine_rmdir(struct wfs_ctx *ctx, const char *path);
+int engine_read(struct wfs_ctx *ctx, const char *path, char *buf, size_t size, off_t offset);
+int engine_write(struct wfs_ctx *ctx, const char *path, const char *buf, size_t size, off_t offset);
+int engine_readdir(struct wfs_ctx *ctx, const char *path, void *buf, wfs_filler_t filler, off_t offset);
+int engine_copy_file_range(struct wfs_ctx *ctx, const char *src_path, off_t off_in,
+                           const char *dst_path, off_t off_out, size_t len);
+int engine_set_compression(struct wfs_ctx *ctx, const char *path, int enable);
+
+#endif
@@ -0,0 +1,329 @@
+#include "grow.h"
+#include "engine.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+static int has_grow_fields(const struct wfs_sb *sb) {
+  return sb->i_bitmap_ptr >= (off_t)(offsetof(struct wfs_sb, grow_cursor) + sizeof(sb->grow_cursor));
+}
+
+//Images formatted before online grow existed keep their inode bitmap where its fields would be
+void grow_fixup_superblock(struct wfs_sb *sb) {
+  if (!has_grow_fields(sb)) {
+    sb->grow_from_disks = 0;
+    sb->grow_cursor = 0;
+  }
+}
+
+//Store the disk count and rebalance state of ctx->sb in every superblock
+static void store_geometry(struct wfs_ctx *ctx) {
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    struct wfs_sb *disk_sb = (struct wfs_sb *)DISK_PTR(ctx, disk, 0);
+    disk_sb->total_disks = ctx->sb.total_disks;
+    disk_sb->meta_copies = ctx->sb.meta_copies;
+    memcpy(disk_sb->disk_tiers, ctx->sb.disk_tiers, sizeof(disk_sb->disk_tiers));
+    disk_sb->grow_from_disks = ctx->sb.grow_from_disks;
+    disk_sb->grow_cursor = ctx->sb.grow_cursor;
+    IO_WRITE(ctx, disk, offsetof(struct wfs_sb, total_disks), sizeof(disk_sb->total_disks));
+    IO_WRITE(ctx, disk, offsetof(struct wfs_sb, meta_copies),
+             offsetof(struct wfs_sb, grow_cursor) + sizeof(disk_sb->grow_cursor) - offsetof(struct wfs_sb, meta_copies));
+  }
+}
+
+//After a crash partway through store_geometry the superblocks disagree; wfs_ctx_open took the
+//one with the most disks, so write it back everywhere before anything else does
+void grow_open(struct wfs_ctx *ctx) {
+  if (ctx->sb.raid_mode != RAID_0 || !has_grow_fields(&ctx->sb) || ctx->missing_disk >= 0) {
+    return;
+  }
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    const struct wfs_sb *disk_sb = (const struct wfs_sb *)DISK_PTR(ctx, disk, 0);
+    if (disk_sb->total_disks != ctx->sb.total_disks || disk_sb->grow_from_disks != ctx->sb.grow_from_disks ||
+        disk_sb->grow_cursor != ctx->sb.grow_cursor) {
+      store_geometry(ctx);
+      return;
+    }
+  }
+}
+
+//The image must be a mkfs'd filesystem with this one's layout, and not one of its disks already
+static int check_new_image(struct wfs_ctx *ctx, int fd, const struct stat *st, struct wfs_sb *image_sb) {
+  if (pread(fd, image_sb, sizeof(*image_sb), 0) != sizeof(*image_sb) ||
+      image_sb->num_inodes != ctx->sb.num_inodes || image_sb->num_data_blocks != ctx->sb.num_data_blocks ||
+      image_sb->i_bitmap_ptr != ctx->sb.i_bitmap_ptr || image_sb->d_bitmap_ptr != ctx->sb.d_bitmap_ptr ||
+      image_sb->i_blocks_ptr != ctx->sb.i_blocks_ptr || image_sb->d_blocks_ptr != ctx->sb.d_blocks_ptr ||
+      st->st_size < ctx->sb.d_blocks_ptr + (off_t)(ctx->sb.num_data_blocks * BLOCK_SIZE)) {
+    return -EINVAL;
+  }
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    struct stat other;
+    if (fstat(ctx->mapping.fds[disk], &other) == 0 && other.st_dev == st->st_dev && other.st_ino == st->st_ino) {
+      return -EEXIST;
+    }
+  }
+  return 0;
+}
+
+static void put_metadata(struct wfs_ctx *ctx, int disk, const void *data, off_t offset, size_t size) {
+  memcpy(DISK_PTR(ctx, disk, offset), data, size);
+  IO_WRITE(ctx, disk, offset, size);
+}
+
+//Give the new disk its copies of the inode bitmap and table and an empty data bitmap. With -m,
+//inode copies rotate over the disks by inode number, so every inode's copies are also written
+//where the larger disk count puts them; the old copies stay valid until the superblocks switch.
+//A table mkfs -K left stale is zeroed where nothing is copied, as the lazy pass would have.
+static void copy_metadata(struct wfs_ctx *ctx, int new_disk, int all_copies, int stale_table) {
+  size_t bitmap_size = (ctx->sb.num_data_blocks + 7) / 8;
+  memset(DISK_PTR(ctx, new_disk, DATA_BITMAP_OFFSET(ctx)), 0, bitmap_size);
+  IO_WRITE(ctx, new_disk, DATA_BITMAP_OFFSET(ctx), bitmap_size);
+
+  //Copied straight from where the bitmap is mapped; the new disk's copy is not read from
+  if (all_copies) {
+    int disk = ctx->meta_disk;
+    size_t inode_bitmap_size = (ctx->sb.num_inodes + 7) / 8;
+    IO_READ(ctx, disk, INODE_BITMAP_OFFSET(ctx), inode_bitmap_size);
+    put_metadata(ctx, new_disk, DISK_PTR(ctx, disk, INODE_BITMAP_OFFSET(ctx)), INODE_BITMAP_OFFSET(ctx),
+                 inode_bitmap_size);
+  }
+  for (size_t i = 0; i < ctx->sb.num_inodes; i++) {
+    if (!inode_allocated(ctx, i)) {
+      if (stale_table) {
+        memset(DISK_PTR(ctx, new_disk, INODE_OFFSET(ctx, i)), 0, BLOCK_SIZE);
+        IO_WRITE(ctx, new_disk, INODE_OFFSET(ctx, i), BLOCK_SIZE);
+      }
+      continue;
+    }
+    struct wfs_inode inode;
+    load_inode(ctx, &inode, i);
+    for (int copy = 0; copy < (all_copies ? 1 : ctx->meta_copies); copy++) {
+      int disk = all_copies ? new_disk : (i + copy) % (new_disk + 1);
+      put_metadata(ctx, disk, &inode, INODE_OFFSET(ctx, i), sizeof(inode));
+    }
+  }
+}
+
+/*
+  Add the image at path as the next disk of a mounted RAID 0 filesystem,
+  tagged with tier. The new disk's metadata is written and synced before
+  any old superblock names it, and the old disks only switch once it is
+  in place; the rebalance then runs from grow_rebalance_step. Caller holds
+  ctx->lock. Returns 0 or a negative errno.
+*/
+int grow_add_disk(struct wfs_ctx *ctx, const char *path, int tier) {
+  int new_disk = ctx->num_disks;
+  if (ctx->sb.raid_mode != RAID_0 || !has_grow_fields(&ctx->sb) ||
+      (tier != WFS_TIER_CAPACITY && tier != WFS_TIER_FAST)) {
+    return -EINVAL;
+  }
+  if (ctx->missing_disk >= 0) {
+    return -EROFS;
+  }
+  if (ctx->sb.grow_from_disks) {
+    return -EBUSY;
+  }
+  if (new_disk == MAX_DISKS) {
+    return -ENOSPC;
+  }
+
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    return -errno;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+  struct wfs_sb image_sb;
+  int ret = check_new_image(ctx, fd, &st, &image_sb);
+  if (ret < 0) {
+    close(fd);
+    return ret;
+  }
+  void *map = mapping_open_disk(ctx, new_disk, fd, st.st_size, ctx->sb.d_blocks_ptr);
+  if (!map) {
+    return -EIO;
+  }
+  ctx->disk_mmaps[new_disk] = map;
+  ctx->disk_sizes[new_disk] = st.st_size;
+
+  int all_copies = ctx->meta_copies >= new_disk;
+  copy_metadata(ctx, new_disk, all_copies, (image_sb.flags & WFS_SB_ITABLE_UNINIT) != 0);
+
+  ctx->sb.total_disks = new_disk + 1;
+  ctx->sb.meta_copies = all_copies ? 0 : ctx->meta_copies;
+  ctx->sb.disk_tiers[new_disk] = tier;
+  ctx->sb.grow_from_disks = new_disk;
+  ctx->sb.grow_cursor = 0;
+
+  //The new superblock carries the live write-intent bits; its own disk id stays
+  struct wfs_sb *new_sb = (struct wfs_sb *)DISK_PTR(ctx, new_disk, 0);
+  uint64_t disk_id = new_sb->disk_id;
+  memcpy(new_sb, &ctx->sb, sizeof(struct wfs_sb));
+  memcpy(new_sb->write_intent, ((struct wfs_sb *)DISK_PTR(ctx, 0, 0))->write_intent, WFS_INTENT_BYTES);
+  new_sb->disk_index = new_disk;
+  new_sb->disk_id = disk_id;
+  IO_WRITE(ctx, new_disk, 0, sizeof(struct wfs_sb));
+  for (int disk = 0; disk <= new_disk; disk++) {
+    mapping_sync(ctx, disk, 0, ctx->sb.d_blocks_ptr);
+  }
+
+  ctx->num_disks = new_disk + 1;
+  store_geometry(ctx);
+  for (int disk = 0; disk < new_disk; disk++) {
+    mapping_sync(ctx, disk, 0, sizeof(struct wfs_sb));
+  }
+  ctx->meta_copies = meta_copies_of(&ctx->sb, ctx->num_disks);
+  if (tier_add_disk(ctx, new_disk) != 0) {
+    perror("Error growing the tier heat table");
+  }
+  STATS_ADD(ctx->stats.grow_disks_added, 1);
+  return 0;
+}
+
+//Where block id sits when the stripe spans num_disks disks (see raid0.c)
+static size_t raid0_place(const struct wfs_ctx *ctx, int num_disks, size_t id, int *disk) {
+  size_t chunk_blocks = ctx->sb.chunk_blocks > 1 ? ctx->sb.chunk_blocks : 1;
+  size_t chunk = id / chunk_blocks;
+  *disk = chunk % num_disks;
+  return chunk / num_disks * chunk_blocks + id % chunk_blocks;
+}
+
+static int test_bit(const char *bits, size_t bit) {
+  return bits[bit / 8] & (1 << (bit % 8));
+}
+
+static void put_bit(struct wfs_ctx *ctx, int disk, size_t bit, int value) {
+  char *byte = DISK_PTR(ctx, disk, DATA_BITMAP_OFFSET(ctx) + bit / 8);
+  *byte = value ? *byte | (1 << (bit % 8)) : *byte & ~(1 << (bit % 8));
+  IO_WRITE(ctx, disk, DATA_BITMAP_OFFSET(ctx) + bit / 8, 1);
+}
+
+/*
+  Move the next chunks from the old layout to the new one, used blocks
+  and bitmap bits alike, and persist the cursor. An id's new place was
+  the old place of an id no larger, already moved; its old place is the
+  new place of a larger one, and is left free until that one arrives.
+  The new places are written and synced before the old bits are cleared,
+  so a batch redone after a crash finds each id used at one place or the
+  other. Caller holds ctx->lock. Returns 1 while work remains.
+*/
+int grow_rebalance_step(struct wfs_ctx *ctx, size_t max_chunks) {
+  struct wfs_sb *sb = &ctx->sb;
+  if (!sb->grow_from_disks || ctx->missing_disk >= 0) {
+    return 0;
+  }
+
+  size_t chunk_blocks = sb->chunk_blocks > 1 ? sb->chunk_blocks : 1;
+  size_t old_ids = sb->num_data_blocks * sb->grow_from_disks;
+  //Near the start a batch could overwrite the old place of one of its own ids; redoing it after
+  //a crash would then copy garbage, so batches grow with the cursor up to max_chunks
+  size_t batch = MIN(max_chunks, MAX(sb->grow_cursor / chunk_blocks / ctx->num_disks, 1));
+  size_t end = MIN(sb->grow_cursor + batch * chunk_blocks, old_ids);
+  size_t first_local[MAX_DISKS];
+  size_t last_local[MAX_DISKS] = {0};
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    first_local[disk] = SIZE_MAX;
+  }
+
+  for (size_t id = sb->grow_cursor; id < end; id++) {
+    int old_disk, new_disk;
+    size_t old_local = raid0_place(ctx, sb->grow_from_disks, id, &old_disk);
+    size_t new_local = raid0_place(ctx, ctx->num_disks, id, &new_disk);
+    if (old_disk == new_disk && old_local == new_local) {
+      continue;
+    }
+    int used = test_bit(DISK_PTR(ctx, old_disk, DATA_BITMAP_OFFSET(ctx)), old_local) ||
+               test_bit(DISK_PTR(ctx, new_disk, DATA_BITMAP_OFFSET(ctx)), new_local);
+    IO_READ(ctx, old_disk, DATA_BITMAP_OFFSET(ctx) + old_local / 8, 1);
+    if (used) {
+      off_t old_offset = DATA_BLOCK_OFFSET(ctx, old_local);
+      off_t new_offset = DATA_BLOCK_OFFSET(ctx, new_local);
+      memcpy(DISK_PTR(ctx, new_disk, new_offset), DISK_PTR(ctx, old_disk, old_offset), BLOCK_SIZE);
+      IO_READ(ctx, old_disk, old_offset, BLOCK_SIZE);
+      IO_WRITE(ctx, new_disk, new_offset, BLOCK_SIZE);
+      first_local[new_disk] = MIN(first_local[new_disk], new_local);
+      last_local[new_disk] = MAX(last_local[new_disk], new_local);
+      STATS_ADD(ctx->stats.rebalance_blocks_moved, 1);
+    }
+    put_bit(ctx, new_disk, new_local, used);
+  }
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    if (first_local[disk] != SIZE_MAX) {
+      mapping_sync(ctx, disk, DATA_BLOCK_OFFSET(ctx, first_local[disk]),
+                   (last_local[disk] - first_local[disk] + 1) * BLOCK_SIZE);
+    }
+    mapping_sync(ctx, disk, DATA_BITMAP_OFFSET(ctx), (sb->num_data_blocks + 7) / 8);
+  }
+
+  for (size_t id = sb->grow_cursor; id < end; id++) {
+    int old_disk, new_disk;
+    size_t old_local = raid0_place(ctx, sb->grow_from_disks, id, &old_disk);
+    size_t new_local = raid0_place(ctx, ctx->num_disks, id, &new_disk);
+    if (old_disk != new_disk || old_local != new_local) {
+      put_bit(ctx, old_disk, old_local, 0);
+    }
+  }
+  for (int disk = 0; disk < sb->grow_from_disks; disk++) {
+    mapping_sync(ctx, disk, DATA_BITMAP_OFFSET(ctx), (sb->num_data_blocks + 7) / 8);
+  }
+
+  sb->grow_cursor = end;
+  if (end == old_ids) {
+    sb->grow_from_disks = 0;
+    sb->grow_cursor = 0;
+  }
+  store_geometry(ctx);
+  return sb->grow_from_disks != 0;
+}
+
+static void *rebalance_thread(void *arg) {
+  struct wfs_ctx *ctx = arg;
+  int more = 1;
+  while (more && !__atomic_load_n(&ctx->grow.rebalance_stop, __ATOMIC_ACQUIRE)) {
+    pthread_mutex_lock(&ctx->lock);
+    more = grow_rebalance_step(ctx, WFS_REBALANCE_BATCH);
+    mapping_release(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+    if (more) {
+      usleep(WFS_REBALANCE_INTERVAL_US);
+    }
+  }
+  return NULL;
+}
+
+//Run or resume the rebalance in the background; a no-op when there is none to do
+int grow_start_rebalance(struct wfs_ctx *ctx) {
+  if (!ctx->sb.grow_from_disks || ctx->missing_disk >= 0) {
+    return 0;
+  }
+  //A thread left from an earlier grow has returned: a disk is only added once its last step found
+  //nothing more to move
+  if (ctx->grow.rebalance_running) {
+    pthread_join(ctx->grow.rebalance_thread, NULL);
+    ctx->grow.rebalance_running = 0;
+  }
+  if (pthread_create(&ctx->grow.rebalance_thread, NULL, rebalance_thread, ctx) != 0) {
+    return -1;
+  }
+  ctx->grow.rebalance_running = 1;
+  return 0;
+}
+
+void grow_close(struct wfs_ctx *ctx) {
+  struct wfs_grow *grow = &ctx->grow;
+  if (grow->rebalance_running) {
+    __atomic_store_n(&grow->rebalance_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(grow->rebalance_thread, NULL);
+    grow->rebalance_running = 0;
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef GROW_H
+#define GROW_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "wfs.h"
+
+/*
+  Online growth of a RAID 0 filesystem by one disk at a time. The added
+  image, formatted by mkfs with the same -i and -b, gets a copy of the
+  metadata and every superblock then records the new disk count along
+  with the count it grew from. Block ids keep their meaning, so no inode
+  or indirect block changes; only where an id lives does. Ids below
+  wfs_sb.grow_cursor sit in the layout over every disk, the rest still in
+  the layout over the old ones, and a throttled background rebalance
+  moves ids over in order, persisting the cursor after each batch. Moving
+  an id only ever overwrites the old place of a smaller one, and batches
+  are kept short enough near the start that redoing one after a crash
+  never reads a place the batch itself has overwritten. The new disk's
+  share of ids is handed out once the rebalance is done.
+*/
+
+//Chunks moved per lock hold, and the pause between batches
+#define WFS_REBALANCE_BATCH 64
+#define WFS_REBALANCE_INTERVAL_US 10000
+
+struct wfs_grow {
+  pthread_t rebalance_thread;
+  int rebalance_running;
+  int rebalance_stop;
+};
+
+struct wfs_ctx;
+
+void grow_fixup_superblock(struct wfs_sb *sb);
+void grow_open(struct wfs_ctx *ctx);
+int grow_add_disk(struct wfs_ctx *ctx, const char *path, int tier);
+int grow_rebalance_step(struct wfs_ctx *ctx, size_t max_chunks);
+int grow_start_rebalance(struct wfs_ctx *ctx);
+void grow_close(struct wfs_ctx *ctx);
+
+#endif
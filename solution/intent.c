@@ -0,0 +1,369 @@
+#include "intent.h"
+#include "engine.h"
+#include "parity.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define INTENT_REGIONS (WFS_INTENT_BYTES * 8)
+#define INTENT_OFFSET offsetof(struct wfs_sb, write_intent)
+
+//The cleaner wakes this often to notice a stop request; it clears every WFS_INTENT_CLEAR_INTERVAL_US
+#define CLEANER_TICK_US 100000
+
+static int test_bit(const uint8_t *bits, int region) {
+  return bits[region / 8] & (1 << (region % 8));
+}
+
+//First and one-past-last byte a region covers; the last region is cut short by the image
+static void region_bounds(const struct wfs_ctx *ctx, int region, off_t *start, off_t *end) {
+  off_t image_end = ctx->sb.d_blocks_ptr + (off_t)ctx->sb.num_data_blocks * BLOCK_SIZE;
+  *start = ctx->sb.i_bitmap_ptr + (off_t)region * ctx->intent.region_bytes;
+  *end = MIN(*start + (off_t)ctx->intent.region_bytes, image_end);
+}
+
+//msync [offset, offset + len) of every disk
+static void sync_range(struct wfs_ctx *ctx, off_t offset, off_t len) {
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    mapping_sync(ctx, disk, offset, len);
+  }
+}
+
+static int has_generation(const struct wfs_sb *sb) {
+  return sb->i_bitmap_ptr >= (off_t)(offsetof(struct wfs_sb, generation) + sizeof(sb->generation));
+}
+
+//Images formatted before generations existed keep their inode bitmap where the UUID and counter would be
+void intent_fixup_superblock(struct wfs_sb *sb) {
+  if (!has_generation(sb)) {
+    memset(sb->fs_uuid, 0, WFS_UUID_BYTES);
+    sb->generation = 0;
+  }
+}
+
+//Copy ctx->sb.write_intent and the next generation to every superblock and wait until they are on disk
+static void store_bits(struct wfs_ctx *ctx) {
+  int generations = has_generation(&ctx->sb);
+  ctx->sb.generation += generations;
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    if (ctx->disk_mmaps[disk]) {
+      memcpy(DISK_PTR(ctx, disk, INTENT_OFFSET), ctx->sb.write_intent, WFS_INTENT_BYTES);
+      IO_WRITE(ctx, disk, INTENT_OFFSET, WFS_INTENT_BYTES);
+      if (generations) {
+        ((struct wfs_sb *)DISK_PTR(ctx, disk, 0))->generation = ctx->sb.generation;
+        IO_WRITE(ctx, disk, offsetof(struct wfs_sb, generation), sizeof(ctx->sb.generation));
+      }
+    }
+  }
+  sync_range(ctx, 0, sizeof(struct wfs_sb));
+}
+
+static int is_stale(const struct wfs_ctx *ctx, int disk) {
+  return (ctx->intent.stale_disks >> disk) & 1;
+}
+
+//First disk that is not stale; the mount refuses a filesystem where that leaves none
+static int first_fresh_disk(const struct wfs_ctx *ctx) {
+  int disk = 0;
+  while (is_stale(ctx, disk)) {
+    disk++;
+  }
+  return disk;
+}
+
+//Fresh disk whose copy of [offset, offset + len) most other fresh ones agree with; ties go to the lowest disk
+static int majority_disk(struct wfs_ctx *ctx, off_t offset, size_t len) {
+  int chosen = first_fresh_disk(ctx);
+  int highest_votes = -1;
+  for (int current = 0; current < ctx->num_disks; current++) {
+    if (is_stale(ctx, current)) {
+      continue;
+    }
+    int votes = 0;
+    for (int compare = 0; compare < ctx->num_disks; compare++) {
+      if (compare != current && !is_stale(ctx, compare) &&
+          memcmp(DISK_RANGE(ctx, current, offset, len), DISK_RANGE(ctx, compare, offset, len), len) == 0) {
+        votes++;
+      }
+    }
+    IO_READ(ctx, current, offset, len);
+    if (votes > highest_votes) {
+      highest_votes = votes;
+      chosen = current;
+    }
+  }
+  return chosen;
+}
+
+//Make every disk's copy of [start, end) match, block by block: the majority in RAID 1v, the first
+//fresh disk otherwise. Returns the bytes that differed.
+static size_t resync_all(struct wfs_ctx *ctx, off_t start, off_t end) {
+  size_t differed = 0;
+  for (off_t offset = start; offset < end; offset += BLOCK_SIZE) {
+    size_t len = MIN(BLOCK_SIZE, end - offset);
+    int source = ctx->sb.raid_mode == RAID_2 ? majority_disk(ctx, offset, len) : first_fresh_disk(ctx);
+    const char *data = DISK_RANGE(ctx, source, offset, len);
+    IO_READ(ctx, source, offset, len);
+    for (int disk = 0; disk < ctx->num_disks; disk++) {
+      char *copy = DISK_RANGE(ctx, disk, offset, len);
+      if (disk != source && memcmp(copy, data, len) != 0) {
+        memcpy(copy, data, len);
+        IO_WRITE(ctx, disk, offset, len);
+        differed += len;
+      }
+    }
+  }
+  return differed;
+}
+
+//Inode bitmap and table with fewer copies than disks: each block's first copy over its others
+static size_t resync_meta(struct wfs_ctx *ctx, off_t start, off_t end) {
+  size_t differed = 0;
+  for (off_t offset = start; offset < end; offset += BLOCK_SIZE) {
+    size_t len = MIN(BLOCK_SIZE, end - offset);
+    int source = meta_copy_disk(ctx, offset, 0);
+    const char *data = DISK_RANGE(ctx, source, offset, len);
+    IO_READ(ctx, source, offset, len);
+    for (int copy = 1; copy < ctx->meta_copies; copy++) {
+      int disk = meta_copy_disk(ctx, offset, copy);
+      char *target = DISK_RANGE(ctx, disk, offset, len);
+      if (memcmp(target, data, len) != 0) {
+        memcpy(target, data, len);
+        IO_WRITE(ctx, disk, offset, len);
+        differed += len;
+      }
+    }
+  }
+  return differed;
+}
+
+//RAID 10: copy each pair's even disk, or its odd one when the even one is stale, over its
+//partner where they differ, a block at a time
+static size_t resync_pairs(struct wfs_ctx *ctx, off_t start, off_t end) {
+  size_t differed = 0;
+  for (off_t offset = start; offset < end; offset += BLOCK_SIZE) {
+    size_t len = MIN(BLOCK_SIZE, end - offset);
+    for (int pair = 0; pair < ctx->num_disks; pair += 2) {
+      int disk = is_stale(ctx, pair) ? pair + 1 : pair;
+      int partner = RAID10_PARTNER(disk);
+      const char *data = DISK_RANGE(ctx, disk, offset, len);
+      char *copy = DISK_RANGE(ctx, partner, offset, len);
+      IO_READ(ctx, disk, offset, len);
+      if (memcmp(copy, data, len) != 0) {
+        memcpy(copy, data, len);
+        IO_WRITE(ctx, partner, offset, len);
+        differed += len;
+      }
+    }
+  }
+  return differed;
+}
+
+//RAID 5: recompute the parity of every row with a block in [start, end) of the data region
+static size_t resync_parity(struct wfs_ctx *ctx, off_t start, off_t end) {
+  size_t differed = 0;
+  if (end <= start) {
+    return 0;
+  }
+  size_t first_row = (start - ctx->sb.d_blocks_ptr) / BLOCK_SIZE;
+  size_t end_row = (end - ctx->sb.d_blocks_ptr + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for (size_t row = first_row; row < end_row; row++) {
+    off_t offset = DATA_BLOCK_OFFSET(ctx, row);
+    int parity_disk = raid5_parity_disk(ctx, row);
+    char parity[BLOCK_SIZE];
+    memset(parity, 0, BLOCK_SIZE);
+    for (int disk = 0; disk < ctx->num_disks; disk++) {
+      if (disk != parity_disk) {
+        parity_xor(parity, DISK_PTR(ctx, disk, offset), BLOCK_SIZE);
+        IO_READ(ctx, disk, offset, BLOCK_SIZE);
+      }
+    }
+    if (memcmp(DISK_PTR(ctx, parity_disk, offset), parity, BLOCK_SIZE) != 0) {
+      memcpy(DISK_PTR(ctx, parity_disk, offset), parity, BLOCK_SIZE);
+      IO_WRITE(ctx, parity_disk, offset, BLOCK_SIZE);
+      differed += BLOCK_SIZE;
+    }
+  }
+  return differed;
+}
+
+/*
+  Bring the copies of one region back in line. The inode bitmap and
+  table are mirrored on every disk in every mode, or on meta_copies of
+  them in a RAID 0 formatted with fewer; the data bitmaps and
+  data blocks are mirrored only in RAID 1/1v and within RAID 10 pairs,
+  and a RAID 5 row's copy of its data is its parity.
+*/
+static size_t resync_region(struct wfs_ctx *ctx, int region) {
+  const struct wfs_sb *sb = &ctx->sb;
+  off_t start, end;
+  region_bounds(ctx, region, &start, &end);
+
+  size_t (*resync_inodes)(struct wfs_ctx *, off_t, off_t) =
+      ctx->meta_copies < ctx->num_disks ? resync_meta : resync_all;
+  size_t differed = resync_inodes(ctx, MAX(start, sb->i_bitmap_ptr), MIN(end, sb->d_bitmap_ptr));
+  differed += resync_inodes(ctx, MAX(start, sb->i_blocks_ptr), MIN(end, sb->d_blocks_ptr));
+
+  off_t bitmap_start = MAX(start, sb->d_bitmap_ptr), bitmap_end = MIN(end, sb->i_blocks_ptr);
+  off_t data_start = MAX(start, sb->d_blocks_ptr);
+  if (IS_MIRRORED(ctx)) {
+    differed += resync_all(ctx, bitmap_start, bitmap_end);
+    differed += resync_all(ctx, data_start, end);
+  } else if (sb->raid_mode == RAID_10) {
+    differed += resync_pairs(ctx, bitmap_start, bitmap_end);
+    differed += resync_pairs(ctx, data_start, end);
+  } else if (sb->raid_mode == RAID_5) {
+    differed += resync_parity(ctx, data_start, end);
+  }
+  sync_range(ctx, start, end - start);
+  return differed;
+}
+
+//Size the regions and resync any the last mount left marked; returns the number resynced
+int intent_open(struct wfs_ctx *ctx) {
+  struct wfs_intent *intent = &ctx->intent;
+  //Images formatted before the bitmap existed keep their inode bitmap where it would be
+  if (ctx->num_disks < 2 || ctx->sb.i_bitmap_ptr < (off_t)(INTENT_OFFSET + WFS_INTENT_BYTES)) {
+    return 0;
+  }
+  intent->enabled = 1;
+  off_t span = ctx->sb.d_blocks_ptr + (off_t)ctx->sb.num_data_blocks * BLOCK_SIZE - ctx->sb.i_bitmap_ptr;
+  intent->region_bytes = MAX(ROUNDBLOCK((span + INTENT_REGIONS - 1) / INTENT_REGIONS), BLOCK_SIZE);
+
+  //A kill can land between the superblock updates, so a bit on any disk counts; a stale disk
+  //may differ anywhere
+  int marked = 0;
+  if (intent->stale_disks) {
+    memset(ctx->sb.write_intent, 0xff, WFS_INTENT_BYTES);
+  }
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    if (!ctx->disk_mmaps[disk]) {
+      continue;
+    }
+    const struct wfs_sb *disk_sb = (const struct wfs_sb *)DISK_PTR(ctx, disk, 0);
+    IO_READ(ctx, disk, INTENT_OFFSET, WFS_INTENT_BYTES);
+    for (int i = 0; i < WFS_INTENT_BYTES; i++) {
+      ctx->sb.write_intent[i] |= disk_sb->write_intent[i];
+      marked |= ctx->sb.write_intent[i];
+    }
+  }
+  if (!marked) {
+    return 0;
+  }
+  if (ctx->missing_disk >= 0) {
+    fprintf(stderr, "Unclean shutdown: dirty regions are left for a mount with every disk present\n");
+    return 0;
+  }
+
+  int regions = 0;
+  size_t differed = 0;
+  for (int region = 0; region < INTENT_REGIONS; region++) {
+    if (test_bit(ctx->sb.write_intent, region)) {
+      differed += resync_region(ctx, region);
+      regions++;
+      mapping_release(ctx);
+    }
+  }
+  memset(ctx->sb.write_intent, 0, WFS_INTENT_BYTES);
+  store_bits(ctx);
+  STATS_ADD(ctx->stats.intent_resynced_regions, regions);
+  fprintf(stderr, "%s: resynced %d of %d regions, %zu bytes differed\n",
+          intent->stale_disks ? "Stale disk" : "Unclean shutdown", regions, INTENT_REGIONS, differed);
+  intent->stale_disks = 0;
+  return regions;
+}
+
+//Called before any write that will go to more than one disk; the first write into a
+//region since its bit was cleared pays for one superblock sync. Caller holds ctx->lock.
+void intent_mark(struct wfs_ctx *ctx, off_t offset, size_t size) {
+  struct wfs_intent *intent = &ctx->intent;
+  if (!intent->enabled || size == 0 || offset < ctx->sb.i_bitmap_ptr) {
+    return;
+  }
+  int first = (offset - ctx->sb.i_bitmap_ptr) / intent->region_bytes;
+  int last = MIN((offset + (off_t)size - 1 - ctx->sb.i_bitmap_ptr) / (off_t)intent->region_bytes, INTENT_REGIONS - 1);
+  int newly_marked = 0;
+  for (int region = first; region <= last; region++) {
+    intent->recent[region / 8] |= 1 << (region % 8);
+    if (!test_bit(ctx->sb.write_intent, region)) {
+      ctx->sb.write_intent[region / 8] |= 1 << (region % 8);
+      newly_marked++;
+    }
+  }
+  if (newly_marked) {
+    store_bits(ctx);
+    STATS_ADD(ctx->stats.intent_marks, newly_marked);
+  }
+}
+
+//Drop the bits of regions not written since the last pass, syncing each first.
+//Caller holds ctx->lock. Returns the number of bits cleared.
+int intent_clear_idle(struct wfs_ctx *ctx) {
+  struct wfs_intent *intent = &ctx->intent;
+  if (!intent->enabled || ctx->missing_disk >= 0) {
+    return 0;
+  }
+  int cleared = 0;
+  for (int region = 0; region < INTENT_REGIONS; region++) {
+    if (test_bit(ctx->sb.write_intent, region) && !test_bit(intent->recent, region)) {
+      off_t start, end;
+      region_bounds(ctx, region, &start, &end);
+      sync_range(ctx, start, end - start);
+      ctx->sb.write_intent[region / 8] &= ~(1 << (region % 8));
+      cleared++;
+    }
+  }
+  memset(intent->recent, 0, WFS_INTENT_BYTES);
+  if (cleared) {
+    store_bits(ctx);
+    STATS_ADD(ctx->stats.intent_clears, cleared);
+  }
+  return cleared;
+}
+
+static void *cleaner_thread(void *arg) {
+  struct wfs_ctx *ctx = arg;
+  long waited = 0;
+  while (!__atomic_load_n(&ctx->intent.cleaner_stop, __ATOMIC_ACQUIRE)) {
+    usleep(CLEANER_TICK_US);
+    waited += CLEANER_TICK_US;
+    if (waited >= WFS_INTENT_CLEAR_INTERVAL_US) {
+      pthread_mutex_lock(&ctx->lock);
+      intent_clear_idle(ctx);
+      pthread_mutex_unlock(&ctx->lock);
+      waited = 0;
+    }
+  }
+  return NULL;
+}
+
+//Start the background pass that clears the bits of quiet regions
+int intent_start_cleaner(struct wfs_ctx *ctx) {
+  if (!ctx->intent.enabled || ctx->intent.cleaner_running || ctx->missing_disk >= 0) {
+    return 0;
+  }
+  if (pthread_create(&ctx->intent.cleaner_thread, NULL, cleaner_thread, ctx) != 0) {
+    return -1;
+  }
+  ctx->intent.cleaner_running = 1;
+  return 0;
+}
+
+//Clean shutdown: stop the cleaner, then sync and clear every remaining bit and move every
+//disk on a generation
+void intent_close(struct wfs_ctx *ctx) {
+  struct wfs_intent *intent = &ctx->intent;
+  if (intent->cleaner_running) {
+    __atomic_store_n(&intent->cleaner_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(intent->cleaner_thread, NULL);
+    intent->cleaner_running = 0;
+  }
+  memset(intent->recent, 0, WFS_INTENT_BYTES);
+  if (!intent_clear_idle(ctx) && intent->enabled && ctx->missing_disk < 0) {
+    store_bits(ctx);
+  }
+  intent->enabled = 0;
+}
@@ -0,0 +1,49 @@
+#ifndef INTENT_H
+#define INTENT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "wfs.h"
+
+/*
+  Write-intent bitmap. Everything after the superblock is split into
+  256 coarse regions, and a region's bit is set in every superblock and
+  synced before the first write into it goes out. Bits of regions that
+  stay quiet for a clearing interval are dropped once the region itself
+  is synced. After a crash or kill only the regions still marked can
+  have copies that disagree, so the next mount resyncs just those.
+
+  Each update of the bits, and each clean unmount, also moves every
+  superblock on to the next generation. Disks written together can end
+  up at most one generation apart, and then the bits they carry cover
+  what differs. A disk further behind, say an old copy of an image put
+  back, is stale: the mount takes the freshest superblock as the
+  filesystem's and marks every region, so each is resynced from the
+  disks that are current.
+*/
+
+//How long a region must go unwritten before the cleaner drops its bit
+#define WFS_INTENT_CLEAR_INTERVAL_US 1000000
+
+struct wfs_intent {
+  int enabled;                       //more than one disk, and the image has room for the bitmap
+  int stale_disks;                   //mask of disks found behind at mount; never a resync source
+  size_t region_bytes;
+  uint8_t recent[WFS_INTENT_BYTES];  //regions written since the last clearing pass
+  pthread_t cleaner_thread;
+  int cleaner_running;
+  int cleaner_stop;
+};
+
+struct wfs_ctx;
+
+void intent_fixup_superblock(struct wfs_sb *sb);
+int intent_open(struct wfs_ctx *ctx);
+void intent_mark(struct wfs_ctx *ctx, off_t offset, size_t size);
+int intent_clear_idle(struct wfs_ctx *ctx);
+int intent_start_cleaner(struct wfs_ctx *ctx);
+void intent_close(struct wfs_ctx *ctx);
+
+#endif
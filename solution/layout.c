@@ -0,0 +1,82 @@
+#include "layout.h"
+#include "engine.h"
+
+//Table for a superblock's RAID mode, or NULL for a mode this build does not know
+const struct wfs_layout *layout_select(const struct wfs_sb *sb) {
+  switch (sb->raid_mode) {
+  case RAID_0:
+    return sb->chunk_blocks > 1 ? &raid0_chunked_layout : &raid0_layout;
+  case RAID_1:
+    return &raid1_layout;
+  case RAID_2:
+    return &raid1v_layout;
+  case RAID_5:
+    return &raid5_layout;
+  case RAID_10:
+    return &raid10_layout;
+  default:
+    return NULL;
+  }
+}
+
+//Blocks are read from where they live
+int layout_same_disk(const struct wfs_ctx *ctx, int disk, off_t local) {
+  (void)ctx;
+  (void)local;
+  return disk;
+}
+
+//Each disk's data bitmap is read from the disk itself
+int layout_own_bitmap(const struct wfs_ctx *ctx, int disk) {
+  (void)ctx;
+  return disk;
+}
+
+//A block has no copy on another disk
+int layout_only_disk(const struct wfs_ctx *ctx, int disk, int *disks) {
+  (void)ctx;
+  disks[0] = disk;
+  return 1;
+}
+
+//A block goes with the same block of every disk
+int layout_every_disk(const struct wfs_ctx *ctx, int disk, int *disks) {
+  (void)disk;
+  for (int d = 0; d < ctx->num_disks; d++) {
+    disks[d] = d;
+  }
+  return ctx->num_disks;
+}
+
+//New blocks need no preparation
+void layout_none_allocated(struct wfs_ctx *ctx, const off_t *ids, int count) {
+  (void)ctx;
+  (void)ids;
+  (void)count;
+}
+
+//Copy a range of one disk out to buf
+void layout_copy_out(struct wfs_ctx *ctx, int disk, off_t local, size_t offset, size_t size, char *buf) {
+  off_t start = DATA_BLOCK_OFFSET(ctx, local) + offset;
+  pio_copy(ctx, disk, buf, DISK_RANGE(ctx, disk, start, size), size);
+  IO_READ(ctx, disk, start, size);
+}
+
+//Copy buf into a range of one disk; buf may already be that range, edited in place
+void layout_copy_in(struct wfs_ctx *ctx, int disk, off_t local, size_t offset, const char *buf, size_t size) {
+  off_t start = DATA_BLOCK_OFFSET(ctx, local) + offset;
+  char *target = DISK_RANGE(ctx, disk, start, size);
+  if (target != buf) {
+    pio_copy(ctx, disk, target, buf, size);
+  }
+  IO_WRITE(ctx, disk, start, size);
+}
+
+//Nothing mirrors a disk
+void layout_no_copies(struct wfs_ctx *ctx, const void *data, size_t offset, size_t size, int disk) {
+  (void)ctx;
+  (void)data;
+  (void)offset;
+  (void)size;
+  (void)disk;
+}
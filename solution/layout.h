@@ -0,0 +1,81 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "wfs.h"
+
+/*
+  RAID layouts. Each mode is a table of the operations that place, read
+  and write data blocks, built in its own file (raid0.c, raid1.c, raid5.c,
+  raid10.c) and picked once when the filesystem is opened. The engine
+  calls through ctx->layout and never branches on sb.raid_mode on a block
+  path, so each mode's loops carry only its own logic, and a new RAID
+  level is a new table rather than another case in every caller.
+
+  Ranges passed to read_range and write_range start offset bytes into the
+  local-th block of a disk and may run over several blocks on it, except
+  where the flags below say a mode works block by block.
+*/
+
+struct wfs_ctx;
+
+struct wfs_layout {
+  const char *name;
+  int mirrored;    //every disk holds a copy of every block (RAID 1, 1v)
+  int data_copies; //data blocks and data bitmaps have a copy to keep in step (RAID 1, 1v, 10)
+  int votes;       //file data is read block by block, voting across the copies (RAID 1v)
+  int parity;      //writes go block by block to keep each row's parity (RAID 5)
+
+  //Disk a block id lives on, returning its index there
+  off_t (*map)(const struct wfs_ctx *ctx, int *disk, off_t block_id);
+  //Whether the allocator hands out a block id that maps to local on disk; NULL when it hands out every id
+  int (*allocates)(const struct wfs_ctx *ctx, off_t block_id, int disk, off_t local);
+  //Called with the ids of a successful allocation before the bitmaps marking them are written back
+  void (*allocated)(struct wfs_ctx *ctx, const off_t *ids, int count);
+  //Disk to read a block from: a copy, or the missing disk itself when it must be rebuilt
+  int (*read_disk)(const struct wfs_ctx *ctx, int disk, off_t local);
+  //Disk to read the data bitmap of disk from
+  int (*bitmap_disk)(const struct wfs_ctx *ctx, int disk);
+  //Disks whose block local goes with that of disk, disk included: every mirror, the pair, or the
+  //whole RAID 5 row. Fills disks and returns how many; discard punches them together.
+  int (*copies)(const struct wfs_ctx *ctx, int disk, int *disks);
+  //Rebuild a block of the missing disk; only reached when read_disk returns it
+  void (*reconstruct)(struct wfs_ctx *ctx, void *block, off_t local);
+  //Copy file data out to buf
+  void (*read_range)(struct wfs_ctx *ctx, int disk, off_t local, size_t offset, size_t size, char *buf);
+  //Store file data
+  void (*write_range)(struct wfs_ctx *ctx, int disk, off_t local, size_t offset, const char *buf, size_t size);
+  //Copy bytes just written at offset of disk to the disks that mirror it
+  void (*replicate)(struct wfs_ctx *ctx, const void *data, size_t offset, size_t size, int disk);
+  //Full-stripe write of a row, blocks[disk] for every data disk; NULL without parity
+  void (*write_row)(struct wfs_ctx *ctx, off_t row, const char *blocks[]);
+};
+
+extern const struct wfs_layout raid0_layout;
+extern const struct wfs_layout raid0_chunked_layout;
+extern const struct wfs_layout raid1_layout;
+extern const struct wfs_layout raid1v_layout;
+extern const struct wfs_layout raid5_layout;
+extern const struct wfs_layout raid10_layout;
+
+const struct wfs_layout *layout_select(const struct wfs_sb *sb);
+
+//Shared by the layouts whose blocks are plain copies
+int layout_same_disk(const struct wfs_ctx *ctx, int disk, off_t local);
+int layout_own_bitmap(const struct wfs_ctx *ctx, int disk);
+int layout_only_disk(const struct wfs_ctx *ctx, int disk, int *disks);
+int layout_every_disk(const struct wfs_ctx *ctx, int disk, int *disks);
+void layout_none_allocated(struct wfs_ctx *ctx, const off_t *ids, int count);
+void layout_copy_out(struct wfs_ctx *ctx, int disk, off_t local, size_t offset, size_t size, char *buf);
+void layout_copy_in(struct wfs_ctx *ctx, int disk, off_t local, size_t offset, const char *buf, size_t size);
+void layout_no_copies(struct wfs_ctx *ctx, const void *data, size_t offset, size_t size, int disk);
+
+//RAID 5
+int raid5_parity_disk(const struct wfs_ctx *ctx, size_t row);
+
+//RAID 1 and 1v
+void synchronize_disks(struct wfs_ctx *ctx, const void *block, size_t block_offset, size_t block_size, int primary_disk_index);
+void find_majority_block(struct wfs_ctx *ctx, void *block, off_t block_index);
+
+#endif
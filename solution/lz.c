@@ -0,0 +1,160 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define HASH_BITS 12
+#define MAX_OFFSET 65535
+//The format ends every block with at least this many literals...
+#define LAST_LITERALS 5
+//...and starts no match closer than this to the end
+#define MATCH_LIMIT 12
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+//Bytes a length field of this size takes after its nibble in the token
+static size_t length_bytes(size_t len) {
+  return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+static uint8_t *put_length(uint8_t *op, size_t len) {
+  for (len -= 15; len >= 255; len -= 255) {
+    *op++ = 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+//One sequence: a token, the literals since anchor and, unless this is the last one, a match
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *anchor, size_t literals, size_t offset, size_t match_len) {
+  uint8_t *token = op++;
+  *token = (literals < 15 ? literals : 15) << 4;
+  if (literals >= 15) {
+    op = put_length(op, literals);
+  }
+  memcpy(op, anchor, literals);
+  op += literals;
+  if (offset) {
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    size_t extra = match_len - MIN_MATCH;
+    *token |= extra < 15 ? extra : 15;
+    if (extra >= 15) {
+      op = put_length(op, extra);
+    }
+  }
+  return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap) {
+  const uint8_t *base = src;
+  const uint8_t *ip = base;
+  const uint8_t *anchor = base;
+  const uint8_t *end = base + len;
+  uint8_t *op = dst;
+  uint8_t *op_end = op + cap;
+  uint16_t table[1 << HASH_BITS];
+
+  if (len > MAX_OFFSET) {
+    return 0;
+  }
+  memset(table, 0, sizeof(table));
+  if (len > MATCH_LIMIT) {
+    const uint8_t *match_start_limit = end - MATCH_LIMIT;
+    const uint8_t *match_end_limit = end - LAST_LITERALS;
+    while (ip < match_start_limit) {
+      uint32_t h = hash4(read32(ip));
+      const uint8_t *ref = base + table[h];
+      table[h] = ip - base;
+      if (ref >= ip || read32(ref) != read32(ip)) {
+        ip++;
+        continue;
+      }
+      const uint8_t *match_end = ip + MIN_MATCH;
+      while (match_end < match_end_limit && *match_end == ref[match_end - ip]) {
+        match_end++;
+      }
+      size_t literals = ip - anchor;
+      size_t match_len = match_end - ip;
+      if ((size_t)(op_end - op) < 3 + length_bytes(literals) + literals + length_bytes(match_len - MIN_MATCH)) {
+        return 0;
+      }
+      op = put_sequence(op, anchor, literals, ip - ref, match_len);
+      ip = anchor = match_end;
+    }
+  }
+
+  size_t literals = end - anchor;
+  if ((size_t)(op_end - op) < 1 + length_bytes(literals) + literals) {
+    return 0;
+  }
+  op = put_sequence(op, anchor, literals, 0, 0);
+  return op - (uint8_t *)dst;
+}
+
+//Read the continuation bytes of a length whose nibble was 15; -1 if src runs out
+static long get_length(const uint8_t **ip, const uint8_t *end, size_t len) {
+  uint8_t b;
+  do {
+    if (*ip >= end) {
+      return -1;
+    }
+    b = *(*ip)++;
+    len += b;
+  } while (b == 255);
+  return len;
+}
+
+long lz_decompress(const void *src, size_t len, void *dst, size_t cap) {
+  const uint8_t *ip = src;
+  const uint8_t *end = ip + len;
+  uint8_t *start = dst;
+  uint8_t *op = start;
+  uint8_t *op_end = op + cap;
+
+  while (ip < end) {
+    uint8_t token = *ip++;
+    long literals = token >> 4;
+    if (literals == 15 && (literals = get_length(&ip, end, literals)) < 0) {
+      return -1;
+    }
+    if (literals > end - ip || literals > op_end - op) {
+      return -1;
+    }
+    memcpy(op, ip, literals);
+    op += literals;
+    ip += literals;
+    if (ip == end) {
+      break;
+    }
+
+    if (end - ip < 2) {
+      return -1;
+    }
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    long match_len = token & 15;
+    if (match_len == 15 && (match_len = get_length(&ip, end, match_len)) < 0) {
+      return -1;
+    }
+    match_len += MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(op - start) || match_len > op_end - op) {
+      return -1;
+    }
+    //Byte by byte: a match may overlap the bytes it produces
+    const uint8_t *ref = op - offset;
+    for (long i = 0; i < match_len; i++) {
+      op[i] = ref[i];
+    }
+    op += match_len;
+  }
+  return op - start;
+}
@@ -0,0 +1,17 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/*
+  Small in-tree compressor for compressed files, producing the LZ4 block
+  format: a greedy single-pass matcher over a 4 KiB hash table, 64 KiB
+  window. Inputs are one cluster, so sizes stay well under that window.
+*/
+
+//Compress len (at most 65535) bytes; returns the compressed size, or 0 if it does not fit in cap
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+//Returns the decompressed size, or -1 if src is corrupt or would overflow cap
+long lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif
@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+
+#include "mapping.h"
+#include "engine.h"
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+//Consume --window= and --max-windows=; returns 1 if used, 0 if not ours, -1 on a bad value.
+//Either one turns windowed mapping on, with the default for the other.
+int mapping_parse_option(const char *arg, size_t *window_bytes, int *max_windows) {
+  char *end;
+  if (strncmp(arg, "--window=", strlen("--window=")) == 0) {
+    unsigned long long value = strtoull(arg + strlen("--window="), &end, 10);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (*end != '\0' || value == 0 || value % page_size != 0) {
+      return -1;
+    }
+    *window_bytes = value;
+    if (*max_windows == 0) {
+      *max_windows = WFS_WINDOW_DEFAULT_MAX;
+    }
+    return 1;
+  }
+  if (strncmp(arg, "--max-windows=", strlen("--max-windows=")) == 0) {
+    long value = strtol(arg + strlen("--max-windows="), &end, 10);
+    if (*end != '\0' || value < 1 || value > 1 << 20) {
+      return -1;
+    }
+    *max_windows = value;
+    if (*window_bytes == 0) {
+      *window_bytes = WFS_WINDOW_DEFAULT_BYTES;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/*
+  Map one disk image and take ownership of fd, which stays open for
+  mapping_punch. Whole-image mode maps it all; windowed mode maps the
+  metadata prefix up to the page holding the first data block and maps
+  data windows from fd later. Returns the mapping that becomes
+  ctx->disk_mmaps[disk], or NULL.
+*/
+void *mapping_open_disk(struct wfs_ctx *ctx, int disk, int fd, size_t size, off_t d_blocks_ptr) {
+  struct wfs_mapping *map = &ctx->mapping;
+  if (!map->window_bytes) {
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+      perror("Error mapping disk file");
+      close(fd);
+      return NULL;
+    }
+    map->fds[disk] = fd;
+    return base;
+  }
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  size_t meta_bytes = MIN(((size_t)d_blocks_ptr + page_size - 1) / page_size * page_size, size);
+  //Every disk of one filesystem has the same layout, so this only shrinks for a damaged image
+  map->meta_bytes = map->meta_bytes ? MIN(map->meta_bytes, meta_bytes) : meta_bytes;
+  map->slots[disk] = calloc((size + map->window_bytes - 1) / map->window_bytes + 1, sizeof(struct wfs_window *));
+  if (!map->slots[disk]) {
+    perror("Error allocating the window table");
+    close(fd);
+    return NULL;
+  }
+  void *base = mmap(NULL, meta_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    perror("Error mapping disk metadata");
+    close(fd);
+    return NULL;
+  }
+  map->fds[disk] = fd;
+  map->meta_lens[disk] = meta_bytes;
+  return base;
+}
+
+static void unlink_window(struct wfs_mapping *map, struct wfs_window *window) {
+  if (window->newer) {
+    window->newer->older = window->older;
+  } else {
+    map->newest = window->older;
+  }
+  if (window->older) {
+    window->older->newer = window->newer;
+  } else {
+    map->oldest = window->newer;
+  }
+}
+
+static void push_newest(struct wfs_mapping *map, struct wfs_window *window) {
+  window->newer = NULL;
+  window->older = map->newest;
+  if (map->newest) {
+    map->newest->newer = window;
+  } else {
+    map->oldest = window;
+  }
+  map->newest = window;
+}
+
+static void unmap_window(struct wfs_ctx *ctx, struct wfs_window *window) {
+  struct wfs_mapping *map = &ctx->mapping;
+  size_t slot = window->start / map->window_bytes;
+  if (map->slots[window->disk][slot] == window) {
+    map->slots[window->disk][slot] = NULL;
+  }
+  if (map->last[window->disk] == window) {
+    map->last[window->disk] = NULL;
+  }
+  unlink_window(map, window);
+  munmap(window->addr, window->len);
+  free(window);
+  map->active--;
+}
+
+//Unmap least recently used windows until at most target remain, sparing any used since the last release
+static void evict_idle(struct wfs_ctx *ctx, int target) {
+  struct wfs_mapping *map = &ctx->mapping;
+  while (map->active > target && map->oldest && map->oldest->last_use != map->epoch) {
+    unmap_window(ctx, map->oldest);
+    STATS_ADD(ctx->stats.map_windows_evicted, 1);
+  }
+}
+
+//Map the window-aligned span from chunk slot up to end. A range crossing a window
+//boundary gets one window over the whole span, so callers always see contiguous memory.
+static struct wfs_window *map_new_window(struct wfs_ctx *ctx, int disk, size_t slot, off_t end) {
+  struct wfs_mapping *map = &ctx->mapping;
+  off_t start = (off_t)slot * map->window_bytes;
+  size_t len = (end - start + map->window_bytes - 1) / map->window_bytes * map->window_bytes;
+  len = MIN(len, ctx->disk_sizes[disk] - start);
+
+  if (map->active >= map->max_windows) {
+    evict_idle(ctx, map->max_windows - 1);
+  }
+  struct wfs_window *window = malloc(sizeof(*window));
+  void *addr = window ? mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, map->fds[disk], start) : MAP_FAILED;
+  if (addr == MAP_FAILED) {
+    //Out of address space: give back every idle window and try once more
+    evict_idle(ctx, 0);
+    addr = window ? mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, map->fds[disk], start) : MAP_FAILED;
+  }
+  if (addr == MAP_FAILED) {
+    //Callers hold no error path for a mapped disk; carrying on would touch unmapped memory
+    perror("Error mapping disk window");
+    abort();
+  }
+  if (map->data_advice) {
+    madvise(addr, len, map->data_advice);
+  }
+
+  window->addr = addr;
+  window->start = start;
+  window->len = len;
+  window->disk = disk;
+  map->slots[disk][slot] = window;
+  push_newest(map, window);
+  map->active++;
+  STATS_ADD(ctx->stats.map_windows_mapped, 1);
+  return window;
+}
+
+static int covers(const struct wfs_window *window, off_t offset, off_t end) {
+  return window && window->start <= offset && window->start + (off_t)window->len >= end;
+}
+
+//Slow path of DISK_RANGE: the address of [offset, offset + len) of a disk's data region.
+//Valid until the next mapping_release.
+char *mapping_window(struct wfs_ctx *ctx, int disk, off_t offset, size_t len) {
+  struct wfs_mapping *map = &ctx->mapping;
+  off_t end = MIN(offset + (off_t)len, (off_t)ctx->disk_sizes[disk]);
+  struct wfs_window *window = map->last[disk];
+  if (covers(window, offset, end) && window->last_use == map->epoch) {
+    //Already moved up this operation, ahead of every window eviction may take
+    return window->addr + (offset - window->start);
+  }
+  if (!covers(window, offset, end)) {
+    size_t slot = offset / map->window_bytes;
+    window = map->slots[disk][slot];
+    if (!covers(window, offset, end)) {
+      window = map_new_window(ctx, disk, slot, end);
+    }
+    map->last[disk] = window;
+  }
+  if (map->newest != window) {
+    unlink_window(map, window);
+    push_newest(map, window);
+  }
+  window->last_use = map->epoch;
+  return window->addr + (offset - window->start);
+}
+
+//The caller holds no pointer from DISK_PTR or DISK_RANGE any more: trim the LRU back to its cap.
+//Called with ctx->lock held at the end of every operation.
+void mapping_release(struct wfs_ctx *ctx) {
+  struct wfs_mapping *map = &ctx->mapping;
+  if (!map->window_bytes) {
+    return;
+  }
+  map->epoch++;
+  evict_idle(ctx, map->max_windows);
+}
+
+/*
+  msync [offset, offset + len) of one disk. Windowed data is synced
+  through a short-lived mapping of each window-sized chunk rather than
+  the LRU: msync writes back the file's pages whichever mapping dirtied
+  them, and an unmapped window can still have dirty pages in the cache.
+*/
+int mapping_sync(struct wfs_ctx *ctx, int disk, off_t offset, size_t len) {
+  struct wfs_mapping *map = &ctx->mapping;
+  long page_size = sysconf(_SC_PAGESIZE);
+  off_t start = offset / page_size * page_size;
+  off_t end = MIN(offset + (off_t)len, (off_t)ctx->disk_sizes[disk]);
+  char *base = ctx->disk_mmaps[disk];
+  if (!base || end <= start) {
+    return 0;
+  }
+  if (!map->window_bytes) {
+    return msync(base + start, end - start, MS_SYNC);
+  }
+
+  int ret = 0;
+  if (start < (off_t)map->meta_bytes) {
+    ret |= msync(base + start, MIN(end, (off_t)map->meta_bytes) - start, MS_SYNC);
+    start = map->meta_bytes;
+  }
+  for (; start < end; start += map->window_bytes) {
+    size_t chunk = MIN((off_t)map->window_bytes, end - start);
+    void *addr = mmap(NULL, chunk, PROT_READ, MAP_SHARED, map->fds[disk], start);
+    if (addr == MAP_FAILED) {
+      ret = -1;
+      continue;
+    }
+    ret |= msync(addr, chunk, MS_SYNC);
+    munmap(addr, chunk);
+  }
+  return ret;
+}
+
+//Hand [offset, offset + len) of a disk back to the host. The range reads as zeros afterwards,
+//through every mapping of it. Returns 0, or -1 with errno set.
+int mapping_punch(struct wfs_ctx *ctx, int disk, off_t offset, size_t len) {
+  return fallocate(ctx->mapping.fds[disk], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+}
+
+//Unmap every window and pinned prefix or whole image, and close the image files
+void mapping_close(struct wfs_ctx *ctx) {
+  struct wfs_mapping *map = &ctx->mapping;
+  while (map->newest) {
+    unmap_window(ctx, map->newest);
+  }
+  for (int disk = 0; ctx->disk_mmaps && disk < MAX_DISKS; disk++) {
+    if (ctx->disk_mmaps[disk]) {
+      munmap(ctx->disk_mmaps[disk], map->window_bytes ? map->meta_lens[disk] : ctx->disk_sizes[disk]);
+      ctx->disk_mmaps[disk] = NULL;
+    }
+    if (map->fds[disk] >= 0) {
+      close(map->fds[disk]);
+      map->fds[disk] = -1;
+    }
+    free(map->slots[disk]);
+    map->slots[disk] = NULL;
+  }
+}
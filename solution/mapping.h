@@ -0,0 +1,57 @@
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include "wfs.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+  Windowed mapping of the disk images. By default every image is mapped
+  whole at mount. With a window size set, only the metadata prefix of
+  each image (superblock, bitmaps, inode table) is mapped for the life of
+  the mount; the data region is mapped in window-sized chunks on first
+  touch and kept in an LRU capped at max_windows. A pointer handed out
+  stays valid until the next mapping_release, so windows are only
+  unmapped once the operation that used them has finished.
+*/
+
+#define WFS_WINDOW_DEFAULT_BYTES (1024 * 1024)
+#define WFS_WINDOW_DEFAULT_MAX 64
+
+struct wfs_window {
+  char *addr;
+  off_t start;
+  size_t len;
+  int disk;
+  uint64_t last_use; //release epoch of the last access
+  struct wfs_window *newer;
+  struct wfs_window *older;
+};
+
+struct wfs_mapping {
+  size_t window_bytes; //0 maps every image whole
+  int max_windows;
+  size_t meta_bytes;   //pinned prefix every image has mapped, rounded up to a page
+  size_t meta_lens[MAX_DISKS];
+  int data_advice;     //madvise advice for new windows, 0 for none
+  int fds[MAX_DISKS];   //open images, -1 for none
+  struct wfs_window **slots[MAX_DISKS]; //window starting at each window-sized chunk, or NULL
+  struct wfs_window *last[MAX_DISKS];   //last window hit per disk
+  struct wfs_window *newest;
+  struct wfs_window *oldest;
+  int active;
+  uint64_t epoch;
+};
+
+struct wfs_ctx;
+
+int mapping_parse_option(const char *arg, size_t *window_bytes, int *max_windows);
+void *mapping_open_disk(struct wfs_ctx *ctx, int disk, int fd, size_t size, off_t d_blocks_ptr);
+char *mapping_window(struct wfs_ctx *ctx, int disk, off_t offset, size_t len);
+void mapping_release(struct wfs_ctx *ctx);
+int mapping_sync(struct wfs_ctx *ctx, int disk, off_t offset, size_t len);
+int mapping_punch(struct wfs_ctx *ctx, int disk, off_t offset, size_t len);
+void mapping_close(struct wfs_ctx *ctx);
+
+#endif
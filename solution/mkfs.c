@@ -1,5 +1,8 @@
 #include "utility.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,11 +13,58 @@
 
 #define BLOCK_ALIGN(offset) (((offset) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE)
 
+//Inode numbers are 32-bit on disk. Data blocks per disk are capped so an image stays well inside
+//off_t and block ids over every disk clear of the flag bit of compressed block pointers.
+//Both leave room to round up to 32.
+#define MAX_INODES ((size_t)INT_MAX - 31)
+#define MAX_DATA_BLOCKS (((size_t)1 << 52) - 31)
+
+//One formatting thread per disk image
+struct disk_job {
+    const char *disk;
+    size_t num_inodes;
+    size_t num_data_blocks;
+    size_t required_size;
+    int raid_mode;
+    int disk_index;
+    int num_disks;
+    int chunk_blocks;
+    int meta_copies;
+    const uint8_t *disk_tiers;
+    const uint8_t *fs_uuid;
+    int mkfs_flags;
+    int ret;
+};
+
+//-i, -b, -c or -m: a whole number from 1 to max, or 0 for anything else
+static size_t parse_count(const char *arg, size_t max) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (errno || end == arg || *end != '\0' || arg[0] == '-' || value > max) {
+        return 0;
+    }
+    return value;
+}
+
+static void *format_disk(void *arg) {
+    struct disk_job *job = arg;
+    job->ret = disk_initialize(job->disk, job->num_inodes, job->num_data_blocks, job->required_size,
+                               job->raid_mode, job->disk_index, job->num_disks, job->chunk_blocks,
+                               job->meta_copies, job->disk_tiers, job->fs_uuid, job->mkfs_flags);
+    return NULL;
+}
+
 int main(int argc, char* argv[]){   
     int raid_mode = -1;
-    int num_inodes = 0;
-    int num_data_blocks = 0;
+    size_t num_inodes = 0;
+    size_t num_data_blocks = 0;
     int num_disks = 0;
+    int mkfs_flags = 0;
+    int chunk_size = BLOCK_SIZE;
+    int meta_copies = 0;
+    int spare = 0;
+    const char *tiers = NULL;
     char* disks[MAX_DISKS];
 
     //parse the parameters passed in the input
@@ -27,33 +77,120 @@ int main(int argc, char* argv[]){
                     raid_mode = 1;
                 } else if (strcmp(argv[i + 1], "1v") == 0) {
                     raid_mode = 2;
+                } else if (strcmp(argv[i + 1], "5") == 0) {
+                    raid_mode = 3;
+                } else if (strcmp(argv[i + 1], "10") == 0) {
+                    raid_mode = 4;
                 } else {
                     return 1;
                 }
                 i++;
             }
-        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc && num_disks < MAX_DISKS) {
             disks[num_disks++] = argv[++i]; 
         } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
-            num_inodes = atoi(argv[++i]); 
+            num_inodes = parse_count(argv[++i], MAX_INODES);
         } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
-            num_data_blocks = atoi(argv[++i]); 
+            num_data_blocks = parse_count(argv[++i], MAX_DATA_BLOCKS);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            chunk_size = parse_count(argv[++i], INT_MAX);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            i++;
+            meta_copies = strcmp(argv[i], "all") == 0 ? 0 : parse_count(argv[i], INT_MAX);
+            if (meta_copies <= 0 && strcmp(argv[i], "all") != 0) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            tiers = argv[++i];
+        } else if (strcmp(argv[i], "-s") == 0) {
+            mkfs_flags |= MKFS_SIZE_IMAGES;
+        } else if (strcmp(argv[i], "-a") == 0) {
+            mkfs_flags |= MKFS_SIZE_IMAGES | MKFS_PREALLOCATE;
+        } else if (strcmp(argv[i], "-L") == 0) {
+            mkfs_flags |= MKFS_LAZY_BITMAPS;
+        } else if (strcmp(argv[i], "-K") == 0) {
+            mkfs_flags |= MKFS_KEEP_STALE;
+        } else if (strcmp(argv[i], "-g") == 0) {
+            spare = 1;
         } else {
             return 1;
         }
     }
-    if(raid_mode==-1 || num_disks<2 || num_inodes<=0 || num_data_blocks<=0){
+    if(raid_mode==-1 || num_disks<(spare ? 1 : 2) || num_inodes==0 || num_data_blocks==0){
+        return 1;
+    }
+    //-g formats one image for WFS_IOC_ADD_DISK to add to a mounted RAID 0 filesystem
+    if(spare && (num_disks!=1 || raid_mode!=0)){
+        return 1;
+    }
+    //With two disks RAID 5 parity is just a mirror
+    if(raid_mode==3 && num_disks<3){
+        return 1;
+    }
+    //RAID 10 needs whole mirror pairs, and at least two of them to stripe over
+    if(raid_mode==4 && (num_disks<4 || num_disks%2)){
         return 1;
     }
 
-    num_inodes = (num_inodes+31) & ~31;
-    num_data_blocks = (num_data_blocks+31) & ~31;
+    //The stripe unit is a whole number of blocks, and only RAID 0 stripes by it
+    if(chunk_size<BLOCK_SIZE || chunk_size%BLOCK_SIZE || (chunk_size!=BLOCK_SIZE && raid_mode!=0)){
+        return 1;
+    }
+    int chunk_blocks = chunk_size / BLOCK_SIZE;
+
+    //Fewer metadata copies than disks only in RAID 0; the other modes keep one on every disk
+    if(meta_copies >= num_disks){
+        meta_copies = 0;
+    }
+    if(meta_copies && raid_mode!=0){
+        return 1;
+    }
+
+    //One tier letter per -d image, in order: f(ast) or c(apacity)
+    uint8_t disk_tiers[MAX_DISKS] = {0};
+    if(tiers){
+        if((int)strlen(tiers) != num_disks){
+            return 1;
+        }
+        for (int i = 0; i < num_disks; i++) {
+            if(tiers[i] == 'f'){
+                disk_tiers[i] = WFS_TIER_FAST;
+            } else if(tiers[i] != 'c'){
+                return 1;
+            }
+        }
+    }
+
+    num_inodes = (num_inodes+31) & ~(size_t)31;
+    num_data_blocks = (num_data_blocks+31) & ~(size_t)31;
+    //Whole chunks per disk, so every block id maps inside the data region
+    num_data_blocks = (num_data_blocks+chunk_blocks-1) / chunk_blocks * chunk_blocks;
 
     size_t required_size = calc_size(num_inodes, num_data_blocks);
+    uint8_t fs_uuid[WFS_UUID_BYTES];
+    generate_fs_uuid(fs_uuid);
+
+    //Disks are independent, so format them all at once
+    struct disk_job jobs[MAX_DISKS];
+    pthread_t threads[MAX_DISKS];
+    int started[MAX_DISKS];
+    for (int i = 0; i < num_disks; i++) {
+        jobs[i] = (struct disk_job){disks[i], num_inodes, num_data_blocks, required_size,
+                                    raid_mode, i, num_disks, chunk_blocks, meta_copies, disk_tiers, fs_uuid, mkfs_flags, -1};
+        started[i] = pthread_create(&threads[i], NULL, format_disk, &jobs[i]) == 0;
+        if (!started[i]) {
+            format_disk(&jobs[i]);
+        }
+    }
+
+    int ret = 0;
     for (int i = 0; i < num_disks; i++) {
-        if (disk_initialize(disks[i], num_inodes, num_data_blocks,required_size, raid_mode, i, num_disks) != 0) {
-            return -1;
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        if (jobs[i].ret != 0) {
+            ret = -1;
         }
     }
-    return 0;
+    return ret;
 }
@@ -0,0 +1,46 @@
+#include "parity.h"
+#include <stdint.h>
+#include <string.h>
+
+/*
+  GCC vector extensions rather than intrinsics: the compiler lowers a
+  32-byte vector to whatever SIMD the target has (two SSE2 registers on
+  any x86-64, one AVX2 register with -mavx2, NEON on arm64) and to plain
+  64-bit operations elsewhere. The memcpy loads and stores compile to
+  unaligned vector moves, so mapped blocks need no alignment.
+*/
+typedef uint64_t xor_vec __attribute__((vector_size(32)));
+
+void parity_xor(void *dst, const void *src, size_t len) {
+  char *d = dst;
+  const char *s = src;
+  size_t i = 0;
+  for (; i + sizeof(xor_vec) <= len; i += sizeof(xor_vec)) {
+    xor_vec a, b;
+    memcpy(&a, d + i, sizeof(a));
+    memcpy(&b, s + i, sizeof(b));
+    a ^= b;
+    memcpy(d + i, &a, sizeof(a));
+  }
+  for (; i < len; i++) {
+    d[i] ^= s[i];
+  }
+}
+
+void parity_xor_update(void *dst, const void *old_data, const void *new_data, size_t len) {
+  char *d = dst;
+  const char *o = old_data;
+  const char *n = new_data;
+  size_t i = 0;
+  for (; i + sizeof(xor_vec) <= len; i += sizeof(xor_vec)) {
+    xor_vec a, b, c;
+    memcpy(&a, d + i, sizeof(a));
+    memcpy(&b, o + i, sizeof(b));
+    memcpy(&c, n + i, sizeof(c));
+    a ^= b ^ c;
+    memcpy(d + i, &a, sizeof(a));
+  }
+  for (; i < len; i++) {
+    d[i] ^= o[i] ^ n[i];
+  }
+}
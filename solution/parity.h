@@ -0,0 +1,16 @@
+#ifndef PARITY_H
+#define PARITY_H
+
+#include <stddef.h>
+
+/*
+  XOR kernels for RAID 5 parity. Buffers need no particular alignment;
+  lengths are usually a block but any size works.
+*/
+
+//dst ^= src
+void parity_xor(void *dst, const void *src, size_t len);
+//dst ^= old ^ new: folds a small write into an existing parity block in one pass
+void parity_xor_update(void *dst, const void *old_data, const void *new_data, size_t len);
+
+#endif
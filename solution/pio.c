@@ -0,0 +1,187 @@
+#include "pio.h"
+#include "engine.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct pio_worker_arg {
+  struct wfs_ctx *ctx;
+  int disk;
+  uint64_t generation; //batches dispatched before the worker existed
+};
+
+static void run_queue(struct wfs_pio_copy *copies, int count) {
+  for (int i = 0; i < count; i++) {
+    memcpy(copies[i].dst, copies[i].src, copies[i].len);
+  }
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//Whether *word is where a waiter wants it: moved off value, or with equal set, at value
+static int settled(const uint64_t *word, uint64_t value, int equal) {
+  return (__atomic_load_n(word, __ATOMIC_ACQUIRE) == value) == equal;
+}
+
+//Wait for *word to settle, spinning for pio->spin_ns before sleeping on cond under pio->lock,
+//so back-to-back requests of a stream never pay for a wakeup
+static void wait_for(struct wfs_pio *pio, const uint64_t *word, uint64_t value, int equal, pthread_cond_t *cond) {
+  uint64_t deadline = now_ns() + pio->spin_ns;
+  while (!settled(word, value, equal) && !__atomic_load_n(&pio->stop, __ATOMIC_ACQUIRE)) {
+    if (now_ns() > deadline) {
+      pthread_mutex_lock(&pio->lock);
+      while (!settled(word, value, equal) && !pio->stop) {
+        pthread_cond_wait(cond, &pio->lock);
+      }
+      pthread_mutex_unlock(&pio->lock);
+      return;
+    }
+  }
+}
+
+//Worker of one disk: run that disk's queue each time a batch hands it one
+static void *pio_worker(void *arg) {
+  struct wfs_ctx *ctx = ((struct pio_worker_arg *)arg)->ctx;
+  int disk = ((struct pio_worker_arg *)arg)->disk;
+  uint64_t seen = ((struct pio_worker_arg *)arg)->generation;
+  free(arg);
+  struct wfs_pio *pio = &ctx->pio;
+  struct wfs_pio_queue *queue = &pio->queues[disk];
+
+  for (;;) {
+    wait_for(pio, &pio->generation, seen, 0, &pio->start);
+    if (__atomic_load_n(&pio->stop, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    seen = __atomic_load_n(&pio->generation, __ATOMIC_ACQUIRE);
+    if (!__atomic_load_n(&queue->assigned, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+    run_queue(queue->copies, queue->count);
+    queue->count = 0;
+    __atomic_store_n(&queue->assigned, 0, __ATOMIC_RELAXED);
+    if (__atomic_sub_fetch(&pio->busy, 1, __ATOMIC_RELEASE) == 0) {
+      pthread_mutex_lock(&pio->lock);
+      pthread_cond_signal(&pio->finished);
+      pthread_mutex_unlock(&pio->lock);
+    }
+  }
+  return NULL;
+}
+
+//Start a worker for every disk without one; a no-op unless --parallel-io is on and there is
+//more than one disk. Called again after a grow adds a disk.
+int pio_start_workers(struct wfs_ctx *ctx) {
+  struct wfs_pio *pio = &ctx->pio;
+  if (!pio->enabled || ctx->num_disks < 2 || pio->num_workers == ctx->num_disks) {
+    return 0;
+  }
+  if (!pio->num_workers) {
+    //Spinning only pays when every worker, and the request, can have a CPU to itself
+    pio->spin_ns = sysconf(_SC_NPROCESSORS_ONLN) > ctx->num_disks ? WFS_PIO_SPIN_NS : 0;
+    pio->stop = 0;
+    pio->busy = 0;
+    pthread_mutex_init(&pio->lock, NULL);
+    pthread_cond_init(&pio->start, NULL);
+    pthread_cond_init(&pio->finished, NULL);
+  }
+  for (int disk = pio->num_workers; disk < ctx->num_disks; disk++) {
+    struct pio_worker_arg *arg = malloc(sizeof(*arg));
+    if (!arg) {
+      pio_close(ctx);
+      return -1;
+    }
+    //Taken here, not by the thread, which may first run after a batch has been handed to it
+    *arg = (struct pio_worker_arg){ctx, disk, pio->generation};
+    if (pthread_create(&pio->workers[disk], NULL, pio_worker, arg) != 0) {
+      free(arg);
+      pio_close(ctx);
+      return -1;
+    }
+    pio->num_workers++;
+  }
+  return 0;
+}
+
+//Start queueing the copies of a request of the given size, if it is large enough to split.
+//Caller holds ctx->lock until the matching pio_end.
+void pio_begin(struct wfs_ctx *ctx, size_t bytes) {
+  ctx->pio.batching = ctx->pio.num_workers == ctx->num_disks && bytes >= WFS_PIO_MIN_BYTES;
+}
+
+//Copy len bytes to or from a mapping of disk: queued while batching, done at once otherwise
+void pio_copy(struct wfs_ctx *ctx, int disk, void *dst, const void *src, size_t len) {
+  struct wfs_pio_queue *queue = &ctx->pio.queues[disk];
+  if (!ctx->pio.batching || queue->count == WFS_PIO_QUEUE) {
+    memcpy(dst, src, len);
+    return;
+  }
+  queue->copies[queue->count++] = (struct wfs_pio_copy){dst, src, len};
+}
+
+//Run the queued copies, one disk per thread, and return once every one has landed
+void pio_end(struct wfs_ctx *ctx) {
+  struct wfs_pio *pio = &ctx->pio;
+  if (!pio->batching) {
+    return;
+  }
+  pio->batching = 0;
+  int own = -1;
+  int others = 0;
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    if (pio->queues[disk].count) {
+      if (own < 0) {
+        own = disk;
+      } else {
+        others++;
+      }
+    }
+  }
+  if (own < 0) {
+    return;
+  }
+  //The calling thread takes the first disk with work; it has no worker to hand off to otherwise
+  struct wfs_pio_queue *queue = &pio->queues[own];
+  int count = queue->count;
+  queue->count = 0;
+  if (others) {
+    for (int disk = own + 1; disk < ctx->num_disks; disk++) {
+      __atomic_store_n(&pio->queues[disk].assigned, pio->queues[disk].count > 0, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&pio->busy, others, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pio->generation, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&pio->lock);
+    pthread_cond_broadcast(&pio->start);
+    pthread_mutex_unlock(&pio->lock);
+    STATS_ADD(ctx->stats.pio_batches, 1);
+    STATS_ADD(ctx->stats.pio_disks, others + 1);
+  }
+  run_queue(queue->copies, count);
+  if (others) {
+    wait_for(pio, &pio->busy, 0, 1, &pio->finished);
+  }
+}
+
+//Stop the workers
+void pio_close(struct wfs_ctx *ctx) {
+  struct wfs_pio *pio = &ctx->pio;
+  if (!pio->num_workers) {
+    return;
+  }
+  pthread_mutex_lock(&pio->lock);
+  __atomic_store_n(&pio->stop, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&pio->start);
+  pthread_mutex_unlock(&pio->lock);
+  for (int disk = 0; disk < pio->num_workers; disk++) {
+    pthread_join(pio->workers[disk], NULL);
+  }
+  pio->num_workers = 0;
+  pthread_cond_destroy(&pio->finished);
+  pthread_cond_destroy(&pio->start);
+  pthread_mutex_destroy(&pio->lock);
+}
@@ -0,0 +1,62 @@
+#ifndef PIO_H
+#define PIO_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "wfs.h"
+
+/*
+  Per-disk I/O workers for large requests. With `wfs --parallel-io`, a
+  read or write of at least WFS_PIO_MIN_BYTES has its copies to and from
+  the mapped images queued by disk instead of done in place. When the
+  request touches more than one disk, each disk's queue then goes to that
+  disk's worker, the calling thread takes the first queue itself, and the
+  request waits for all of them. The page faults behind those copies are
+  the image I/O, so every disk of a stripe is busy at once rather than
+  one after another. Pointers are looked up and I/O is accounted on the
+  calling thread, which holds ctx->lock throughout; workers only copy.
+*/
+
+#define WFS_PIO_MIN_BYTES (16 * 1024)
+//How long an idle worker, or a request waiting on the workers, spins before sleeping
+#define WFS_PIO_SPIN_NS 50000
+//Copies one disk can have queued per request; past that they are done in place
+#define WFS_PIO_QUEUE 160
+
+struct wfs_pio_copy {
+  void *dst;
+  const void *src;
+  size_t len;
+};
+
+struct wfs_pio_queue {
+  struct wfs_pio_copy copies[WFS_PIO_QUEUE];
+  int count;
+  int assigned; //handed to the disk's worker by the last dispatch, under wfs_pio.lock
+};
+
+struct wfs_pio {
+  int enabled;  //--parallel-io
+  int batching; //copies of the current request are being queued
+  struct wfs_pio_queue queues[MAX_DISKS];
+  pthread_t workers[MAX_DISKS];
+  int num_workers;
+  pthread_mutex_t lock;
+  pthread_cond_t start;    //a batch was dispatched, or the workers should stop
+  pthread_cond_t finished; //the last busy worker is done
+  uint64_t spin_ns;        //WFS_PIO_SPIN_NS, or 0 with too few CPUs to spare
+  uint64_t generation;     //batches dispatched so far
+  uint64_t busy;           //workers still copying the current batch
+  int stop;
+};
+
+struct wfs_ctx;
+
+int pio_start_workers(struct wfs_ctx *ctx);
+void pio_begin(struct wfs_ctx *ctx, size_t bytes);
+void pio_copy(struct wfs_ctx *ctx, int disk, void *dst, const void *src, size_t len);
+void pio_end(struct wfs_ctx *ctx);
+void pio_close(struct wfs_ctx *ctx);
+
+#endif
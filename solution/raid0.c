@@ -0,0 +1,51 @@
+#include "layout.h"
+#include "engine.h"
+
+/*
+  RAID 0: block ids rotate over the disks one by one, or with a stripe
+  unit, in chunks of sb.chunk_blocks consecutive ids. Every block has a
+  single copy. This is the only layout a mounted filesystem can grow.
+*/
+
+//Ids a grow's rebalance has not reached yet stay striped over the old disks (see grow.h)
+static int stripe_width(const struct wfs_ctx *ctx, off_t block_id) {
+  return ctx->sb.grow_from_disks && (uint64_t)block_id >= ctx->sb.grow_cursor ? (int)ctx->sb.grow_from_disks
+                                                                             : ctx->num_disks;
+}
+
+static off_t raid0_map(const struct wfs_ctx *ctx, int *disk, off_t block_id) {
+  int num_disks = stripe_width(ctx, block_id);
+  *disk = block_id % num_disks;
+  return block_id / num_disks;
+}
+
+static off_t raid0_chunked_map(const struct wfs_ctx *ctx, int *disk, off_t block_id) {
+  int num_disks = stripe_width(ctx, block_id);
+  off_t chunk = block_id / ctx->sb.chunk_blocks;
+  *disk = chunk % num_disks;
+  return chunk / num_disks * ctx->sb.chunk_blocks + block_id % ctx->sb.chunk_blocks;
+}
+
+const struct wfs_layout raid0_layout = {
+    .name = "raid0",
+    .map = raid0_map,
+    .allocated = layout_none_allocated,
+    .read_disk = layout_same_disk,
+    .bitmap_disk = layout_own_bitmap,
+    .copies = layout_only_disk,
+    .read_range = layout_copy_out,
+    .write_range = layout_copy_in,
+    .replicate = layout_no_copies,
+};
+
+const struct wfs_layout raid0_chunked_layout = {
+    .name = "raid0",
+    .map = raid0_chunked_map,
+    .allocated = layout_none_allocated,
+    .read_disk = layout_same_disk,
+    .bitmap_disk = layout_own_bitmap,
+    .copies = layout_only_disk,
+    .read_range = layout_copy_out,
+    .write_range = layout_copy_in,
+    .replicate = layout_no_copies,
+};
@@ -0,0 +1,134 @@
+#include "layout.h"
+#include "engine.h"
+#include <string.h>
+
+/*
+  RAID 1 and 1v: every disk holds a copy of every block. A row of
+  num_disks block ids maps to one block on disk 0, the first id standing
+  for the row, and every write goes to all the copies present. RAID 1
+  reads one copy, on a fast disk when there is one (see tier.h). RAID 1v
+  reads file data block by block and returns the contents most copies
+  agree on; its other reads go to disk 0, or another copy once it is lost.
+*/
+
+static off_t mirror_map(const struct wfs_ctx *ctx, int *disk, off_t block_id) {
+  *disk = 0;
+  return block_id / ctx->num_disks;
+}
+
+static int mirror_allocates(const struct wfs_ctx *ctx, off_t block_id, int disk, off_t local) {
+  (void)disk;
+  (void)local;
+  return block_id % ctx->num_disks == 0;
+}
+
+static int raid1_read_disk(const struct wfs_ctx *ctx, int disk, off_t local) {
+  (void)disk;
+  (void)local;
+  return ctx->tier.mirror_reader;
+}
+
+static int raid1v_read_disk(const struct wfs_ctx *ctx, int disk, off_t local) {
+  (void)local;
+  return disk == ctx->missing_disk ? ctx->tier.mirror_reader : disk;
+}
+
+//Mirrored bitmaps are identical, so read the one on a fast disk
+static int mirror_bitmap_disk(const struct wfs_ctx *ctx, int disk) {
+  (void)disk;
+  return ctx->tier.mirror_reader;
+}
+
+//Replicate the disks for making raid1
+void synchronize_disks(struct wfs_ctx *ctx, const void *data, size_t offset, size_t size, int main_disk_id) {
+  for (int disk_id = 0; disk_id < ctx->num_disks; disk_id++) {
+    if (disk_id == main_disk_id || !ctx->disk_mmaps[disk_id]) {
+      continue;
+    }
+    pio_copy(ctx, disk_id, DISK_RANGE(ctx, disk_id, offset, size), data, size);
+    IO_WRITE(ctx, disk_id, offset, size);
+  }
+}
+
+//Contents of a block most copies agree on, comparing the mapped copies in place
+static void vote(struct wfs_ctx *ctx, void *block, off_t local) {
+  off_t offset = DATA_BLOCK_OFFSET(ctx, local);
+  int chosen_disk = ctx->meta_disk;
+  int highest_votes = -1;
+  for (int current = 0; current < ctx->num_disks; current++) {
+    if (current == ctx->missing_disk) {
+      continue;
+    }
+    char *current_data = DISK_PTR(ctx, current, offset);
+    int votes = 0;
+    for (int compare = 0; compare < ctx->num_disks; compare++) {
+      if (current != compare && compare != ctx->missing_disk &&
+          memcmp(current_data, DISK_PTR(ctx, compare, offset), BLOCK_SIZE) == 0) {
+        votes++;
+      }
+    }
+    IO_READ(ctx, current, offset, BLOCK_SIZE);
+    if (votes > highest_votes) {
+      highest_votes = votes;
+      chosen_disk = current;
+    }
+  }
+  memcpy(block, DISK_PTR(ctx, chosen_disk, offset), BLOCK_SIZE);
+}
+
+//To compute for raid1v:
+void find_majority_block(struct wfs_ctx *ctx, void *block, off_t block_index) {
+  int disk;
+  vote(ctx, block, mirror_map(ctx, &disk, block_index));
+}
+
+static void raid1_read_range(struct wfs_ctx *ctx, int disk, off_t local, size_t offset, size_t size, char *buf) {
+  (void)disk;
+  layout_copy_out(ctx, ctx->tier.mirror_reader, local, offset, size, buf);
+}
+
+//Ranges are a single block here (wfs_layout.votes)
+static void raid1v_read_range(struct wfs_ctx *ctx, int disk, off_t local, size_t offset, size_t size, char *buf) {
+  (void)disk;
+  char block[BLOCK_SIZE];
+  vote(ctx, block, local);
+  memcpy(buf, block + offset, size);
+}
+
+static void mirror_write_range(struct wfs_ctx *ctx, int disk, off_t local, size_t offset, const char *buf, size_t size) {
+  off_t start = DATA_BLOCK_OFFSET(ctx, local) + offset;
+  intent_mark(ctx, start, size);
+  layout_copy_in(ctx, disk, local, offset, buf, size);
+  synchronize_disks(ctx, buf, start, size, disk);
+}
+
+const struct wfs_layout raid1_layout = {
+    .name = "raid1",
+    .mirrored = 1,
+    .data_copies = 1,
+    .map = mirror_map,
+    .allocates = mirror_allocates,
+    .allocated = layout_none_allocated,
+    .read_disk = raid1_read_disk,
+    .bitmap_disk = mirror_bitmap_disk,
+    .copies = layout_every_disk,
+    .read_range = raid1_read_range,
+    .write_range = mirror_write_range,
+    .replicate = synchronize_disks,
+};
+
+const struct wfs_layout raid1v_layout = {
+    .name = "raid1v",
+    .mirrored = 1,
+    .data_copies = 1,
+    .votes = 1,
+    .map = mirror_map,
+    .allocates = mirror_allocates,
+    .allocated = layout_none_allocated,
+    .read_disk = raid1v_read_disk,
+    .bitmap_disk = mirror_bitmap_disk,
+    .copies = layout_every_disk,
+    .read_range = raid1v_read_range,
+    .write_range = mirror_write_range,
+    .replicate = synchronize_disks,
+};
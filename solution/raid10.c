@@ -0,0 +1,71 @@
+#include "layout.h"
+#include "engine.h"
+
+/*
+  RAID 10: disk 2k is mirrored on disk 2k+1 and block ids rotate over the
+  pairs. Blocks are allocated from the bitmap of each pair's even disk.
+  Reads go to the fast member of a pair mixing tiers, and otherwise
+  alternate between the members by block, so sequential and random reads
+  both spread over every disk; to the survivor when a member is missing.
+*/
+
+static off_t raid10_map(const struct wfs_ctx *ctx, int *disk, off_t block_id) {
+  *disk = block_id % ctx->num_disks;
+  return block_id / ctx->num_disks;
+}
+
+static int raid10_allocates(const struct wfs_ctx *ctx, off_t block_id, int disk, off_t local) {
+  (void)ctx;
+  (void)block_id;
+  (void)local;
+  return disk % 2 == 0;
+}
+
+static int raid10_read_disk(const struct wfs_ctx *ctx, int disk, off_t local) {
+  int fast = (ctx->tier.fast_members >> (disk & ~1)) & 3;
+  int member = fast ? (disk & ~1) + (fast >> 1) : disk ^ (local & 1);
+  return member == ctx->missing_disk ? RAID10_PARTNER(member) : member;
+}
+
+static int raid10_bitmap_disk(const struct wfs_ctx *ctx, int disk) {
+  int partner = RAID10_PARTNER(disk);
+  return (ctx->tier.fast_members & (1 << partner)) && ctx->disk_mmaps[partner] ? partner : disk;
+}
+
+static int raid10_copies(const struct wfs_ctx *ctx, int disk, int *disks) {
+  (void)ctx;
+  disks[0] = disk;
+  disks[1] = RAID10_PARTNER(disk);
+  return 2;
+}
+
+static void raid10_read_range(struct wfs_ctx *ctx, int disk, off_t local, size_t offset, size_t size, char *buf) {
+  layout_copy_out(ctx, raid10_read_disk(ctx, disk, local), local, offset, size, buf);
+}
+
+static void raid10_replicate(struct wfs_ctx *ctx, const void *data, size_t offset, size_t size, int disk) {
+  int partner = RAID10_PARTNER(disk);
+  pio_copy(ctx, partner, DISK_RANGE(ctx, partner, offset, size), data, size);
+  IO_WRITE(ctx, partner, offset, size);
+}
+
+static void raid10_write_range(struct wfs_ctx *ctx, int disk, off_t local, size_t offset, const char *buf, size_t size) {
+  off_t start = DATA_BLOCK_OFFSET(ctx, local) + offset;
+  intent_mark(ctx, start, size);
+  layout_copy_in(ctx, disk, local, offset, buf, size);
+  raid10_replicate(ctx, buf, start, size, disk);
+}
+
+const struct wfs_layout raid10_layout = {
+    .name = "raid10",
+    .data_copies = 1,
+    .map = raid10_map,
+    .allocates = raid10_allocates,
+    .allocated = layout_none_allocated,
+    .read_disk = raid10_read_disk,
+    .bitmap_disk = raid10_bitmap_disk,
+    .copies = raid10_copies,
+    .read_range = raid10_read_range,
+    .write_range = raid10_write_range,
+    .replicate = raid10_replicate,
+};
@@ -0,0 +1,156 @@
+#include "layout.h"
+#include "engine.h"
+#include "parity.h"
+#include <string.h>
+
+/*
+  RAID 5: block ids rotate over the disks, and each row of blocks, one
+  per disk at the same index, gives one of them to the XOR parity of the
+  others. A block of a missing disk is rebuilt from the rest of its row.
+*/
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+//RAID 5 rows rotate their parity backwards from the last disk, so parity writes hit every disk
+int raid5_parity_disk(const struct wfs_ctx *ctx, size_t row) {
+  return ctx->num_disks - 1 - row % ctx->num_disks;
+}
+
+static off_t raid5_map(const struct wfs_ctx *ctx, int *disk, off_t block_id) {
+  *disk = block_id % ctx->num_disks;
+  return block_id / ctx->num_disks;
+}
+
+static int raid5_allocates(const struct wfs_ctx *ctx, off_t block_id, int disk, off_t local) {
+  (void)block_id;
+  return disk != raid5_parity_disk(ctx, local);
+}
+
+//Rebuild a block of the missing disk as the XOR of the rest of its row, parity included
+static void raid5_reconstruct(struct wfs_ctx *ctx, void *block, off_t local_block_idx) {
+  off_t offset = DATA_BLOCK_OFFSET(ctx, local_block_idx);
+  memset(block, 0, BLOCK_SIZE);
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    if (disk == ctx->missing_disk) {
+      continue;
+    }
+    parity_xor(block, DISK_PTR(ctx, disk, offset), BLOCK_SIZE);
+    IO_READ(ctx, disk, offset, BLOCK_SIZE);
+  }
+  STATS_ADD(ctx->stats.reconstructed_reads, 1);
+}
+
+//Blocks of a missing disk are rebuilt one by one
+static void raid5_read_range(struct wfs_ctx *ctx, int disk, off_t local, size_t offset, size_t size, char *buf) {
+  if (disk != ctx->missing_disk) {
+    layout_copy_out(ctx, disk, local, offset, size, buf);
+    return;
+  }
+  char block[BLOCK_SIZE];
+  size_t done = 0;
+  for (int i = 0; done < size; i++) {
+    size_t block_offset = i ? 0 : offset;
+    size_t piece = MIN(BLOCK_SIZE - block_offset, size - done);
+    raid5_reconstruct(ctx, block, local + i);
+    memcpy(buf + done, block + block_offset, piece);
+    done += piece;
+  }
+}
+
+//Small write: fold old and new contents into the row's parity, then overwrite the data
+static void raid5_write(struct wfs_ctx *ctx, int disk, off_t local_block_idx, size_t offset, const char *buf, size_t size) {
+  off_t data_offset = DATA_BLOCK_OFFSET(ctx, local_block_idx) + offset;
+  int parity_disk = raid5_parity_disk(ctx, local_block_idx);
+  char *data = DISK_PTR(ctx, disk, data_offset);
+
+  intent_mark(ctx, data_offset, size);
+  IO_READ(ctx, disk, data_offset, size);
+  IO_READ(ctx, parity_disk, data_offset, size);
+  parity_xor_update(DISK_PTR(ctx, parity_disk, data_offset), data, buf, size);
+  memcpy(data, buf, size);
+  IO_WRITE(ctx, disk, data_offset, size);
+  IO_WRITE(ctx, parity_disk, data_offset, size);
+  STATS_ADD(ctx->stats.parity_rmw_writes, 1);
+}
+
+//Full-stripe write: blocks[disk] for every data disk of the row; parity needs no reads
+static void raid5_write_row(struct wfs_ctx *ctx, off_t row, const char *blocks[]) {
+  off_t offset = DATA_BLOCK_OFFSET(ctx, row);
+  int parity_disk = raid5_parity_disk(ctx, row);
+  char *parity = DISK_PTR(ctx, parity_disk, offset);
+  int first = 1;
+
+  intent_mark(ctx, offset, BLOCK_SIZE);
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    if (disk == parity_disk) {
+      continue;
+    }
+    memcpy(DISK_PTR(ctx, disk, offset), blocks[disk], BLOCK_SIZE);
+    IO_WRITE(ctx, disk, offset, BLOCK_SIZE);
+    if (first) {
+      memcpy(parity, blocks[disk], BLOCK_SIZE);
+      first = 0;
+    } else {
+      parity_xor(parity, blocks[disk], BLOCK_SIZE);
+    }
+  }
+  IO_WRITE(ctx, parity_disk, offset, BLOCK_SIZE);
+  STATS_ADD(ctx->stats.full_stripe_writes, 1);
+}
+
+/*
+  mkfs does not touch the data region, so the parity of a row nothing has
+  used yet may not match its data. Recompute it when the first block of a
+  row is handed out; from then on every write keeps it current.
+*/
+static void raid5_init_row(struct wfs_ctx *ctx, off_t row, int new_disk) {
+  int parity_disk = raid5_parity_disk(ctx, row);
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    if (disk == parity_disk || disk == new_disk) {
+      continue;
+    }
+    const char *bitmap = DISK_PTR(ctx, disk, DATA_BITMAP_OFFSET(ctx));
+    IO_READ(ctx, disk, DATA_BITMAP_OFFSET(ctx) + row / 8, 1);
+    if (bitmap[row / 8] & (1 << (row % 8))) {
+      return;
+    }
+  }
+
+  off_t offset = DATA_BLOCK_OFFSET(ctx, row);
+  char *parity = DISK_PTR(ctx, parity_disk, offset);
+  intent_mark(ctx, offset, BLOCK_SIZE);
+  memset(parity, 0, BLOCK_SIZE);
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    if (disk != parity_disk) {
+      parity_xor(parity, DISK_PTR(ctx, disk, offset), BLOCK_SIZE);
+      IO_READ(ctx, disk, offset, BLOCK_SIZE);
+    }
+  }
+  IO_WRITE(ctx, parity_disk, offset, BLOCK_SIZE);
+}
+
+//Rows are initialised against the bitmaps as they were, so a row one allocation
+//fills several blocks of still counts as fresh
+static void raid5_allocated(struct wfs_ctx *ctx, const off_t *ids, int count) {
+  for (int i = 0; i < count; i++) {
+    int disk;
+    off_t row = raid5_map(ctx, &disk, ids[i]);
+    raid5_init_row(ctx, row, disk);
+  }
+}
+
+const struct wfs_layout raid5_layout = {
+    .name = "raid5",
+    .parity = 1,
+    .map = raid5_map,
+    .allocates = raid5_allocates,
+    .allocated = raid5_allocated,
+    .read_disk = layout_same_disk,
+    .bitmap_disk = layout_own_bitmap,
+    .copies = layout_every_disk,
+    .reconstruct = raid5_reconstruct,
+    .read_range = raid5_read_range,
+    .write_range = raid5_write,
+    .replicate = layout_no_copies,
+    .write_row = raid5_write_row,
+};
@@ -0,0 +1,267 @@
+#include "rebuild.h"
+#include "engine.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+//One thread's share of a region: the slots [first, last) whose bits are set get copied,
+//or under RAID 5 (ctx set) rebuilt from the rest of their row
+struct rebuild_job {
+  int src_fd;
+  int dst_fd;
+  const char *bitmap;
+  off_t region;
+  size_t first;
+  size_t last;
+  size_t copied;
+  int ret;
+  struct wfs_ctx *ctx;
+};
+
+static int test_bit(const char *bits, size_t bit) {
+  return bits[bit / 8] & (1 << (bit % 8));
+}
+
+static int write_range(int dst_fd, const char *buf, off_t offset, size_t len) {
+  for (size_t done = 0; done < len;) {
+    ssize_t put = pwrite(dst_fd, buf + done, len - done, offset + done);
+    if (put < 0) {
+      return -errno;
+    }
+    done += put;
+  }
+  return 0;
+}
+
+static int copy_range(int src_fd, int dst_fd, char *buf, off_t offset, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t got = pread(src_fd, buf + done, len - done, offset + done);
+    if (got <= 0) {
+      return got < 0 ? -errno : -EIO;
+    }
+    done += got;
+  }
+  return write_range(dst_fd, buf, offset, len);
+}
+
+//Copy every run of set bits in the job's slice, splitting runs at WFS_REBUILD_IO_BYTES
+static void *copy_runs(void *arg) {
+  struct rebuild_job *job = arg;
+  char *buf = malloc(WFS_REBUILD_IO_BYTES);
+  if (!buf) {
+    job->ret = -ENOMEM;
+    return NULL;
+  }
+  size_t max_slots = WFS_REBUILD_IO_BYTES / BLOCK_SIZE;
+  size_t slot = job->first;
+  while (slot < job->last && job->ret == 0) {
+    if (!test_bit(job->bitmap, slot)) {
+      slot++;
+      continue;
+    }
+    size_t run_end = slot + 1;
+    while (run_end < job->last && run_end - slot < max_slots && test_bit(job->bitmap, run_end)) {
+      run_end++;
+    }
+    size_t len = (run_end - slot) * BLOCK_SIZE;
+    if (job->ctx) {
+      for (size_t row = slot; row < run_end; row++) {
+        job->ctx->layout->reconstruct(job->ctx, buf + (row - slot) * BLOCK_SIZE, row);
+      }
+      job->ret = write_range(job->dst_fd, buf, job->region + slot * BLOCK_SIZE, len);
+    } else {
+      job->ret = copy_range(job->src_fd, job->dst_fd, buf, job->region + slot * BLOCK_SIZE, len);
+    }
+    job->copied += len;
+    slot = run_end;
+  }
+  free(buf);
+  return NULL;
+}
+
+/*
+  RAID 5 keeps no second copy of a disk's data bitmap, so the lost one is
+  worked out again: the blocks on that disk some inode in use points to.
+  rows gets a bit for every row any disk has a block in use in, the rows
+  whose blocks, parity included, the new disk needs.
+*/
+static void rebuild_data_bitmap(struct wfs_ctx *ctx, int disk, char *bitmap, char *rows) {
+  size_t bytes = (ctx->sb.num_data_blocks + 7) / 8;
+  memset(bitmap, 0, bytes);
+  for (size_t i = 0; i < ctx->sb.num_inodes; i++) {
+    if (!inode_allocated(ctx, i)) {
+      continue;
+    }
+    struct wfs_inode inode;
+    load_inode(ctx, &inode, i);
+    off_t pointers[N_BLOCKS + BLOCK_SIZE / sizeof(off_t)];
+    int count = 0;
+    for (int b = 0; b < N_BLOCKS; b++) {
+      if (inode.blocks[b] != -1) {
+        pointers[count++] = inode.blocks[b];
+      }
+    }
+    //Only a regular file's last pointer is an indirect block
+    if (S_ISREG(inode.mode) && inode.blocks[N_BLOCKS - 1] != -1) {
+      off_t indirect[BLOCK_SIZE / sizeof(off_t)];
+      read_data_block(ctx, indirect, inode.blocks[N_BLOCKS - 1]);
+      for (size_t b = 0; b < BLOCK_SIZE / sizeof(off_t); b++) {
+        if (indirect[b] != -1) {
+          pointers[count++] = indirect[b];
+        }
+      }
+    }
+    for (int p = 0; p < count; p++) {
+      off_t block = WFS_BLOCK_ID(pointers[p]);
+      int on;
+      if (block < 0 || block >= num_block_ids(ctx)) {
+        continue;
+      }
+      off_t local = ctx->layout->map(ctx, &on, block);
+      if (on == disk) {
+        bitmap[local / 8] |= 1 << (local % 8);
+      }
+    }
+  }
+
+  memcpy(rows, bitmap, bytes);
+  for (int other = 0; other < ctx->num_disks; other++) {
+    if (ctx->disk_mmaps[other]) {
+      const char *theirs = DISK_PTR(ctx, other, DATA_BITMAP_OFFSET(ctx));
+      IO_READ(ctx, other, DATA_BITMAP_OFFSET(ctx), bytes);
+      for (size_t b = 0; b < bytes; b++) {
+        rows[b] |= theirs[b];
+      }
+    }
+  }
+}
+
+//Empty the replacement into a sparse image of the survivors' size, so what is not copied reads as zero
+static int reset_image(struct wfs_ctx *ctx, int fd) {
+  size_t size = 0;
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    if (ctx->disk_mmaps[disk] && ctx->disk_sizes[disk] > size) {
+      size = ctx->disk_sizes[disk];
+    }
+  }
+  if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0) {
+    return -errno;
+  }
+  return 0;
+}
+
+//Rebuild ctx->missing_disk onto the image open at fd with up to threads copy threads.
+//Caller holds ctx->lock. Returns 0, or -EINVAL when the filesystem has no lost mirror or
+//parity disk to rebuild, -EEXIST when fd is one of the survivors, or the -errno of a failed copy.
+int rebuild_disk(struct wfs_ctx *ctx, int fd, int threads, size_t *bytes_copied) {
+  int disk = ctx->missing_disk;
+  int parity = ctx->layout->parity;
+  if (disk < 0 || (!HAS_DATA_COPIES(ctx) && !parity)) {
+    return -EINVAL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return -errno;
+  }
+  for (int other = 0; other < ctx->num_disks; other++) {
+    struct stat survivor;
+    if (ctx->mapping.fds[other] >= 0 && fstat(ctx->mapping.fds[other], &survivor) == 0 &&
+        survivor.st_dev == st.st_dev && survivor.st_ino == st.st_ino) {
+      return -EEXIST;
+    }
+  }
+  threads = threads < 1 ? 1 : MIN(threads, WFS_REBUILD_MAX_THREADS);
+
+  //A RAID 10 disk holds its pair's blocks, so everything comes from its partner; a mirror
+  //has all of them on every survivor and spreads the data reads over them. RAID 5 takes
+  //the metadata from any survivor and rebuilds data from all of them.
+  int sources[MAX_DISKS];
+  int num_sources = 0;
+  for (int other = 0; other < ctx->num_disks; other++) {
+    if (ctx->disk_mmaps[other] && (IS_MIRRORED(ctx) || parity || other == RAID10_PARTNER(disk))) {
+      sources[num_sources++] = other;
+    }
+  }
+  int meta_src = IS_MIRRORED(ctx) ? ctx->meta_disk : sources[0];
+
+  //The superblock, bitmaps and inode table padding, fixed up for the new disk
+  size_t prefix = ctx->sb.i_blocks_ptr;
+  char *meta = malloc(prefix);
+  if (!meta) {
+    return -ENOMEM;
+  }
+  memcpy(meta, DISK_PTR(ctx, meta_src, 0), prefix);
+  IO_READ(ctx, meta_src, 0, prefix);
+  struct wfs_sb *sb = (struct wfs_sb *)meta;
+  sb->disk_index = disk;
+  sb->disk_id = (uint64_t)time(NULL) ^ (disk + 1) ^ rand();
+  char *rows = NULL;
+  if (parity) {
+    rows = malloc((ctx->sb.num_data_blocks + 7) / 8);
+    if (!rows) {
+      free(meta);
+      return -ENOMEM;
+    }
+    rebuild_data_bitmap(ctx, disk, meta + ctx->sb.d_bitmap_ptr, rows);
+  }
+
+  int ret = reset_image(ctx, fd);
+  size_t sb_bytes = ctx->sb.i_bitmap_ptr;
+  if (ret == 0 && pwrite(fd, meta + sb_bytes, prefix - sb_bytes, sb_bytes) != (ssize_t)(prefix - sb_bytes)) {
+    ret = -errno;
+  }
+
+  //One job for the inode table and threads for slices of the data region
+  struct rebuild_job jobs[1 + WFS_REBUILD_MAX_THREADS];
+  pthread_t handles[1 + WFS_REBUILD_MAX_THREADS];
+  int started[1 + WFS_REBUILD_MAX_THREADS];
+  int num_jobs = 0;
+  size_t slice = (ctx->sb.num_data_blocks + threads - 1) / threads;
+  if (ret == 0) {
+    jobs[num_jobs++] = (struct rebuild_job){ctx->mapping.fds[meta_src], fd, meta + ctx->sb.i_bitmap_ptr,
+                                            ctx->sb.i_blocks_ptr, 0, ctx->sb.num_inodes, 0, 0, NULL};
+    for (int t = 0; t < threads; t++) {
+      size_t first = t * slice;
+      size_t last = MIN(first + slice, ctx->sb.num_data_blocks);
+      if (first < last) {
+        jobs[num_jobs++] = (struct rebuild_job){ctx->mapping.fds[sources[t % num_sources]], fd,
+                                                parity ? rows : meta + ctx->sb.d_bitmap_ptr,
+                                                ctx->sb.d_blocks_ptr, first, last, 0, 0, parity ? ctx : NULL};
+      }
+    }
+  }
+  for (int i = 0; i < num_jobs; i++) {
+    started[i] = pthread_create(&handles[i], NULL, copy_runs, &jobs[i]) == 0;
+    if (!started[i]) {
+      copy_runs(&jobs[i]);
+    }
+  }
+  *bytes_copied = prefix - sb_bytes;
+  for (int i = 0; i < num_jobs; i++) {
+    if (started[i]) {
+      pthread_join(handles[i], NULL);
+    }
+    *bytes_copied += jobs[i].copied;
+    if (jobs[i].ret != 0 && ret == 0) {
+      ret = jobs[i].ret;
+    }
+  }
+
+  //Only once everything else is on the image does it get a superblock
+  if (ret == 0 && fsync(fd) != 0) {
+    ret = -errno;
+  }
+  if (ret == 0 && (pwrite(fd, meta, sb_bytes, 0) != (ssize_t)sb_bytes || fsync(fd) != 0)) {
+    ret = -errno;
+  }
+  free(rows);
+  free(meta);
+  return ret;
+}
@@ -0,0 +1,31 @@
+#ifndef REBUILD_H
+#define REBUILD_H
+
+#include <stddef.h>
+
+/*
+  Rebuild of a lost RAID 1, 1v, 5 or 10 disk onto a replacement image.
+  The filesystem is opened degraded without it, and the replacement is
+  first emptied into a sparse image. Then only what is in use is copied
+  from a surviving copy: the bitmaps, the inodes marked in the inode
+  bitmap and the data blocks marked in the data bitmap. A RAID 10 disk
+  copies its pair partner. A RAID 5 disk's data bitmap is worked out from
+  the inodes' block pointers, and every row with a block in use is
+  rebuilt as the XOR of the survivors. Each bitmap is cut into runs of set bits of up to
+  WFS_REBUILD_IO_BYTES, and a few threads each copy their own slice of
+  the data region with large sequential reads and writes. RAID 1 threads
+  read from different survivors. The time taken follows the space in use,
+  not the size of the disk. The superblock, with the missing disk's
+  index, is written last, so a rebuild cut short leaves an image that
+  wfs does not take for a disk.
+*/
+
+#define WFS_REBUILD_IO_BYTES (1 << 20)
+#define WFS_REBUILD_THREADS 4
+#define WFS_REBUILD_MAX_THREADS 16
+
+struct wfs_ctx;
+
+int rebuild_disk(struct wfs_ctx *ctx, int fd, int threads, size_t *bytes_copied);
+
+#endif
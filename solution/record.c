@@ -0,0 +1,107 @@
+#include "record.h"
+#include "engine.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//Records are small, so a large stdio buffer keeps writes off the callback path
+#define RECORD_BUFFER_BYTES (256 * 1024)
+
+struct wfs_recorder {
+  uint64_t id;
+  FILE *file;
+  char *buffer;
+  uint64_t start_ns;
+  uint16_t next_thread;
+  pthread_mutex_t lock;
+};
+
+//Thread numbers belong to one recorder, as trace rings do
+static uint64_t next_recorder_id = 1;
+static _Thread_local uint64_t thread_recorder_id;
+static _Thread_local uint16_t thread_number;
+
+struct wfs_recorder *record_open(const struct wfs_ctx *ctx, const char *path) {
+    struct wfs_recorder *recorder = calloc(1, sizeof(struct wfs_recorder));
+    if (!recorder) {
+        return NULL;
+    }
+    recorder->file = fopen(path, "wb");
+    if (!recorder->file) {
+        perror("Error opening record file");
+        free(recorder);
+        return NULL;
+    }
+    recorder->buffer = malloc(RECORD_BUFFER_BYTES);
+    if (recorder->buffer) {
+        setvbuf(recorder->file, recorder->buffer, _IOFBF, RECORD_BUFFER_BYTES);
+    }
+    pthread_mutex_init(&recorder->lock, NULL);
+    recorder->id = __atomic_fetch_add(&next_recorder_id, 1, __ATOMIC_RELAXED);
+    recorder->start_ns = stats_now_ns();
+
+    struct wfs_record_header header = {
+        .version = RECORD_VERSION,
+        .raid_mode = ctx->sb.raid_mode,
+        .num_disks = ctx->num_disks,
+        .chunk_blocks = ctx->sb.chunk_blocks ? ctx->sb.chunk_blocks : 1,
+        .num_inodes = ctx->sb.num_inodes,
+        .num_data_blocks = ctx->sb.num_data_blocks,
+        .compress_new_files = ctx->compress_new_files,
+        .meta_copies = ctx->meta_copies < ctx->num_disks ? ctx->meta_copies : 0,
+        .start_ns = recorder->start_ns,
+    };
+    memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+    if (fwrite(&header, sizeof(header), 1, recorder->file) != 1) {
+        perror("Error writing record header");
+        record_close(recorder);
+        return NULL;
+    }
+    return recorder;
+}
+
+//Append one finished callback. Called with the engine lock held, so records land in execution order.
+void record_op(struct wfs_recorder *recorder, int op, uint64_t start_ns, int result, const char *path,
+               const char *src_path, off_t offset, off_t offset_in, uint64_t size, mode_t mode) {
+    uint64_t now = stats_now_ns();
+    size_t path_len = strnlen(path, PATH_MAX - 1);
+    size_t src_path_len = src_path ? strnlen(src_path, PATH_MAX - 1) : 0;
+
+    pthread_mutex_lock(&recorder->lock);
+    if (thread_recorder_id != recorder->id) {
+        thread_recorder_id = recorder->id;
+        thread_number = recorder->next_thread++;
+    }
+    struct wfs_record rec = {
+        .start_ns = start_ns - recorder->start_ns,
+        .duration_ns = now - start_ns,
+        .offset = offset,
+        .offset_in = offset_in,
+        .size = size,
+        .mode = mode,
+        .result = result,
+        .thread = thread_number,
+        .op = op,
+        .path_len = path_len,
+        .src_path_len = src_path_len,
+    };
+    if (fwrite(&rec, sizeof(rec), 1, recorder->file) != 1 ||
+        fwrite(path, 1, path_len, recorder->file) != path_len ||
+        fwrite(src_path ? src_path : "", 1, src_path_len, recorder->file) != src_path_len) {
+        perror("Error writing workload record");
+    }
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+void record_close(struct wfs_recorder *recorder) {
+    if (!recorder) {
+        return;
+    }
+    if (fclose(recorder->file) != 0) {
+        perror("Error closing record file");
+    }
+    free(recorder->buffer);
+    pthread_mutex_destroy(&recorder->lock);
+    free(recorder);
+}
@@ -0,0 +1,62 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include "stats.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+  Workload recording. With `wfs --record=FILE` every FUSE callback that
+  reaches the engine is appended to FILE while the engine lock is still
+  held, so the file holds the operations in the order the engine ran
+  them. The file is a wfs_record_header followed by wfs_record entries,
+  each trailed by its path bytes and, for copies, the source path bytes.
+  Written data is not kept; wfsreplay writes a fixed pattern instead.
+*/
+
+#define RECORD_MAGIC "WFSRECRD"
+#define RECORD_VERSION 1
+
+//Record ops are enum wfs_op. The ioctl op holds WFS_IOC_SET_COMPRESSION only: WFS_IOC_ADD_DISK
+//is not recorded, as a replay has no image to grow by
+#define RECORD_OP_SET_COMPRESSION WFS_OP_IOCTL
+#define RECORD_OP_COUNT WFS_OP_COUNT
+
+struct wfs_record_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t raid_mode;
+  uint32_t num_disks;
+  uint32_t chunk_blocks;
+  uint64_t num_inodes;
+  uint64_t num_data_blocks;
+  uint32_t compress_new_files;
+  uint32_t meta_copies; //0 means a metadata copy on every disk
+  uint64_t start_ns;
+};
+
+struct wfs_record {
+  uint64_t start_ns;    //since the header's start_ns
+  uint64_t duration_ns; //inside the engine lock
+  int64_t offset;       //read/write offset, copy destination offset
+  int64_t offset_in;    //copy source offset
+  uint64_t size;        //bytes asked for; compression setting for RECORD_OP_SET_COMPRESSION
+  uint32_t mode;        //mknod/mkdir mode
+  int32_t result;
+  uint16_t thread;      //recording thread, numbered in order of first callback
+  uint8_t op;
+  uint8_t reserved;
+  uint16_t path_len;
+  uint16_t src_path_len; //nonzero only for copies
+};
+
+struct wfs_recorder;
+struct wfs_ctx;
+
+struct wfs_recorder *record_open(const struct wfs_ctx *ctx, const char *path);
+void record_op(struct wfs_recorder *recorder, int op, uint64_t start_ns, int result, const char *path,
+               const char *src_path, off_t offset, off_t offset_in, uint64_t size, mode_t mode);
+void record_close(struct wfs_recorder *recorder);
+
+#endif
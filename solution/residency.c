@@ -0,0 +1,156 @@
+#include "residency.h"
+#include "engine.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+//The metadata of all disks together is made resident in at most 1/8 of physical memory
+#define RESIDENT_MEMORY_SHARE 8
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+//Consume --meta=, --data= and --hugepages; returns 1 if used, 0 if not ours, -1 on a bad value
+int residency_parse_option(const char *arg, struct wfs_residency *policy) {
+  if (strncmp(arg, "--meta=", strlen("--meta=")) == 0) {
+    const char *value = arg + strlen("--meta=");
+    if (strcmp(value, "none") == 0) {
+      policy->meta = WFS_META_NONE;
+    } else if (strcmp(value, "prefault") == 0) {
+      policy->meta = WFS_META_PREFAULT;
+    } else if (strcmp(value, "pin") == 0) {
+      policy->meta = WFS_META_PIN;
+    } else {
+      return -1;
+    }
+    return 1;
+  }
+  if (strncmp(arg, "--data=", strlen("--data=")) == 0) {
+    const char *value = arg + strlen("--data=");
+    if (strcmp(value, "normal") == 0) {
+      policy->data = WFS_DATA_NORMAL;
+    } else if (strcmp(value, "random") == 0) {
+      policy->data = WFS_DATA_RANDOM;
+    } else if (strcmp(value, "sequential") == 0) {
+      policy->data = WFS_DATA_SEQUENTIAL;
+    } else {
+      return -1;
+    }
+    return 1;
+  }
+  if (strcmp(arg, "--hugepages") == 0) {
+    policy->hugepages = 1;
+    return 1;
+  }
+  return 0;
+}
+
+//Read every page of [addr, addr + len) in; a later first write is then only a minor fault
+static void prefault(char *addr, size_t len) {
+#ifdef MADV_POPULATE_READ
+  if (madvise(addr, len, MADV_POPULATE_READ) == 0) {
+    return;
+  }
+#endif
+  madvise(addr, len, MADV_WILLNEED);
+  long page_size = sysconf(_SC_PAGESIZE);
+  for (size_t off = 0; off < len; off += page_size) {
+    (void)*(volatile char *)(addr + off);
+  }
+}
+
+//Huge pages only apply to the 2 MiB aligned part of the region
+static void advise_hugepages(char *addr, size_t len) {
+#ifdef MADV_HUGEPAGE
+  uintptr_t start = ((uintptr_t)addr + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  uintptr_t end = ((uintptr_t)addr + len) & ~(HUGE_PAGE_SIZE - 1);
+  if (end > start) {
+    madvise((void *)start, end - start, MADV_HUGEPAGE);
+  }
+#else
+  (void)addr;
+  (void)len;
+#endif
+}
+
+/*
+  Bytes at the start of each disk to make resident. The superblock and
+  bitmaps always are; the inode table grows with mkfs -i at a block per
+  inode, so only as much of it as fits a share of physical memory, split
+  over the disks. The length to pin is also held to the memlock limit,
+  even below the bitmaps; the caller prefaults what is left over.
+*/
+static size_t resident_len(const struct wfs_ctx *ctx, int pin, long page_size) {
+  size_t meta_len = (ctx->sb.d_blocks_ptr + page_size - 1) / page_size * page_size;
+  size_t min_len = (ctx->sb.i_blocks_ptr + page_size - 1) / page_size * page_size;
+  long pages = sysconf(_SC_PHYS_PAGES);
+  size_t budget = pages > 0 ? (size_t)pages * page_size / RESIDENT_MEMORY_SHARE : min_len;
+  budget = MIN(meta_len, MAX(min_len, budget / ctx->num_disks / page_size * page_size));
+  struct rlimit limit;
+  if (pin && getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+    budget = MIN(budget, limit.rlim_cur / ctx->num_disks / page_size * page_size);
+  }
+  return budget;
+}
+
+/*
+  Applied from the FUSE init callback: mlock is not inherited across the
+  fork FUSE uses to daemonize, so it must run in the process that serves
+  requests. Failures only degrade the policy; they never fail the mount.
+*/
+int residency_apply(struct wfs_ctx *ctx, const struct wfs_residency *policy) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  size_t meta_len = (ctx->sb.d_blocks_ptr + page_size - 1) / page_size * page_size;
+  size_t pin_len = resident_len(ctx, 1, page_size);
+  size_t prefault_len = resident_len(ctx, 0, page_size);
+  int warned = 0;
+  int ret = 0;
+
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    char *base = ctx->disk_mmaps[disk];
+    if (!base) {
+      continue;
+    }
+    size_t len = MIN(prefault_len, ctx->disk_sizes[disk]);
+
+    if (policy->hugepages) {
+      advise_hugepages(base, MIN(meta_len, ctx->disk_sizes[disk]));
+    }
+    if (policy->meta == WFS_META_PIN) {
+      //mlock faults the range in itself; what is past the memlock limit is prefaulted
+      size_t locked = MIN(pin_len, len);
+      if (locked > 0 && mlock(base, locked) != 0) {
+        if (!warned) {
+          perror("Could not lock metadata in memory, prefaulting instead");
+          warned = 1;
+        }
+        ret = -1;
+        locked = 0;
+      }
+      STATS_ADD(ctx->stats.meta_bytes_locked, locked);
+      if (len > locked) {
+        prefault(base + locked, len - locked);
+        STATS_ADD(ctx->stats.meta_bytes_prefaulted, len - locked);
+      }
+    } else if (policy->meta == WFS_META_PREFAULT) {
+      prefault(base, len);
+      STATS_ADD(ctx->stats.meta_bytes_prefaulted, len);
+    }
+
+    //The data region starts on a block boundary; madvise wants a page boundary.
+    //Windowed mounts have no data mapped yet, so each window gets the advice as it is mapped.
+    if (policy->data != WFS_DATA_NORMAL && ctx->disk_sizes[disk] > meta_len) {
+      int advice = policy->data == WFS_DATA_RANDOM ? MADV_RANDOM : MADV_SEQUENTIAL;
+      if (ctx->mapping.window_bytes) {
+        ctx->mapping.data_advice = advice;
+      } else {
+        madvise(base + meta_len, ctx->disk_sizes[disk] - meta_len, advice);
+      }
+    }
+  }
+  return ret;
+}
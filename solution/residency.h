@@ -0,0 +1,38 @@
+#ifndef RESIDENCY_H
+#define RESIDENCY_H
+
+/*
+  Memory-residency policy for the mapped disk images. The metadata
+  region of every disk (superblock, bitmaps, inode table) is touched by
+  nearly every operation, so it is prefaulted or locked into memory at
+  mount, up to a share of physical memory and locking no more than the
+  memlock limit allows (see residency.c); the data region only gets an
+  access-pattern hint.
+*/
+
+enum wfs_meta_policy {
+  WFS_META_NONE,     //leave metadata to demand paging
+  WFS_META_PREFAULT, //fault it in once at mount
+  WFS_META_PIN,      //mlock it up to the lock limit and prefault the rest
+};
+
+enum wfs_data_advice {
+  WFS_DATA_NORMAL,
+  WFS_DATA_RANDOM,
+  WFS_DATA_SEQUENTIAL,
+};
+
+struct wfs_residency {
+  enum wfs_meta_policy meta;
+  enum wfs_data_advice data;
+  int hugepages; //ask for transparent huge pages on 2 MiB aligned metadata
+};
+
+#define WFS_RESIDENCY_DEFAULT {WFS_META_PIN, WFS_DATA_NORMAL, 0}
+
+struct wfs_ctx;
+
+int residency_parse_option(const char *arg, struct wfs_residency *policy);
+int residency_apply(struct wfs_ctx *ctx, const struct wfs_residency *policy);
+
+#endif
@@ -0,0 +1,247 @@
+#include "stats.h"
+#include "engine.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *op_names[WFS_OP_COUNT] = {
+  [WFS_OP_GETATTR] = "getattr",
+  [WFS_OP_MKNOD]   = "mknod",
+  [WFS_OP_MKDIR]   = "mkdir",
+  [WFS_OP_UNLINK]  = "unlink",
+  [WFS_OP_RMDIR]   = "rmdir",
+  [WFS_OP_READ]    = "read",
+  [WFS_OP_WRITE]   = "write",
+  [WFS_OP_READDIR] = "readdir",
+  [WFS_OP_COPY_RANGE] = "copy_range",
+  [WFS_OP_IOCTL]   = "ioctl",
+};
+
+const char *stats_op_name(enum wfs_op op) {
+  return op_names[op];
+}
+
+uint64_t stats_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//Log2 bucket of a latency, clamped into the histogram
+static int latency_bucket(uint64_t ns) {
+  int bucket = 63 - __builtin_clzll(ns | 1);
+  return bucket < STATS_HIST_BUCKETS ? bucket : STATS_HIST_BUCKETS - 1;
+}
+
+//Account one finished callback that started at start_ns
+void stats_record_op(struct wfs_stats *stats, enum wfs_op op, uint64_t start_ns, int result) {
+  stats_record_latency(&stats->ops[op], stats_now_ns() - start_ns, result);
+}
+
+//Account one call that took elapsed nanoseconds
+void stats_record_latency(struct wfs_op_stats *op_stats, uint64_t elapsed, int result) {
+
+  STATS_ADD(op_stats->calls, 1);
+  STATS_ADD(op_stats->total_ns, elapsed);
+  STATS_ADD(op_stats->hist[latency_bucket(elapsed)], 1);
+  if (result < 0) {
+    STATS_ADD(op_stats->errors, 1);
+  }
+
+  uint64_t max = __atomic_load_n(&op_stats->max_ns, __ATOMIC_RELAXED);
+  while (elapsed > max &&
+         !__atomic_compare_exchange_n(&op_stats->max_ns, &max, elapsed, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+//Upper bound of the bucket holding the given quantile, in parts per thousand
+uint64_t stats_quantile_ns(const struct wfs_op_stats *op_stats, uint64_t calls, int permille) {
+  uint64_t target = (calls * permille + 999) / 1000;
+  uint64_t seen = 0;
+  for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+    seen += op_stats->hist[i];
+    if (seen >= target) {
+      return 2ULL << i;
+    }
+  }
+  return 2ULL << (STATS_HIST_BUCKETS - 1);
+}
+
+struct render_buf {
+  char *buf;
+  size_t size;
+  size_t len;
+};
+
+//snprintf-style append: keeps counting past the end so callers can size buffers
+static void append(struct render_buf *out, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  size_t room = out->len < out->size ? out->size - out->len : 0;
+  int written = vsnprintf(room ? out->buf + out->len : NULL, room, fmt, args);
+  va_end(args);
+  if (written > 0) {
+    out->len += written;
+  }
+}
+
+/*
+  Render every counter as line-oriented text, one record per line, so the
+  output can be scraped and graphed. Returns the full length, which may be
+  larger than size (the output is then truncated, as with snprintf).
+*/
+size_t stats_render(const struct wfs_ctx *ctx, char *buf, size_t size) {
+  const struct wfs_stats *stats = &ctx->stats;
+  struct render_buf out = {buf, size, 0};
+
+  for (int op = 0; op < WFS_OP_COUNT; op++) {
+    const struct wfs_op_stats *op_stats = &stats->ops[op];
+    uint64_t calls = op_stats->calls;
+    append(&out, "op %s calls=%lu errors=%lu total_ns=%lu avg_ns=%lu max_ns=%lu",
+           op_names[op], calls, op_stats->errors, op_stats->total_ns,
+           calls ? op_stats->total_ns / calls : 0, op_stats->max_ns);
+    if (calls) {
+      append(&out, " p50_ns=%lu p90_ns=%lu p99_ns=%lu p999_ns=%lu",
+             stats_quantile_ns(op_stats, calls, 500), stats_quantile_ns(op_stats, calls, 900),
+             stats_quantile_ns(op_stats, calls, 990), stats_quantile_ns(op_stats, calls, 999));
+    }
+    append(&out, "\n");
+
+    //Only the populated buckets: "<bucket upper bound ns>:<count>"
+    append(&out, "hist %s", op_names[op]);
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+      if (op_stats->hist[i]) {
+        append(&out, " %lu:%lu", 2UL << i, op_stats->hist[i]);
+      }
+    }
+    append(&out, "\n");
+  }
+
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    append(&out, "disk %d bytes_read=%lu bytes_written=%lu\n", disk,
+           stats->disk_bytes_read[disk], stats->disk_bytes_written[disk]);
+  }
+
+  append(&out, "alloc blocks_allocated=%lu blocks_freed=%lu block_alloc_failures=%lu "
+               "block_alloc_probes=%lu inodes_allocated=%lu inodes_freed=%lu "
+               "inode_alloc_failures=%lu\n",
+         stats->blocks_allocated, stats->blocks_freed, stats->block_alloc_failures,
+         stats->block_alloc_probes, stats->inodes_allocated, stats->inodes_freed,
+         stats->inode_alloc_failures);
+  append(&out, "lookup cache_hits=%lu walks=%lu\n", stats->lookup_cache_hits, stats->lookup_walks);
+
+  if (ctx->sb.raid_mode == RAID_5) {
+    append(&out, "raid5 full_stripe_writes=%lu rmw_writes=%lu reconstructed_reads=%lu missing_disk=%d\n",
+           stats->full_stripe_writes, stats->parity_rmw_writes, stats->reconstructed_reads,
+           ctx->missing_disk);
+  }
+
+  if (ctx->intent.enabled) {
+    int dirty = 0;
+    for (int i = 0; i < WFS_INTENT_BYTES; i++) {
+      dirty += __builtin_popcount(ctx->sb.write_intent[i]);
+    }
+    append(&out, "intent region_bytes=%zu dirty_regions=%d marks=%lu clears=%lu resynced_regions=%lu\n",
+           ctx->intent.region_bytes, dirty, stats->intent_marks, stats->intent_clears,
+           stats->intent_resynced_regions);
+  }
+
+  if (ctx->compress_new_files || stats->clusters_compressed || stats->clusters_stored_plain) {
+    append(&out, "compress clusters_compressed=%lu clusters_plain=%lu bytes_in=%lu bytes_stored=%lu\n",
+           stats->clusters_compressed, stats->clusters_stored_plain, stats->cluster_bytes_in,
+           stats->cluster_bytes_stored);
+  }
+
+  if (ctx->tier.placement) {
+    append(&out, "tier promotions=%lu demotions=%lu\n", stats->tier_promotions, stats->tier_demotions);
+  }
+
+  if (ctx->discard.enabled || stats->discard_punches) {
+    append(&out, "discard queued=%d punches=%lu bytes=%lu\n", ctx->discard.count, stats->discard_punches,
+           stats->discard_bytes);
+  }
+
+  if (ctx->sb.grow_from_disks || stats->grow_disks_added) {
+    append(&out, "grow disks_added=%lu rebalance_from=%u cursor=%lu of=%zu moved=%lu\n", stats->grow_disks_added,
+           ctx->sb.grow_from_disks, ctx->sb.grow_cursor, ctx->sb.num_data_blocks * ctx->sb.grow_from_disks,
+           stats->rebalance_blocks_moved);
+  }
+
+  if (ctx->pio.num_workers) {
+    append(&out, "parallel_io workers=%d split_requests=%lu disks_per_request=%.2f\n", ctx->pio.num_workers,
+           stats->pio_batches, stats->pio_batches ? (double)stats->pio_disks / stats->pio_batches : 0.0);
+  }
+
+  if (ctx->mapping.window_bytes) {
+    append(&out, "mapping window_bytes=%zu max_windows=%d active=%d pinned_bytes=%zu mapped=%lu evicted=%lu\n",
+           ctx->mapping.window_bytes, ctx->mapping.max_windows, ctx->mapping.active,
+           ctx->mapping.meta_bytes, stats->map_windows_mapped, stats->map_windows_evicted);
+  }
+
+  //Process-wide fault counts show whether the residency policy keeps metadata in memory
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  append(&out, "residency meta_locked_bytes=%lu meta_prefaulted_bytes=%lu major_faults=%ld "
+               "minor_faults=%ld\n",
+         stats->meta_bytes_locked, stats->meta_bytes_prefaulted, usage.ru_majflt, usage.ru_minflt);
+
+  return out.len;
+}
+
+//Render into a heap buffer and write it out in one go
+static void dump_stats(const struct wfs_ctx *ctx, int fd) {
+  size_t len = stats_render(ctx, NULL, 0);
+  char *text = malloc(len + 1);
+  if (!text) {
+    return;
+  }
+  stats_render(ctx, text, len + 1);
+  if (write(fd, text, len) < 0) {
+    perror("Error dumping stats");
+  }
+  free(text);
+}
+
+static void *signal_dump_thread(void *arg) {
+  struct wfs_ctx *ctx = arg;
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+
+  for (;;) {
+    int sig;
+    if (sigwait(&set, &sig) == 0 && sig == SIGUSR1) {
+      dump_stats(ctx, STDERR_FILENO);
+    }
+  }
+  return NULL;
+}
+
+/*
+  SIGUSR1 is blocked in the main thread before fuse_main spawns its workers,
+  so every thread inherits the mask and only the dump thread, which waits for
+  it synchronously, ever receives it. Formatting then happens outside signal
+  context.
+*/
+int stats_block_dump_signal(void) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  return pthread_sigmask(SIG_BLOCK, &set, NULL) == 0 ? 0 : -1;
+}
+
+//Started from the FUSE init callback so the thread survives daemonizing
+int stats_start_signal_dump(struct wfs_ctx *ctx) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, signal_dump_thread, ctx) != 0) {
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
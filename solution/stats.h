@@ -0,0 +1,91 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "wfs.h"
+#include <stddef.h>
+#include <stdint.h>
+
+//Virtual read-only files served by the FUSE layer, never stored on disk
+#define STATS_DIR_PATH "/.wfs"
+#define STATS_FILE_PATH "/.wfs/stats"
+
+//Latency buckets are powers of two in nanoseconds: bucket i holds [2^i, 2^(i+1))
+#define STATS_HIST_BUCKETS 40
+
+enum wfs_op {
+  WFS_OP_GETATTR,
+  WFS_OP_MKNOD,
+  WFS_OP_MKDIR,
+  WFS_OP_UNLINK,
+  WFS_OP_RMDIR,
+  WFS_OP_READ,
+  WFS_OP_WRITE,
+  WFS_OP_READDIR,
+  WFS_OP_COPY_RANGE,
+  WFS_OP_IOCTL, //compression changes and grows, kept out of the write latencies
+  WFS_OP_COUNT
+};
+
+struct wfs_op_stats {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t hist[STATS_HIST_BUCKETS];
+};
+
+/*
+  Counters are updated with relaxed atomics from any FUSE thread; readers
+  take an unsynchronised snapshot, which is fine for monitoring.
+*/
+struct wfs_stats {
+  struct wfs_op_stats ops[WFS_OP_COUNT];
+  uint64_t disk_bytes_read[MAX_DISKS];
+  uint64_t disk_bytes_written[MAX_DISKS];
+  uint64_t blocks_allocated;
+  uint64_t blocks_freed;
+  uint64_t block_alloc_failures;
+  uint64_t block_alloc_probes;
+  uint64_t inodes_allocated;
+  uint64_t inodes_freed;
+  uint64_t inode_alloc_failures;
+  uint64_t meta_bytes_locked;
+  uint64_t meta_bytes_prefaulted;
+  uint64_t full_stripe_writes;
+  uint64_t parity_rmw_writes;
+  uint64_t reconstructed_reads;
+  uint64_t intent_marks;
+  uint64_t intent_clears;
+  uint64_t intent_resynced_regions;
+  uint64_t clusters_compressed;
+  uint64_t clusters_stored_plain;
+  uint64_t cluster_bytes_in;
+  uint64_t cluster_bytes_stored;
+  uint64_t map_windows_mapped;
+  uint64_t map_windows_evicted;
+  uint64_t lookup_cache_hits;
+  uint64_t lookup_walks;
+  uint64_t tier_promotions;
+  uint64_t tier_demotions;
+  uint64_t discard_punches;
+  uint64_t discard_bytes;
+  uint64_t grow_disks_added;
+  uint64_t rebalance_blocks_moved;
+  uint64_t pio_batches;
+  uint64_t pio_disks;
+};
+
+#define STATS_ADD(field, value) __atomic_fetch_add(&(field), (value), __ATOMIC_RELAXED)
+
+struct wfs_ctx;
+
+const char *stats_op_name(enum wfs_op op);
+uint64_t stats_now_ns(void);
+void stats_record_op(struct wfs_stats *stats, enum wfs_op op, uint64_t start_ns, int result);
+void stats_record_latency(struct wfs_op_stats *op_stats, uint64_t elapsed_ns, int result);
+uint64_t stats_quantile_ns(const struct wfs_op_stats *op_stats, uint64_t calls, int permille);
+size_t stats_render(const struct wfs_ctx *ctx, char *buf, size_t size);
+int stats_block_dump_signal(void);
+int stats_start_signal_dump(struct wfs_ctx *ctx);
+
+#endif
@@ -0,0 +1,252 @@
+#include "tier.h"
+#include "engine.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+//Inodes the migrator visits per lock hold, how often it wakes, and the least time between
+//the starts of two passes, which is also how often the heat halves
+#define MIGRATE_BATCH 64
+#define MIGRATE_TICK_US 100000
+#define MIGRATE_PASS_INTERVAL_US 5000000
+
+//Tier mkfs gave a disk; images formatted before the tags existed are all capacity
+int tier_of_disk(const struct wfs_sb *sb, int disk) {
+    if (sb->i_bitmap_ptr < (off_t)(offsetof(struct wfs_sb, disk_tiers) + sizeof(sb->disk_tiers))) {
+        return WFS_TIER_CAPACITY;
+    }
+    return sb->disk_tiers[disk] == WFS_TIER_FAST ? WFS_TIER_FAST : WFS_TIER_CAPACITY;
+}
+
+//Pick the copies reads go to and, where blocks can be placed by tier, start tracking heat.
+//Called once the superblock and the set of present disks are known.
+int tier_open(struct wfs_ctx *ctx) {
+    struct wfs_tier *tier = &ctx->tier;
+    tier->mirror_reader = ctx->meta_disk;
+    int fast = -1;
+    for (int disk = ctx->num_disks - 1; disk >= 0; disk--) {
+        if (ctx->disk_mmaps[disk] && tier_of_disk(&ctx->sb, disk) == WFS_TIER_FAST) {
+            fast = disk;
+        }
+    }
+    if (fast < 0) {
+        return 0;
+    }
+
+    //Every disk holds the superblock and, unless -m says otherwise, all other metadata
+    if (tier_of_disk(&ctx->sb, ctx->meta_disk) != WFS_TIER_FAST) {
+        ctx->meta_disk = fast;
+    }
+    tier->mirror_reader = fast;
+
+    int seen[2] = {0};
+    for (int disk = 0; disk < ctx->num_disks; disk++) {
+        int disk_tier = tier_of_disk(&ctx->sb, disk);
+        if (ctx->sb.raid_mode == RAID_10) {
+            //A pair only counts as fast when both of its members are; a mixed pair is read from its fast one
+            int partner_tier = tier_of_disk(&ctx->sb, RAID10_PARTNER(disk));
+            if (disk_tier == WFS_TIER_FAST && partner_tier != WFS_TIER_FAST) {
+                tier->fast_members |= 1 << disk;
+            }
+            disk_tier = disk_tier == WFS_TIER_FAST && partner_tier == WFS_TIER_FAST ? WFS_TIER_FAST
+                                                                                    : WFS_TIER_CAPACITY;
+        }
+        tier->block_tier[disk] = disk_tier;
+        seen[disk_tier] = 1;
+    }
+
+    //RAID 1 and 1v hold every block on every disk, and a RAID 5 row spans them all
+    tier->placement = (ctx->sb.raid_mode == RAID_0 || ctx->sb.raid_mode == RAID_10) && seen[0] && seen[1];
+    if (tier->placement) {
+        tier->heat = calloc(ctx->sb.num_data_blocks * ctx->num_disks, 1);
+        if (!tier->heat) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//Take in a disk a RAID 0 grow added: the tier of its blocks and heat for the ids it brings.
+//Placement may only now see both tiers. Caller holds ctx->lock.
+int tier_add_disk(struct wfs_ctx *ctx, int disk) {
+    struct wfs_tier *tier = &ctx->tier;
+    tier->block_tier[disk] = tier_of_disk(&ctx->sb, disk);
+    int seen[2] = {0};
+    for (int d = 0; d < ctx->num_disks; d++) {
+        seen[tier->block_tier[d]] = 1;
+    }
+    tier->placement = seen[0] && seen[1];
+    if (!tier->placement) {
+        return 0;
+    }
+    size_t old_ids = tier->heat ? ctx->sb.num_data_blocks * disk : 0;
+    uint8_t *heat = realloc(tier->heat, ctx->sb.num_data_blocks * ctx->num_disks);
+    if (!heat) {
+        tier->placement = 0;
+        return -1;
+    }
+    memset(heat + old_ids, 0, ctx->sb.num_data_blocks * ctx->num_disks - old_ids);
+    tier->heat = heat;
+    return 0;
+}
+
+//Count a read of file blocks first..last of map. Caller holds ctx->lock.
+void tier_note_reads(struct wfs_ctx *ctx, const off_t *map, size_t first, size_t last) {
+    uint8_t *heat = ctx->tier.heat;
+    if (!heat) {
+        return;
+    }
+    for (size_t i = first; i <= last; i++) {
+        if (map[i] != -1 && heat[WFS_BLOCK_ID(map[i])] < UINT8_MAX) {
+            heat[WFS_BLOCK_ID(map[i])]++;
+        }
+    }
+}
+
+//Tier a file block should move to, or -1 to leave it. Files that fit in the direct
+//pointers keep their fast blocks however cold they get.
+static int target_tier(struct wfs_ctx *ctx, off_t block, int small_file) {
+    int disk;
+    calculate_raid_disk(ctx, &disk, block);
+    int heat = ctx->tier.heat[block];
+    if (ctx->tier.block_tier[disk] == WFS_TIER_CAPACITY && heat >= WFS_TIER_HOT) {
+        return WFS_TIER_FAST;
+    }
+    if (ctx->tier.block_tier[disk] == WFS_TIER_FAST && heat == 0 && !small_file) {
+        return WFS_TIER_CAPACITY;
+    }
+    return -1;
+}
+
+//Move the blocks of one file whose tier no longer fits their heat. A block is copied and the
+//file pointed at the copy before the old block is freed. Returns the blocks moved.
+static int migrate_file(struct wfs_ctx *ctx, int inode_num) {
+    struct wfs_inode inode;
+    load_inode(ctx, &inode, inode_num);
+    //Compressed clusters are never read block by block, so they gather no heat
+    if (!S_ISREG(inode.mode) || (inode.flags & WFS_INODE_COMPRESSED)) {
+        return 0;
+    }
+
+    off_t map[MAX_FILE_BLOCKS];
+    size_t count = N_BLOCKS - 1;
+    memcpy(map, inode.blocks, count * sizeof(off_t));
+    if (inode.blocks[N_BLOCKS - 1] != -1) {
+        read_data_block(ctx, map + N_BLOCKS - 1, inode.blocks[N_BLOCKS - 1]);
+        count = MAX_FILE_BLOCKS;
+    }
+    int small_file = inode.size <= (off_t)(N_BLOCKS - 1) * BLOCK_SIZE;
+
+    off_t old_blocks[MAX_FILE_BLOCKS];
+    int moved = 0;
+    int direct_changed = 0;
+    int indirect_changed = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (map[i] == -1) {
+            continue;
+        }
+        off_t block = map[i];
+        int target = target_tier(ctx, block, small_file);
+        off_t new_block;
+        if (target < 0 || get_tier_blocks(ctx, 1, &new_block, target, 1) < 0) {
+            continue;
+        }
+        char data[BLOCK_SIZE];
+        read_data_block(ctx, data, block);
+        write_data_block(ctx, data, new_block);
+        ctx->tier.heat[new_block] = ctx->tier.heat[block];
+        ctx->tier.heat[block] = 0;
+        map[i] = new_block;
+        old_blocks[moved++] = block;
+        direct_changed |= i < N_BLOCKS - 1;
+        indirect_changed |= i >= N_BLOCKS - 1;
+        if (target == WFS_TIER_FAST) {
+            STATS_ADD(ctx->stats.tier_promotions, 1);
+        } else {
+            STATS_ADD(ctx->stats.tier_demotions, 1);
+        }
+    }
+
+    if (indirect_changed) {
+        write_data_block(ctx, map + N_BLOCKS - 1, inode.blocks[N_BLOCKS - 1]);
+    }
+    if (direct_changed) {
+        memcpy(inode.blocks, map, (N_BLOCKS - 1) * sizeof(off_t));
+        write_inode(ctx, &inode, inode_num);
+    }
+    for (int i = 0; i < moved; i++) {
+        clear_data_block(ctx, old_blocks[i]);
+    }
+    return moved;
+}
+
+//Visit up to max_inodes inodes from the cursor; finishing a pass halves every heat counter.
+//Caller holds ctx->lock. Returns the blocks moved.
+int tier_migrate_step(struct wfs_ctx *ctx, size_t max_inodes) {
+    struct wfs_tier *tier = &ctx->tier;
+    if (!tier->heat || ctx->missing_disk >= 0) {
+        return 0;
+    }
+
+    size_t end = MIN(tier->cursor + max_inodes, ctx->sb.num_inodes);
+    int moved = 0;
+    for (size_t i = tier->cursor; i < end; i++) {
+        if (inode_allocated(ctx, i)) {
+            moved += migrate_file(ctx, i);
+        }
+    }
+    tier->cursor = end;
+
+    if (end == ctx->sb.num_inodes) {
+        tier->cursor = 0;
+        size_t num_ids = ctx->sb.num_data_blocks * ctx->num_disks;
+        for (size_t id = 0; id < num_ids; id++) {
+            tier->heat[id] >>= 1;
+        }
+    }
+    return moved;
+}
+
+static void *migrator_thread(void *arg) {
+    struct wfs_ctx *ctx = arg;
+    long wait_us = 0;
+    while (!__atomic_load_n(&ctx->tier.migrator_stop, __ATOMIC_ACQUIRE)) {
+        usleep(MIGRATE_TICK_US);
+        wait_us -= MIGRATE_TICK_US;
+        if (wait_us > 0) {
+            continue;
+        }
+        pthread_mutex_lock(&ctx->lock);
+        tier_migrate_step(ctx, MIGRATE_BATCH);
+        int pass_done = ctx->tier.cursor == 0;
+        mapping_release(ctx);
+        pthread_mutex_unlock(&ctx->lock);
+        wait_us = pass_done ? MIGRATE_PASS_INTERVAL_US : 0;
+    }
+    return NULL;
+}
+
+//Start moving blocks between the tiers in the background; a no-op without placement
+int tier_start_migrator(struct wfs_ctx *ctx) {
+    if (!ctx->tier.heat || ctx->tier.migrator_running || ctx->missing_disk >= 0) {
+        return 0;
+    }
+    if (pthread_create(&ctx->tier.migrator_thread, NULL, migrator_thread, ctx) != 0) {
+        return -1;
+    }
+    ctx->tier.migrator_running = 1;
+    return 0;
+}
+
+void tier_close(struct wfs_ctx *ctx) {
+    struct wfs_tier *tier = &ctx->tier;
+    if (tier->migrator_running) {
+        __atomic_store_n(&tier->migrator_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(tier->migrator_thread, NULL);
+        tier->migrator_running = 0;
+    }
+    free(tier->heat);
+    tier->heat = NULL;
+}
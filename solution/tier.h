@@ -0,0 +1,49 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "wfs.h"
+
+/*
+  Tiering over disks of different speed. mkfs tags every disk fast or
+  capacity (wfs_sb.disk_tiers). Metadata and mirrored data are read
+  from a fast copy whenever there is one. Where a block lives on a
+  single disk or mirror pair (RAID 0, RAID 10) the allocator can also
+  choose its tier: directory blocks, indirect blocks and the direct
+  blocks of a file go to the fast tier, the blocks behind the indirect
+  block to the capacity tier, each falling back to the other tier when
+  its own is full. Reads warm a per-block heat counter, and a migrator
+  walking the inode table moves hot file blocks up and cold blocks of
+  files too big for the direct pointers down, halving every counter
+  after each full pass.
+*/
+
+//Reads since the last decay that earn a capacity block a place on the fast tier
+#define WFS_TIER_HOT 4
+
+struct wfs_tier {
+  int placement;                  //the layout lets blocks be steered to a tier, and both tiers exist
+  uint8_t block_tier[MAX_DISKS];  //tier of a block whose primary copy sits on each disk
+  int mirror_reader;              //RAID 1: disk data blocks are read from
+  uint8_t fast_members;           //RAID 10: bit per disk that is the fast member of a mixed pair
+  uint8_t *heat;                  //per block id, saturating; NULL without placement
+  size_t cursor;                  //next inode the migrator visits
+  pthread_t migrator_thread;
+  int migrator_running;
+  int migrator_stop;
+};
+
+struct wfs_ctx;
+
+int tier_of_disk(const struct wfs_sb *sb, int disk);
+int tier_open(struct wfs_ctx *ctx);
+int tier_add_disk(struct wfs_ctx *ctx, int disk);
+void tier_note_reads(struct wfs_ctx *ctx, const off_t *map, size_t first, size_t last);
+int tier_migrate_step(struct wfs_ctx *ctx, size_t max_inodes);
+int tier_start_migrator(struct wfs_ctx *ctx);
+void tier_close(struct wfs_ctx *ctx);
+
+#endif
@@ -0,0 +1,192 @@
+#include "trace.h"
+#include "engine.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TRACE_FLUSH_INTERVAL_US 50000
+
+//Single-producer (owning thread) single-consumer (flusher) ring
+struct trace_ring {
+  uint64_t head; //next slot the owner writes
+  uint64_t tail; //next slot the flusher reads
+  struct trace_ring *next;
+  struct wfs_trace_rec recs[TRACE_RING_SIZE];
+};
+
+struct wfs_trace {
+  uint64_t id;
+  int fd;
+  uint64_t start_ns;
+  uint64_t dropped;
+  pthread_mutex_t lock; //guards the ring list and the file
+  struct trace_ring *rings;
+  pthread_t flusher;
+  int flusher_running;
+  int stop;
+};
+
+//Rings are tied to a trace id, not its address, so a reopened trace never sees a freed ring
+static uint64_t next_trace_id = 1;
+static _Thread_local struct trace_ring *thread_ring;
+static _Thread_local uint64_t thread_ring_trace_id;
+static _Thread_local int thread_origin = TRACE_ORIGIN_INTERNAL;
+
+//Tag the records this thread makes until the next call
+void trace_set_origin(int origin) {
+  thread_origin = origin;
+}
+
+struct wfs_trace *trace_open(const struct wfs_ctx *ctx, const char *path) {
+  struct wfs_trace *trace = calloc(1, sizeof(struct wfs_trace));
+  if (!trace) {
+    return NULL;
+  }
+
+  trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (trace->fd < 0) {
+    perror("Error opening trace file");
+    free(trace);
+    return NULL;
+  }
+  pthread_mutex_init(&trace->lock, NULL);
+  trace->id = __atomic_fetch_add(&next_trace_id, 1, __ATOMIC_RELAXED);
+  trace->start_ns = stats_now_ns();
+
+  struct wfs_trace_header header = {
+    .version = TRACE_VERSION,
+    .num_disks = ctx->num_disks,
+    .block_size = BLOCK_SIZE,
+    .raid_mode = ctx->sb.raid_mode,
+    .start_ns = trace->start_ns,
+    .i_bitmap_ptr = ctx->sb.i_bitmap_ptr,
+    .d_bitmap_ptr = ctx->sb.d_bitmap_ptr,
+    .i_blocks_ptr = ctx->sb.i_blocks_ptr,
+    .d_blocks_ptr = ctx->sb.d_blocks_ptr,
+  };
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  if (write(trace->fd, &header, sizeof(header)) != sizeof(header)) {
+    perror("Error writing trace header");
+    close(trace->fd);
+    free(trace);
+    return NULL;
+  }
+  return trace;
+}
+
+//First record from a thread: give it a ring and publish it to the flusher
+static struct trace_ring *attach_ring(struct wfs_trace *trace) {
+  struct trace_ring *ring = calloc(1, sizeof(struct trace_ring));
+  if (!ring) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&trace->lock);
+  ring->next = trace->rings;
+  trace->rings = ring;
+  pthread_mutex_unlock(&trace->lock);
+
+  thread_ring = ring;
+  thread_ring_trace_id = trace->id;
+  return ring;
+}
+
+void trace_record(struct wfs_trace *trace, int disk, off_t offset, size_t bytes, int op) {
+  struct trace_ring *ring = thread_ring;
+  if (!ring || thread_ring_trace_id != trace->id) {
+    ring = attach_ring(trace);
+    if (!ring) {
+      __atomic_fetch_add(&trace->dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  uint64_t head = ring->head;
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail >= TRACE_RING_SIZE) {
+    //Never block the I/O path: a full ring drops and counts the record
+    __atomic_fetch_add(&trace->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  struct wfs_trace_rec *rec = &ring->recs[head & (TRACE_RING_SIZE - 1)];
+  rec->ts_ns = stats_now_ns() - trace->start_ns;
+  rec->offset = offset;
+  rec->size = bytes;
+  rec->disk = disk;
+  rec->op = op;
+  rec->origin = thread_origin;
+  rec->reserved = 0;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+//Write out everything published so far; the ring storage is contiguous in at most two pieces
+static void drain_rings(struct wfs_trace *trace) {
+  pthread_mutex_lock(&trace->lock);
+  for (struct trace_ring *ring = trace->rings; ring; ring = ring->next) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    while (tail != head) {
+      uint64_t start = tail & (TRACE_RING_SIZE - 1);
+      uint64_t count = head - tail;
+      if (start + count > TRACE_RING_SIZE) {
+        count = TRACE_RING_SIZE - start;
+      }
+      size_t len = count * sizeof(struct wfs_trace_rec);
+      if (write(trace->fd, &ring->recs[start], len) != (ssize_t)len) {
+        perror("Error writing trace records");
+      }
+      tail += count;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&trace->lock);
+}
+
+static void *flusher_thread(void *arg) {
+  struct wfs_trace *trace = arg;
+  while (!__atomic_load_n(&trace->stop, __ATOMIC_ACQUIRE)) {
+    drain_rings(trace);
+    usleep(TRACE_FLUSH_INTERVAL_US);
+  }
+  return NULL;
+}
+
+//Started from the FUSE init callback so the thread survives daemonizing
+int trace_start_flusher(struct wfs_trace *trace) {
+  if (pthread_create(&trace->flusher, NULL, flusher_thread, trace) != 0) {
+    return -1;
+  }
+  trace->flusher_running = 1;
+  return 0;
+}
+
+//Stop the flusher, drain the rings and record the drop count in the header
+void trace_close(struct wfs_trace *trace) {
+  if (!trace) {
+    return;
+  }
+  if (trace->flusher_running) {
+    __atomic_store_n(&trace->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(trace->flusher, NULL);
+  }
+  drain_rings(trace);
+
+  uint64_t dropped = __atomic_load_n(&trace->dropped, __ATOMIC_RELAXED);
+  if (pwrite(trace->fd, &dropped, sizeof(dropped), offsetof(struct wfs_trace_header, dropped)) != sizeof(dropped)) {
+    perror("Error finalizing trace header");
+  }
+  close(trace->fd);
+
+  struct trace_ring *ring = trace->rings;
+  while (ring) {
+    struct trace_ring *next = ring->next;
+    free(ring);
+    ring = next;
+  }
+  pthread_mutex_destroy(&trace->lock);
+  free(trace);
+}
@@ -0,0 +1,62 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+  Block-level I/O trace. Every access to a mapped disk is appended to a
+  per-thread ring buffer without taking a lock; a flusher thread drains
+  the rings into a binary file that wfstrace turns into timelines and
+  heatmaps. The file is a wfs_trace_header followed by wfs_trace_rec
+  entries in drain order (roughly, but not strictly, time ordered).
+*/
+
+#define TRACE_MAGIC "WFSTRACE"
+#define TRACE_VERSION 1
+
+#define TRACE_OP_READ 0
+#define TRACE_OP_WRITE 1
+
+//Records made outside any FUSE callback (mount-time or background work)
+#define TRACE_ORIGIN_INTERNAL 0xff
+
+//Records per thread ring, must be a power of two
+#define TRACE_RING_SIZE 8192
+
+struct wfs_trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_disks;
+  uint32_t block_size;
+  uint32_t raid_mode;
+  uint64_t start_ns;
+  //Region boundaries so the tool can tell metadata from data traffic
+  uint64_t i_bitmap_ptr;
+  uint64_t d_bitmap_ptr;
+  uint64_t i_blocks_ptr;
+  uint64_t d_blocks_ptr;
+  uint64_t dropped; //filled in when the trace is closed
+};
+
+struct wfs_trace_rec {
+  uint64_t ts_ns;   //since start_ns
+  uint64_t offset;  //byte offset within the disk image
+  uint32_t size;    //bytes touched
+  uint8_t disk;
+  uint8_t op;       //TRACE_OP_READ or TRACE_OP_WRITE
+  uint8_t origin;   //enum wfs_op of the callback, or TRACE_ORIGIN_INTERNAL
+  uint8_t reserved;
+};
+
+struct wfs_trace;
+struct wfs_ctx;
+
+struct wfs_trace *trace_open(const struct wfs_ctx *ctx, const char *path);
+int trace_start_flusher(struct wfs_trace *trace);
+void trace_close(struct wfs_trace *trace);
+void trace_record(struct wfs_trace *trace, int disk, off_t offset, size_t bytes, int op);
+void trace_set_origin(int origin);
+
+#endif
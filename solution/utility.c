@@ -1,10 +1,14 @@
-#include "wfs.h"
+#define _GNU_SOURCE
 
+#include "utility.h"
+
+#include <errno.h>
 #include <fcntl.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
@@ -33,7 +37,16 @@ size_t calc_size(size_t num_inodes, size_t num_data_blocks){
     return size;
 }
 
-struct wfs_sb write_superblock(int fd, size_t num_inodes, size_t num_data_blocks, int raid_mode, int disk_index, int num_disks) {
+//Identity shared by the disks of one new filesystem, so a disk of another is told apart at mount
+void generate_fs_uuid(uint8_t *fs_uuid) {
+    if(getrandom(fs_uuid, WFS_UUID_BYTES, 0) != WFS_UUID_BYTES){
+        for(int i = 0; i < WFS_UUID_BYTES; i++){
+            fs_uuid[i] = (uint8_t)(rand() ^ (time(NULL) >> (i % 4 * 8)));
+        }
+    }
+}
+
+struct wfs_sb write_superblock(int fd, size_t num_inodes, size_t num_data_blocks, int raid_mode, int disk_index, int num_disks, int chunk_blocks, int meta_copies, const uint8_t *disk_tiers, const uint8_t *fs_uuid, uint32_t flags) {
     size_t i_bitmap_size = (num_inodes + 7) / 8;
     size_t d_bitmap_size = (num_data_blocks + 7) / 8;
     size_t inodes_size = num_inodes * BLOCK_SIZE;
@@ -49,10 +62,17 @@ struct wfs_sb write_superblock(int fd, size_t num_inodes, size_t num_data_blocks
         .raid_mode = raid_mode,
         .total_disks = num_disks,
         .disk_index = disk_index,
-        .disk_id = disk_id
+        .disk_id = disk_id,
+        .flags = flags,
+        .chunk_blocks = chunk_blocks,
+        .meta_copies = meta_copies,
+        .generation = 1
     };
-    lseek(fd, 0 , SEEK_SET);
-    ssize_t bytes_written = write(fd, &sb, sizeof(struct wfs_sb));
+    if(disk_tiers){
+        memcpy(sb.disk_tiers, disk_tiers, sizeof(sb.disk_tiers));
+    }
+    memcpy(sb.fs_uuid, fs_uuid, WFS_UUID_BYTES);
+    ssize_t bytes_written = pwrite(fd, &sb, sizeof(struct wfs_sb), 0);
 
     if(bytes_written != sizeof(struct wfs_sb)){
         perror("Failed to write superblock");
@@ -61,39 +81,47 @@ struct wfs_sb write_superblock(int fd, size_t num_inodes, size_t num_data_blocks
     return sb;
 }
 
-void write_bitmap(int fd, size_t num_inodes, size_t num_data_blocks, struct wfs_sb *sb) {
+//Zero [offset, offset + length), skipping whatever lies past known_zero_from (fresh, sparse space)
+static int zero_range(int fd, off_t offset, size_t length, off_t known_zero_from) {
+    static const char zeros[64 * 1024];
+    off_t end = offset + length;
+    if (end > known_zero_from) {
+        end = known_zero_from;
+    }
+    while (offset < end) {
+        size_t chunk = end - offset < (off_t)sizeof(zeros) ? end - offset : sizeof(zeros);
+        ssize_t bytes = pwrite(fd, zeros, chunk, offset);
+        if (bytes <= 0) {
+            return -1;
+        }
+        offset += bytes;
+    }
+    return 0;
+}
+
+void write_bitmap(int fd, size_t num_inodes, size_t num_data_blocks, struct wfs_sb *sb, off_t known_zero_from) {
     size_t i_bitmap_size = (num_inodes + 7) / 8;
     size_t d_bitmap_size = (num_data_blocks + 7) / 8;
+    char root_bit = 1;
 
-    char *bitmap = calloc(1, i_bitmap_size);
-    bitmap[0] |= 1;
-
-    lseek(fd, sb->i_bitmap_ptr, SEEK_SET);
-    ssize_t bytes = write(fd, bitmap, i_bitmap_size);
-    if(bytes != (ssize_t)i_bitmap_size){
+    if(zero_range(fd, sb->i_bitmap_ptr, i_bitmap_size, known_zero_from) != 0 ||
+       pwrite(fd, &root_bit, 1, sb->i_bitmap_ptr) != 1){
         perror("Failed to write inode bitmap");
-        free(bitmap);
         exit(EXIT_FAILURE);
     }
-    free(bitmap);
 
-    bitmap = calloc(1, d_bitmap_size);
-    lseek(fd, sb->d_bitmap_ptr, SEEK_SET);
-    bytes = write(fd, bitmap, d_bitmap_size);
-    if(bytes != (ssize_t)d_bitmap_size){
+    //A deferred data bitmap is zeroed by the first mount instead
+    if(!(sb->flags & WFS_SB_DBITMAP_UNINIT) &&
+       zero_range(fd, sb->d_bitmap_ptr, d_bitmap_size, known_zero_from) != 0){
         perror("Failed to write data block bitmap");
-        free(bitmap);
         exit(EXIT_FAILURE);
     }
-    free(bitmap);
-
 }
 
 void write_inode_to_disk(int fd, struct wfs_inode *inode, size_t inode_index, struct wfs_sb *sb) {
   off_t inode_offset = sb->i_blocks_ptr + inode_index * BLOCK_SIZE;
 
-  lseek(fd, inode_offset, SEEK_SET);
-  write(fd, inode, sizeof(struct wfs_inode));
+  pwrite(fd, inode, sizeof(struct wfs_inode), inode_offset);
 }
 
 void write_rootinode(int fd, struct wfs_sb *sb) {
@@ -117,23 +145,66 @@ void write_rootinode(int fd, struct wfs_sb *sb) {
   write_inode_to_disk(fd, &root, 0, sb);
 }
 
+//Bring the image up to required_size, sparse or preallocated
+static int size_image(int fd, off_t required_size, int mkfs_flags) {
+    if(mkfs_flags & MKFS_PREALLOCATE){
+        if(fallocate(fd, 0, 0, required_size) == 0){
+            return 0;
+        }
+        if(errno != EOPNOTSUPP){
+            return -1;
+        }
+    }
+    return ftruncate(fd, required_size);
+}
+
+/*
+  Only the superblock, the inode bitmap and the root inode are always
+  written. Space the image did not have before mkfs ran is known to read
+  back as zero and is never touched. On a reused image everything after
+  the root inode is punched out, which zeroes the old inode table and
+  hands the old data back to the host in one call. Where that is not
+  possible (or -K), the old inode table is left for a background pass
+  after mount (WFS_SB_ITABLE_UNINIT), since nothing reads an inode the
+  bitmap does not mark as allocated.
+*/
 int disk_initialize(const char* disk, size_t num_inodes, size_t num_data_blocks,
-                    size_t required_size, int raid_mode, int disk_index, int num_disks) {
+                    size_t required_size, int raid_mode, int disk_index, int num_disks, int chunk_blocks,
+                    int meta_copies, const uint8_t *disk_tiers, const uint8_t *fs_uuid, int mkfs_flags) {
 
-        int fd = open(disk, O_RDWR, 0644);
+        int open_flags = (mkfs_flags & MKFS_SIZE_IMAGES) ? O_RDWR | O_CREAT : O_RDWR;
+        int fd = open(disk, open_flags, 0644);
         if(fd<0){
             perror("Error opening disk file");
             return -1;
         }
         off_t disk_size = lseek(fd, 0, SEEK_END);
+        off_t old_size = disk_size;
         if( disk_size < required_size ){
-            close(fd);
-            return -1;
+            if(!(mkfs_flags & MKFS_SIZE_IMAGES) || size_image(fd, required_size, mkfs_flags) != 0){
+                close(fd);
+                return -1;
+            }
+        }
+
+        size_t i_bitmap_size = (num_inodes + 7) / 8;
+        uint32_t flags = 0;
+        off_t i_blocks_ptr = BLOCK_ALIGN(sizeof(struct wfs_sb) + i_bitmap_size + (num_data_blocks + 7) / 8);
+        off_t stale_from = i_blocks_ptr + BLOCK_SIZE;
+        if(old_size > stale_from){
+            if(!(mkfs_flags & MKFS_KEEP_STALE) &&
+               fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, stale_from, old_size - stale_from) == 0){
+                old_size = stale_from; //reads as zero from here on, like space the image never had
+            } else {
+                flags |= WFS_SB_ITABLE_UNINIT;
+            }
+        }
+        if((mkfs_flags & MKFS_LAZY_BITMAPS) && old_size > (off_t)(sizeof(struct wfs_sb) + i_bitmap_size)){
+            flags |= WFS_SB_DBITMAP_UNINIT;
         }
 
-        lseek(fd, 0, SEEK_SET);
-        struct wfs_sb sb = write_superblock(fd, num_inodes, num_data_blocks, raid_mode, disk_index, num_disks);
-        write_bitmap(fd, num_inodes, num_data_blocks, &sb);
+        struct wfs_sb sb = write_superblock(fd, num_inodes, num_data_blocks, raid_mode, disk_index, num_disks, chunk_blocks, meta_copies, disk_tiers, fs_uuid, flags);
+        write_bitmap(fd, num_inodes, num_data_blocks, &sb, old_size);
         write_rootinode(fd, &sb);
         
 
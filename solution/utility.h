@@ -4,8 +4,15 @@
 #include "wfs.h"
 #include <stddef.h>
 
+//disk_initialize flags:
+#define MKFS_SIZE_IMAGES  (0x1) //create missing images and grow short ones (sparse)
+#define MKFS_PREALLOCATE  (0x2) //grow with fallocate so the space is reserved up front
+#define MKFS_LAZY_BITMAPS (0x4) //leave a stale data bitmap for the first mount to zero
+#define MKFS_KEEP_STALE   (0x8) //do not punch out a reused image's old inode table and data
+
 size_t calc_size(size_t num_inodes, size_t num_data_blocks);
-int disk_initialize(const char *disk_file, size_t inode_count, size_t data_block_count, size_t required_size,int raid_mode, int disk_index, int total_disks);
+int disk_initialize(const char *disk_file, size_t inode_count, size_t data_block_count, size_t required_size,int raid_mode, int disk_index, int total_disks, int chunk_blocks, int meta_copies, const uint8_t *disk_tiers, const uint8_t *fs_uuid, int mkfs_flags);
+void generate_fs_uuid(uint8_t *fs_uuid);
 int split_path(const char *path, char *parent_path, char *dir_name);
 
 #endif
@@ -1,45 +1,86 @@
 #define FUSE_USE_VERSION 30
 
-#include "wfs.h"
+#include "engine.h"
 #include "fuse_operations.h"
-#include <fcntl.h>
+#include "record.h"
+#include "residency.h"
+#include "stats.h"
+#include "trace.h"
 #include <fuse.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <unistd.h>
 
 
 //Print contenets of superblock
-void print_superblock() {
+void print_superblock(const struct wfs_sb *sb) {
   printf("Superblock Contents:\n");
-  printf("  Total Blocks: %ld\n", sb.num_data_blocks);
-  printf("  Inode Count: %ld\n", sb.num_inodes);
-  printf("  Data Blocks Pointer: %ld\n", sb.d_blocks_ptr);
-  printf("  Inode Blocks Pointer: %ld\n", sb.i_blocks_ptr);
-  printf("  Inode Bitmap Pointer: %ld\n", sb.i_bitmap_ptr);
-  printf("  Data Bitmap Pointer: %ld\n", sb.d_bitmap_ptr);
+  printf("  Total Blocks: %ld\n", sb->num_data_blocks);
+  printf("  Inode Count: %ld\n", sb->num_inodes);
+  printf("  Data Blocks Pointer: %ld\n", sb->d_blocks_ptr);
+  printf("  Inode Blocks Pointer: %ld\n", sb->i_blocks_ptr);
+  printf("  Inode Bitmap Pointer: %ld\n", sb->i_bitmap_ptr);
+  printf("  Data Bitmap Pointer: %ld\n", sb->d_bitmap_ptr);
 }
 
 //Call function if arguments to wfs are incorrect
 static void print_error_usage(const char* name){
-  fprintf(stderr, "Usage:%s disk1 [disk2...] [FUSE options] mount_point\n", name);
+  fprintf(stderr, "Usage:%s disk1 [disk2...] [--trace=file] [--meta=pin|prefault|none] "
+                  "[--data=normal|random|sequential] [--hugepages] [--compress] [--discard] [--parallel-io] [--window=bytes] "
+                  "[--max-windows=n] [--record=file] [FUSE options] mount_point\n", name);
 }
 
-//Storing the mmap in our global variable
-void initialize_wfs_context(void **disk_mmaps, int num_disks, int raid_mode, size_t *disk_sizes) {
-  initialize_raid(disk_mmaps, num_disks, raid_mode, disk_sizes);
+//Options consumed by wfs itself, written as --name=value; everything else goes to FUSE
+struct wfs_options {
+  const char *trace_path;
+  const char *record_path;
+  struct wfs_residency residency;
+  int compress;
+  int discard;
+  int parallel_io;
+  size_t window_bytes;
+  int max_windows;
+};
+
+//Returns 1 if the argument was a wfs option, 0 if it belongs to FUSE, -1 if it is malformed
+static int parse_wfs_option(const char *arg, struct wfs_options *opts) {
+  if (strncmp(arg, "--trace=", strlen("--trace=")) == 0) {
+    opts->trace_path = arg + strlen("--trace=");
+    return 1;
+  }
+  if (strncmp(arg, "--record=", strlen("--record=")) == 0) {
+    opts->record_path = arg + strlen("--record=");
+    return 1;
+  }
+  if (strcmp(arg, "--compress") == 0) {
+    opts->compress = 1;
+    return 1;
+  }
+  if (strcmp(arg, "--discard") == 0) {
+    opts->discard = 1;
+    return 1;
+  }
+  if (strcmp(arg, "--parallel-io") == 0) {
+    opts->parallel_io = 1;
+    return 1;
+  }
+  int parsed = mapping_parse_option(arg, &opts->window_bytes, &opts->max_windows);
+  if (parsed != 0) {
+    return parsed;
+  }
+  return residency_parse_option(arg, &opts->residency);
 }
 
 //Function to parse the input arguments to wfs
 static int parse_args(int argc, char *argv[], char ***disk_paths,
                       int *num_disks, char ***fuse_args, int *fuse_argc,
-                      char **mount_point) {
+                      char **mount_point, struct wfs_options *opts) {
   *num_disks = 0;
   int i = 1;
 
   *disk_paths = NULL;
+  *fuse_args = NULL;
 
   while (i < argc && strncmp(argv[i], "-", 1) != 0 &&
          access(argv[i], F_OK) == 0) {
@@ -69,21 +110,25 @@ static int parse_args(int argc, char *argv[], char ***disk_paths,
     return -1;
   }
 
-  *fuse_args = argv + i;
-  *fuse_argc = argc - i; //re-explain
-
-  return 0;
-}
-
-int load_superblock(void *disk_mmap, struct wfs_sb *sb) {
-  if (!disk_mmap || !sb) {
-    fprintf(stderr, "Invalid arguments to load_superblock.\n");
+  //FUSE expects the program name first, then its own options and the mount point
+  *fuse_args = malloc((argc - i + 1) * sizeof(char *));
+  if (*fuse_args == NULL) {
+    perror("Error allocating memory for FUSE arguments");
     return -1;
   }
+  *fuse_argc = 0;
+  (*fuse_args)[(*fuse_argc)++] = argv[0];
+  for (; i < argc; i++) {
+    int parsed = parse_wfs_option(argv[i], opts);
+    if (parsed < 0) {
+      fprintf(stderr, "Invalid option: %s\n", argv[i]);
+      return -1;
+    }
+    if (!parsed) {
+      (*fuse_args)[(*fuse_argc)++] = argv[i];
+    }
+  }
 
-  memcpy(sb, disk_mmap, sizeof(struct wfs_sb));
-
-  print_superblock();
   return 0;
 }
 
@@ -105,91 +150,70 @@ int main(int argc, char *argv[]) {
   char *mount_point;
   char **fuse_args;
   int fuse_argc;
+  struct wfs_options opts = {.residency = WFS_RESIDENCY_DEFAULT};
 
   if (parse_args(argc, argv, &disk_paths, &num_disks, &fuse_args, &fuse_argc,
-                 &mount_point) != 0) {
+                 &mount_point, &opts) != 0) {
     print_error_usage(argv[0]);
     free(disk_paths);
+    free(fuse_args);
     return EXIT_FAILURE;
   } //Re-explain
 
-  void **disk_mmaps = malloc(num_disks * sizeof(void *));
-  size_t *disk_sizes = malloc(num_disks * sizeof(size_t));
-  if (!disk_mmaps || !disk_sizes) {
-    perror("Error allocating memory for disk mappings or sizes");
+  struct wfs_ctx ctx;
+  if (wfs_ctx_open_windowed(&ctx, disk_paths, num_disks, opts.window_bytes, opts.max_windows) != 0) {
+    fprintf(
+        stderr,
+        "Error reading superblock. Ensure disks are initialized using mkfs.\n");
     free(disk_paths);
-    free(disk_mmaps);
-    free(disk_sizes);
+    free(fuse_args);
     return EXIT_FAILURE;
   }
-
-  // Open and map each disk
-  int success = 1;
-  for (int i = 0; i < num_disks; i++) {
-    int fd = open(disk_paths[i], O_RDWR);
-    if (fd < 0) {
-      perror("Error opening disk file");
-      success = 0;
-      break;
-    }
-
-    struct stat st;
-    if (fstat(fd, &st) < 0) {
-      perror("Error getting disk size");
-      close(fd);
-      success = 0;
-      break;
-    }
-
-    struct wfs_sb *wfs_sb_dummy = mmap(NULL, sizeof(struct wfs_sb), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    int disk_index = wfs_sb_dummy->disk_index;
-
-    disk_sizes[disk_index] = st.st_size;
-    disk_mmaps[disk_index] = mmap(NULL, disk_sizes[disk_index], PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (disk_mmaps[disk_index] == MAP_FAILED) {
-      perror("Error mapping disk file");
-      close(fd);
-      success = 0;
-      break;
-    }
-
-    close(fd);
-  }
-
-  if (!success) {
-    for (int i = 0; i < num_disks; i++) {
-      if (disk_mmaps[i]) {
-        munmap(disk_mmaps[i], disk_sizes[i]);
-      }
+  print_superblock(&ctx.sb);
+  ctx.residency = opts.residency;
+  ctx.compress_new_files = opts.compress;
+  ctx.discard.enabled = opts.discard;
+  ctx.pio.enabled = opts.parallel_io;
+
+  if (opts.trace_path) {
+    ctx.trace = trace_open(&ctx, opts.trace_path);
+    if (!ctx.trace) {
+      wfs_ctx_close(&ctx);
+      free(disk_paths);
+      free(fuse_args);
+      return EXIT_FAILURE;
     }
-    free(disk_mmaps);
-    free(disk_sizes);
-    free(disk_paths);
-    return EXIT_FAILURE;
   }
-
-  if (load_superblock(disk_mmaps[0], &sb) != 0) {
-    fprintf(
-        stderr,
-        "Error reading superblock. Ensure disks are initialized using mkfs.\n");
-    for (int i = 0; i < num_disks; i++) {
-      munmap(disk_mmaps[i], disk_sizes[i]);
+  if (opts.record_path) {
+    ctx.recorder = record_open(&ctx, opts.record_path);
+    if (!ctx.recorder) {
+      trace_close(ctx.trace);
+      wfs_ctx_close(&ctx);
+      free(disk_paths);
+      free(fuse_args);
+      return EXIT_FAILURE;
     }
-    free(disk_mmaps);
-    free(disk_sizes);
-    free(disk_paths);
-    return EXIT_FAILURE;
   }
 
   printf(
       "Loaded superblock: RAID mode = %d, num_inodes = %ld, num_blocks = %ld\n",
-      sb.raid_mode, sb.num_inodes, sb.num_data_blocks);
+      ctx.sb.raid_mode, ctx.sb.num_inodes, ctx.sb.num_data_blocks);
 
-  initialize_wfs_context(disk_mmaps, num_disks, sb.raid_mode, disk_sizes);
   printf("Starting FUSE with mount point: %s\n", mount_point);
 
   print_arguments(fuse_argc, fuse_args);
-  int ret = fuse_main(fuse_argc, fuse_args, &ops, NULL);
-
+  if (stats_block_dump_signal() != 0) {
+    fprintf(stderr, "Could not block SIGUSR1 for the stats dump thread\n");
+  }
+  int ret = fuse_main(fuse_argc, fuse_args, &ops, &ctx);
+
+  struct wfs_trace *trace = ctx.trace;
+  ctx.trace = NULL;
+  trace_close(trace);
+  record_close(ctx.recorder);
+  ctx.recorder = NULL;
+  wfs_ctx_close(&ctx);
+  free(disk_paths);
+  free(fuse_args);
   return ret;
 }
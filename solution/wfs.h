@@ -2,6 +2,7 @@
 #define WFS_H
 
 #include <stdint.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <time.h>
 
@@ -19,6 +20,9 @@
 
 #define PATH_MAX 4096
 
+#define WFS_INTENT_BYTES (32) //write-intent bitmap: one bit per region, 256 regions
+#define WFS_UUID_BYTES (16)
+
 /*
   The fields in the superblock should reflect the structure of the filesystem.
   `mkfs` writes the superblock to offset 0 of the disk image. 
@@ -47,8 +51,25 @@ struct wfs_sb {
     int disk_index;
     int total_disks;
     uint64_t disk_id;
+    uint32_t flags;   /* WFS_SB_* regions mkfs left for the first mount to initialise */
+    uint32_t chunk_blocks; /* RAID 0 stripe unit in blocks; 0 (older images) means 1 */
+    uint8_t write_intent[WFS_INTENT_BYTES]; /* regions that may differ between the copies */
+    uint32_t meta_copies;  /* RAID 0 disks holding each inode and the inode bitmap; 0 means every disk */
+    uint8_t disk_tiers[MAX_DISKS]; /* WFS_TIER_* of each disk, by disk index */
+    uint32_t grow_from_disks; /* RAID 0 disk count a grow is rebalancing away from; 0 when none */
+    uint64_t grow_cursor;     /* block ids below this already sit in the layout over total_disks */
+    uint8_t fs_uuid[WFS_UUID_BYTES]; /* shared by every disk of one filesystem, set by mkfs */
+    uint64_t generation;      /* bumped on every disk with each write-intent update and clean unmount */
 };
 
+// Superblock flags
+#define WFS_SB_ITABLE_UNINIT  (0x1) /* unallocated inode blocks may hold stale data */
+#define WFS_SB_DBITMAP_UNINIT (0x2) /* data bitmap must be zeroed before use */
+
+// Disk performance classes (wfs_sb.disk_tiers)
+#define WFS_TIER_CAPACITY (0) /* the default: bulk file data */
+#define WFS_TIER_FAST     (1) /* metadata, directories and small or hot files */
+
 // Inode
 struct wfs_inode {
     int     num;      /* Inode number */
@@ -63,12 +84,50 @@ struct wfs_inode {
     time_t ctim;      /* Time of last status change */
 
     off_t blocks[N_BLOCKS]; 
+    uint32_t flags;   /* WFS_INODE_* */
 };
 
+// Inode flags
+#define WFS_INODE_COMPRESSED (0x1) /* data is stored in compressed clusters */
+
+/*
+  A compressed file keeps its data in clusters of WFS_CLUSTER_BLOCKS file
+  blocks. A cluster that compresses into fewer blocks stores the LZ4
+  block, after a uint16_t length, in its first few block slots, tagged
+  with WFS_BLOCK_COMPRESSED; the slots it does not need are -1. Other
+  clusters are stored as plain blocks.
+*/
+#define WFS_CLUSTER_BLOCKS (4)
+#define WFS_BLOCK_COMPRESSED (1LL << 62)
+#define WFS_BLOCK_ID(ptr) ((ptr) & ~WFS_BLOCK_COMPRESSED) /* for pointers other than -1 */
+
 // Directory entry
 struct wfs_dentry {
     char name[MAX_NAME];
     int num;
 };
 
+// In-filesystem copy, issued on the destination file. FUSE 2 has no
+// copy_file_range callback, so it travels as an ioctl; src_path is the
+// source's path from the root of the filesystem.
+struct wfs_copy_range {
+    char src_path[PATH_MAX];
+    int64_t off_in;
+    int64_t off_out;
+    uint64_t len;
+};
+
+#define WFS_IOC_COPY_RANGE _IOW('W', 1, struct wfs_copy_range)
+// Turn compression of one file on (1) or off (0); its data is rewritten in the new form
+#define WFS_IOC_SET_COMPRESSION _IOW('W', 2, int)
+
+// Add a formatted image to a mounted RAID 0 filesystem and rebalance onto it
+// (see grow.h). path must be absolute; tier is a WFS_TIER_* value.
+struct wfs_add_disk {
+    char path[PATH_MAX];
+    int32_t tier;
+};
+
+#define WFS_IOC_ADD_DISK _IOW('W', 3, struct wfs_add_disk)
+
 #endif
@@ -0,0 +1,937 @@
+#include "engine.h"
+#include "parity.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+  Offline consistency checker. Works directly on the mapped images and
+  splits the inode table and the data region across threads:
+
+    1. mirrors     copies of mirrored regions agree (majority wins for 1v,
+                   the first copy otherwise, matching what the engine reads; the
+                   even disk of each RAID 10 pair)
+    2. inodes      allocated inodes are sane, block pointers in range
+    3. directories entries are well formed and name live inodes
+    4. tree        reachability from the root (single threaded, in memory)
+    5. references  blocks owned by reachable inodes; orphans found
+    6. bitmaps     data bitmaps match the blocks actually referenced
+    7. parity      RAID 5 parity blocks are the XOR of their rows
+
+  With -r every problem that has an unambiguous fix is repaired in place.
+  Exit status follows fsck: 0 clean, 1 errors fixed, 4 errors left, 8 failure.
+*/
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define EXIT_CLEAN 0
+#define EXIT_FIXED 1
+#define EXIT_UNCORRECTED 4
+#define EXIT_OPERATIONAL 8
+
+//Problems of one kind printed before the rest are only counted, unless -v
+#define MAX_REPORTS 100
+
+#define DENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(struct wfs_dentry))
+#define INDIRECT_ENTRIES (BLOCK_SIZE / sizeof(off_t))
+
+enum problem {
+  P_SUPERBLOCK,
+  P_MIRROR,
+  P_INODE,
+  P_DIRENT,
+  P_TREE,
+  P_BITMAP,
+  P_CROSSLINK,
+  P_PARITY,
+  P_COUNT
+};
+
+static const char *problem_names[P_COUNT] = {
+  [P_SUPERBLOCK] = "superblock",
+  [P_MIRROR]     = "mirror",
+  [P_INODE]      = "inode",
+  [P_DIRENT]     = "dirent",
+  [P_TREE]       = "tree",
+  [P_BITMAP]     = "bitmap",
+  [P_CROSSLINK]  = "crosslink",
+  [P_PARITY]     = "parity",
+};
+
+struct edge {
+  int parent;
+  int child;
+};
+
+struct edge_list {
+  struct edge *edges;
+  size_t len;
+  size_t cap;
+};
+
+struct fsck {
+  struct wfs_ctx ctx;
+  int repair;
+  int verbose;
+  int threads;
+  uint8_t *valid;       //per inode: allocated and sane
+  uint8_t *reachable;   //per inode: linked from the root
+  uint8_t *block_seen;  //bit per (disk, local block): referenced at least once
+  uint8_t *block_multi; //bit per (disk, local block): referenced more than once
+  struct edge_list *edges; //directory entries found by each thread
+  uint64_t found[P_COUNT];
+  uint64_t fixed;
+  int edge_alloc_failed;
+};
+
+static void print_usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-r] [-v] [-j threads] disk1 [disk2...]\n", name);
+}
+
+static void report(struct fsck *f, enum problem kind, int fixed, const char *fmt, ...) {
+  uint64_t count = __atomic_add_fetch(&f->found[kind], 1, __ATOMIC_RELAXED);
+  if (fixed) {
+    __atomic_add_fetch(&f->fixed, 1, __ATOMIC_RELAXED);
+  }
+  if (!f->verbose && count > MAX_REPORTS) {
+    return;
+  }
+
+  char message[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(message, sizeof(message), fmt, args);
+  va_end(args);
+  printf("%s: %s%s\n", problem_names[kind], message, fixed ? " (fixed)" : "");
+}
+
+//Helpers over the mapped images:
+
+static int test_bit(const uint8_t *bitmap, size_t i) {
+  return bitmap[i / 8] & (1 << (i % 8));
+}
+
+static void set_bit(uint8_t *bitmap, size_t i, int value) {
+  if (value) {
+    bitmap[i / 8] |= 1 << (i % 8);
+  } else {
+    bitmap[i / 8] &= ~(1 << (i % 8));
+  }
+}
+
+//The first copy of the inode bitmap and of each inode is the one checked and repaired
+static uint8_t *inode_bitmap(struct fsck *f) {
+  off_t offset = INODE_BITMAP_OFFSET(&f->ctx);
+  return (uint8_t *)DISK_PTR(&f->ctx, meta_copy_disk(&f->ctx, offset, 0), offset);
+}
+
+static uint8_t *data_bitmap(struct fsck *f, int disk) {
+  return (uint8_t *)DISK_PTR(&f->ctx, disk, DATA_BITMAP_OFFSET(&f->ctx));
+}
+
+static struct wfs_inode *inode_at(struct fsck *f, size_t i) {
+  off_t offset = INODE_OFFSET(&f->ctx, i);
+  return (struct wfs_inode *)DISK_PTR(&f->ctx, meta_copy_disk(&f->ctx, offset, 0), offset);
+}
+
+//In the data region and an id the allocator hands out: not a parity slot (RAID 5) or a pair's second copy (RAID 10)
+static int block_in_range(struct fsck *f, off_t block) {
+  struct wfs_ctx *ctx = &f->ctx;
+  if (block < 0 || block >= num_block_ids(ctx)) {
+    return 0;
+  }
+  int disk;
+  off_t local = ctx->layout->map(ctx, &disk, block);
+  return !ctx->layout->allocates || ctx->layout->allocates(ctx, block, disk, local);
+}
+
+//Primary copy of a data block: its disk under RAID 0, disk 0 when mirrored
+static char *block_at(struct fsck *f, off_t block, int *disk, size_t *local) {
+  *local = calculate_raid_disk(&f->ctx, disk, block);
+  return DISK_PTR(&f->ctx, *disk, DATA_BLOCK_OFFSET(&f->ctx, *local));
+}
+
+//After a repair on the first copy, bring the other copies in line
+static void sync_metadata(struct fsck *f, const void *data, off_t offset, size_t size) {
+  write_metadata(&f->ctx, data, offset, size);
+}
+
+static void sync_data(struct fsck *f, const void *data, off_t offset, size_t size, int disk) {
+  f->ctx.layout->replicate(&f->ctx, data, offset, size, disk);
+}
+
+static void mark_block(struct fsck *f, off_t block) {
+  int disk;
+  size_t local = calculate_raid_disk(&f->ctx, &disk, block);
+  size_t slot = disk * f->ctx.sb.num_data_blocks + local;
+  uint8_t bit = 1 << (slot % 8);
+  if (__atomic_fetch_or(&f->block_seen[slot / 8], bit, __ATOMIC_RELAXED) & bit) {
+    __atomic_fetch_or(&f->block_multi[slot / 8], bit, __ATOMIC_RELAXED);
+  }
+}
+
+//Every block pointer of an inode, including the indirect block itself
+typedef void (*block_fn)(struct fsck *f, size_t inode_num, off_t *pointer, int disk, off_t pointer_offset);
+
+static void for_each_block(struct fsck *f, size_t inode_num, block_fn fn) {
+  struct wfs_inode *inode = inode_at(f, inode_num);
+  for (int i = 0; i < N_BLOCKS; i++) {
+    if (inode->blocks[i] == -1) {
+      continue;
+    }
+    off_t pointer_offset = INODE_OFFSET(&f->ctx, inode_num) + offsetof(struct wfs_inode, blocks[i]);
+    fn(f, inode_num, &inode->blocks[i], meta_copy_disk(&f->ctx, pointer_offset, 0), pointer_offset);
+    if (i != N_BLOCKS - 1 || !S_ISREG(inode->mode) || !block_in_range(f, inode->blocks[i])) {
+      continue;
+    }
+
+    int disk;
+    size_t local;
+    off_t *indirect = (off_t *)block_at(f, inode->blocks[i], &disk, &local);
+    for (size_t j = 0; j < INDIRECT_ENTRIES; j++) {
+      if (indirect[j] != -1) {
+        fn(f, inode_num, &indirect[j], disk, DATA_BLOCK_OFFSET(&f->ctx, local) + j * sizeof(off_t));
+      }
+    }
+  }
+}
+
+//Parallel driver: [0, total) split into contiguous ranges, multiples of 8 so
+//threads never share a bitmap byte
+typedef void (*range_fn)(struct fsck *f, int thread, size_t start, size_t end);
+
+struct range_job {
+  struct fsck *f;
+  range_fn fn;
+  int thread;
+  size_t start;
+  size_t end;
+};
+
+static void *range_thread(void *arg) {
+  struct range_job *job = arg;
+  job->fn(job->f, job->thread, job->start, job->end);
+  return NULL;
+}
+
+static void run_parallel(struct fsck *f, size_t total, range_fn fn) {
+  int n = f->threads;
+  size_t chunk = ((total + n - 1) / n + 7) & ~(size_t)7;
+  struct range_job jobs[n];
+  pthread_t threads[n];
+  int started[n];
+
+  for (int i = 0; i < n; i++) {
+    size_t start = MIN(i * chunk, total);
+    jobs[i] = (struct range_job){f, fn, i, start, MIN(start + chunk, total)};
+    started[i] = 0;
+    if (jobs[i].start < jobs[i].end) {
+      started[i] = pthread_create(&threads[i], NULL, range_thread, &jobs[i]) == 0;
+      if (!started[i]) {
+        range_thread(&jobs[i]);
+      }
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+}
+
+//Phase 1: mirror agreement
+
+//Which disk's copy of [offset, offset + size) the others should match, or -1 if all agree.
+//The copies are on the disks meta_copy_disk names, which is every disk in order
+//except for the metadata of a RAID 0 formatted with fewer copies.
+static int pick_good_copy(struct fsck *f, off_t offset, size_t size) {
+  struct wfs_ctx *ctx = &f->ctx;
+  int first = meta_copy_disk(ctx, offset, 0);
+  int differs = 0;
+  for (int copy = 1; copy < ctx->meta_copies && !differs; copy++) {
+    int disk = meta_copy_disk(ctx, offset, copy);
+    differs = memcmp(DISK_PTR(ctx, first, offset), DISK_PTR(ctx, disk, offset), size) != 0;
+  }
+  if (!differs) {
+    return -1;
+  }
+  if (ctx->sb.raid_mode != RAID_2) {
+    return first;
+  }
+
+  int best = 0;
+  int best_votes = 0;
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    int votes = 0;
+    for (int other = 0; other < ctx->num_disks; other++) {
+      votes += memcmp(DISK_PTR(ctx, disk, offset), DISK_PTR(ctx, other, offset), size) == 0;
+    }
+    if (votes > best_votes) {
+      best = disk;
+      best_votes = votes;
+    }
+  }
+  return best;
+}
+
+static void check_mirror_range(struct fsck *f, const char *what, size_t index, off_t offset, size_t size) {
+  int good = pick_good_copy(f, offset, size);
+  if (good < 0) {
+    return;
+  }
+  if (f->repair) {
+    write_metadata(&f->ctx, DISK_PTR(&f->ctx, good, offset), offset, size);
+  }
+  report(f, P_MIRROR, f->repair, "%s %zu differs between disks (disk %d taken as correct)", what, index, good);
+}
+
+static void mirror_inodes(struct fsck *f, int thread, size_t start, size_t end) {
+  (void)thread;
+  const uint8_t *bitmap = inode_bitmap(f);
+  for (size_t i = start; i < end; i++) {
+    if (test_bit(bitmap, i)) {
+      check_mirror_range(f, "inode", i, INODE_OFFSET(&f->ctx, i), sizeof(struct wfs_inode));
+    }
+  }
+}
+
+static void mirror_data(struct fsck *f, int thread, size_t start, size_t end) {
+  (void)thread;
+  struct wfs_ctx *ctx = &f->ctx;
+  check_mirror_range(f, "data bitmap byte range at block", start, DATA_BITMAP_OFFSET(ctx) + start / 8,
+                     (end + 7) / 8 - start / 8);
+  const uint8_t *bitmap = data_bitmap(f, 0);
+  for (size_t b = start; b < end; b++) {
+    if (test_bit(bitmap, b)) {
+      check_mirror_range(f, "data block", b, DATA_BLOCK_OFFSET(ctx, b), BLOCK_SIZE);
+    }
+  }
+}
+
+//RAID 10: the odd disk of each pair should hold a copy of the even one
+static void check_pair_range(struct fsck *f, int disk, const char *what, size_t index, off_t offset, size_t size) {
+  int partner = RAID10_PARTNER(disk);
+  if (memcmp(DISK_PTR(&f->ctx, disk, offset), DISK_PTR(&f->ctx, partner, offset), size) == 0) {
+    return;
+  }
+  if (f->repair) {
+    memcpy(DISK_PTR(&f->ctx, partner, offset), DISK_PTR(&f->ctx, disk, offset), size);
+  }
+  report(f, P_MIRROR, f->repair, "%s %zu differs between disks %d and %d (disk %d taken as correct)", what, index,
+         disk, partner, disk);
+}
+
+static void mirror_pairs(struct fsck *f, int thread, size_t start, size_t end) {
+  (void)thread;
+  struct wfs_ctx *ctx = &f->ctx;
+  for (int disk = 0; disk < ctx->num_disks; disk += 2) {
+    check_pair_range(f, disk, "data bitmap byte range at block", start, DATA_BITMAP_OFFSET(ctx) + start / 8,
+                     (end + 7) / 8 - start / 8);
+    const uint8_t *bitmap = data_bitmap(f, disk);
+    for (size_t b = start; b < end; b++) {
+      if (test_bit(bitmap, b)) {
+        check_pair_range(f, disk, "data block", b, DATA_BLOCK_OFFSET(ctx, b), BLOCK_SIZE);
+      }
+    }
+  }
+}
+
+static void check_mirrors(struct fsck *f) {
+  struct wfs_ctx *ctx = &f->ctx;
+  if (ctx->num_disks < 2) {
+    return;
+  }
+  //Inode bitmap and table are mirrored in every mode (on meta_copies disks); data when IS_MIRRORED or within RAID 10 pairs
+  check_mirror_range(f, "inode bitmap", 0, INODE_BITMAP_OFFSET(ctx), (ctx->sb.num_inodes + 7) / 8);
+  run_parallel(f, ctx->sb.num_inodes, mirror_inodes);
+  if (IS_MIRRORED(ctx) && !(ctx->sb.flags & WFS_SB_DBITMAP_UNINIT)) {
+    run_parallel(f, ctx->sb.num_data_blocks, mirror_data);
+  }
+  if (ctx->sb.raid_mode == RAID_10 && !(ctx->sb.flags & WFS_SB_DBITMAP_UNINIT)) {
+    run_parallel(f, ctx->sb.num_data_blocks, mirror_pairs);
+  }
+}
+
+//Phase 2: inodes
+
+static void check_pointer(struct fsck *f, size_t inode_num, off_t *pointer, int disk, off_t pointer_offset) {
+  if (block_in_range(f, WFS_BLOCK_ID(*pointer))) {
+    return;
+  }
+  off_t bad = *pointer;
+  if (f->repair) {
+    *pointer = -1;
+    if (pointer_offset < f->ctx.sb.d_blocks_ptr) {
+      sync_metadata(f, pointer, pointer_offset, sizeof(off_t));
+    } else {
+      sync_data(f, pointer, pointer_offset, sizeof(off_t), disk);
+    }
+  }
+  report(f, P_INODE, f->repair, "inode %zu: block pointer %ld out of range", inode_num, bad);
+}
+
+static void check_inodes(struct fsck *f, int thread, size_t start, size_t end) {
+  (void)thread;
+  struct wfs_ctx *ctx = &f->ctx;
+  uint8_t *bitmap = inode_bitmap(f);
+  for (size_t i = start; i < end; i++) {
+    if (!test_bit(bitmap, i)) {
+      continue;
+    }
+    struct wfs_inode *inode = inode_at(f, i);
+    if (!S_ISDIR(inode->mode) && !S_ISREG(inode->mode)) {
+      if (f->repair && i != 0) {
+        set_bit(bitmap, i, 0);
+        sync_metadata(f, bitmap + i / 8, INODE_BITMAP_OFFSET(ctx) + i / 8, 1);
+      }
+      report(f, P_INODE, f->repair && i != 0, "inode %zu: allocated with invalid mode %o", i, inode->mode);
+      continue;
+    }
+    if (inode->num != (int)i) {
+      int bad = inode->num;
+      if (f->repair) {
+        inode->num = i;
+        sync_metadata(f, &inode->num, INODE_OFFSET(ctx, i) + offsetof(struct wfs_inode, num), sizeof(inode->num));
+      }
+      report(f, P_INODE, f->repair, "inode %zu: number field is %d", i, bad);
+    }
+    for_each_block(f, i, check_pointer);
+    f->valid[i] = 1;
+  }
+}
+
+//Phase 3: directories
+
+static int name_ok(const struct wfs_dentry *entry) {
+  size_t len = strnlen(entry->name, MAX_NAME);
+  return len > 0 && len < MAX_NAME && !memchr(entry->name, '/', len) &&
+         strcmp(entry->name, ".") != 0 && strcmp(entry->name, "..") != 0;
+}
+
+static void add_edge(struct fsck *f, int thread, int parent, int child) {
+  struct edge_list *list = &f->edges[thread];
+  if (list->len == list->cap) {
+    size_t cap = list->cap ? list->cap * 2 : 1024;
+    struct edge *edges = realloc(list->edges, cap * sizeof(struct edge));
+    if (!edges) {
+      f->edge_alloc_failed = 1;
+      return;
+    }
+    list->edges = edges;
+    list->cap = cap;
+  }
+  list->edges[list->len++] = (struct edge){parent, child};
+}
+
+static int duplicate_name(struct fsck *f, const struct wfs_inode *dir, int upto_block, size_t upto_entry) {
+  size_t local;
+  int disk;
+  const struct wfs_dentry *target = (struct wfs_dentry *)block_at(f, dir->blocks[upto_block], &disk, &local) + upto_entry;
+  for (int i = 0; i <= upto_block; i++) {
+    if (!block_in_range(f, dir->blocks[i])) {
+      continue;
+    }
+    const struct wfs_dentry *entries = (struct wfs_dentry *)block_at(f, dir->blocks[i], &disk, &local);
+    size_t limit = i == upto_block ? upto_entry : DENTRIES_PER_BLOCK;
+    for (size_t j = 0; j < limit; j++) {
+      if (entries[j].num != -1 && strncmp(entries[j].name, target->name, MAX_NAME) == 0) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static void check_directories(struct fsck *f, int thread, size_t start, size_t end) {
+  struct wfs_ctx *ctx = &f->ctx;
+  for (size_t i = start; i < end; i++) {
+    struct wfs_inode *dir = inode_at(f, i);
+    if (!f->valid[i] || !S_ISDIR(dir->mode)) {
+      continue;
+    }
+    for (int b = 0; b < N_BLOCKS; b++) {
+      if (!block_in_range(f, dir->blocks[b])) {
+        continue;
+      }
+      int disk;
+      size_t local;
+      struct wfs_dentry *entries = (struct wfs_dentry *)block_at(f, dir->blocks[b], &disk, &local);
+      for (size_t e = 0; e < DENTRIES_PER_BLOCK; e++) {
+        struct wfs_dentry *entry = &entries[e];
+        if (entry->num == -1) {
+          continue;
+        }
+
+        const char *problem = NULL;
+        if (!name_ok(entry)) {
+          problem = "malformed name";
+        } else if (entry->num < 0 || (size_t)entry->num >= ctx->sb.num_inodes || !f->valid[entry->num]) {
+          problem = "names a free or invalid inode";
+        } else if (duplicate_name(f, dir, b, e)) {
+          problem = "duplicate name";
+        }
+        if (!problem) {
+          add_edge(f, thread, i, entry->num);
+          continue;
+        }
+
+        int target = entry->num;
+        if (f->repair) {
+          entry->num = -1;
+          sync_data(f, &entry->num, DATA_BLOCK_OFFSET(ctx, local) + e * sizeof(struct wfs_dentry) +
+                                        offsetof(struct wfs_dentry, num), sizeof(entry->num), disk);
+        }
+        report(f, P_DIRENT, f->repair, "directory inode %zu: entry \"%.*s\" -> %d %s", i,
+               MAX_NAME, entry->name, target, problem);
+      }
+    }
+  }
+}
+
+//Phase 4: reachability from the root, over the entries gathered above
+
+static int check_tree(struct fsck *f) {
+  struct wfs_ctx *ctx = &f->ctx;
+  size_t num_inodes = ctx->sb.num_inodes;
+  size_t total = 0;
+  for (int t = 0; t < f->threads; t++) {
+    total += f->edges[t].len;
+  }
+
+  //Compressed adjacency: children of inode p are child[first[p] .. first[p + 1])
+  size_t *first = calloc(num_inodes + 1, sizeof(size_t));
+  int *child = malloc((total ? total : 1) * sizeof(int));
+  int *queue = malloc(num_inodes * sizeof(int));
+  uint32_t *parents = calloc(num_inodes, sizeof(uint32_t));
+  if (!first || !child || !queue || !parents) {
+    free(first);
+    free(child);
+    free(queue);
+    free(parents);
+    return -1;
+  }
+  for (int t = 0; t < f->threads; t++) {
+    for (size_t k = 0; k < f->edges[t].len; k++) {
+      first[f->edges[t].edges[k].parent + 1]++;
+    }
+  }
+  for (size_t i = 0; i < num_inodes; i++) {
+    first[i + 1] += first[i];
+  }
+  size_t *fill = calloc(num_inodes, sizeof(size_t));
+  if (!fill) {
+    free(first);
+    free(child);
+    free(queue);
+    free(parents);
+    return -1;
+  }
+  for (int t = 0; t < f->threads; t++) {
+    for (size_t k = 0; k < f->edges[t].len; k++) {
+      struct edge *edge = &f->edges[t].edges[k];
+      child[first[edge->parent] + fill[edge->parent]++] = edge->child;
+      parents[edge->child]++;
+    }
+  }
+  free(fill);
+
+  size_t head = 0, tail = 0;
+  queue[tail++] = 0;
+  f->reachable[0] = 1;
+  while (head < tail) {
+    int dir = queue[head++];
+    for (size_t k = first[dir]; k < first[dir + 1]; k++) {
+      int target = child[k];
+      if (!f->reachable[target]) {
+        f->reachable[target] = 1;
+        queue[tail++] = target;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < num_inodes; i++) {
+    if (f->valid[i] && S_ISDIR(inode_at(f, i)->mode) && parents[i] > (i == 0 ? 0 : 1)) {
+      report(f, P_TREE, 0, "directory inode %zu has %u parent entries", i, parents[i]);
+    }
+  }
+
+  free(first);
+  free(child);
+  free(queue);
+  free(parents);
+  return 0;
+}
+
+//Phase 5: block references and orphans
+
+static void mark_pointer(struct fsck *f, size_t inode_num, off_t *pointer, int disk, off_t pointer_offset) {
+  (void)inode_num;
+  (void)disk;
+  (void)pointer_offset;
+  if (block_in_range(f, WFS_BLOCK_ID(*pointer))) {
+    mark_block(f, WFS_BLOCK_ID(*pointer));
+  }
+}
+
+static void check_references(struct fsck *f, int thread, size_t start, size_t end) {
+  (void)thread;
+  struct wfs_ctx *ctx = &f->ctx;
+  uint8_t *bitmap = inode_bitmap(f);
+  for (size_t i = start; i < end; i++) {
+    if (!f->valid[i]) {
+      continue;
+    }
+    if (f->reachable[i]) {
+      for_each_block(f, i, mark_pointer);
+      continue;
+    }
+    //Not marking an orphan's blocks lets the bitmap phase free them too
+    if (f->repair) {
+      set_bit(bitmap, i, 0);
+      sync_metadata(f, bitmap + i / 8, INODE_BITMAP_OFFSET(ctx) + i / 8, 1);
+    }
+    report(f, P_TREE, f->repair, "inode %zu is allocated but not reachable from the root", i);
+  }
+}
+
+//Phase 6: data bitmaps against references
+
+static void check_bitmaps(struct fsck *f, int thread, size_t start, size_t end) {
+  (void)thread;
+  struct wfs_ctx *ctx = &f->ctx;
+  int disks = IS_MIRRORED(ctx) ? 1 : ctx->num_disks;
+  //RAID 10 allocates from the even disk of each pair; the odd one was compared in phase 1
+  int step = ctx->sb.raid_mode == RAID_10 ? 2 : 1;
+  for (int disk = 0; disk < disks; disk += step) {
+    uint8_t *bitmap = data_bitmap(f, disk);
+    for (size_t b = start; b < end; b++) {
+      if (ctx->sb.raid_mode == RAID_5 && disk == raid5_parity_disk(ctx, b)) {
+        continue;
+      }
+      size_t slot = disk * ctx->sb.num_data_blocks + b;
+      int used = !!test_bit(f->block_seen, slot);
+      if (test_bit(f->block_multi, slot)) {
+        report(f, P_CROSSLINK, 0, "disk %d block %zu is referenced more than once", disk, b);
+      }
+      if (used == !!test_bit(bitmap, b)) {
+        continue;
+      }
+      if (f->repair) {
+        set_bit(bitmap, b, used);
+      }
+      report(f, P_BITMAP, f->repair, used ? "disk %d block %zu is in use but marked free"
+                                           : "disk %d block %zu is marked used but unreferenced", disk, b);
+    }
+    if (f->repair && start < end) {
+      size_t first_byte = start / 8;
+      sync_data(f, bitmap + first_byte, DATA_BITMAP_OFFSET(ctx) + first_byte, (end + 7) / 8 - first_byte, disk);
+    }
+  }
+}
+
+//Phase 7: RAID 5 parity. Repairs above rewrite data in place, so this runs last
+//and rewrites any parity block that no longer matches its row.
+
+static void check_parity(struct fsck *f, int thread, size_t start, size_t end) {
+  (void)thread;
+  struct wfs_ctx *ctx = &f->ctx;
+  for (size_t row = start; row < end; row++) {
+    int parity_disk = raid5_parity_disk(ctx, row);
+    int in_use = 0;
+    for (int disk = 0; disk < ctx->num_disks && !in_use; disk++) {
+      in_use = disk != parity_disk && test_bit(data_bitmap(f, disk), row);
+    }
+    //The engine recomputes a row's parity when its first block is allocated
+    if (!in_use) {
+      continue;
+    }
+
+    char expected[BLOCK_SIZE] = {0};
+    off_t offset = DATA_BLOCK_OFFSET(ctx, row);
+    for (int disk = 0; disk < ctx->num_disks; disk++) {
+      if (disk != parity_disk) {
+        parity_xor(expected, DISK_PTR(ctx, disk, offset), BLOCK_SIZE);
+      }
+    }
+    char *parity = DISK_PTR(ctx, parity_disk, offset);
+    if (memcmp(expected, parity, BLOCK_SIZE) == 0) {
+      continue;
+    }
+    if (f->repair) {
+      memcpy(parity, expected, BLOCK_SIZE);
+    }
+    report(f, P_PARITY, f->repair, "row %zu: parity on disk %d does not match the data", row, parity_disk);
+  }
+}
+
+//Setup:
+
+static int open_images(struct fsck *f, char **paths, int num_disks) {
+  struct wfs_ctx *ctx = &f->ctx;
+  ctx->num_disks = num_disks;
+  ctx->missing_disk = -1;
+  ctx->disk_mmaps = calloc(num_disks, sizeof(void *));
+  ctx->disk_sizes = calloc(num_disks, sizeof(size_t));
+  if (!ctx->disk_mmaps || !ctx->disk_sizes) {
+    perror("Error allocating disk tables");
+    return -1;
+  }
+
+  for (int i = 0; i < num_disks; i++) {
+    int fd = open(paths[i], f->repair ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      perror(paths[i]);
+      if (fd >= 0) {
+        close(fd);
+      }
+      return -1;
+    }
+    struct wfs_sb sb;
+    if (pread(fd, &sb, sizeof(sb), 0) != sizeof(sb) || sb.disk_index < 0 || sb.disk_index >= num_disks ||
+        ctx->disk_mmaps[sb.disk_index]) {
+      fprintf(stderr, "%s: invalid or duplicate disk index\n", paths[i]);
+      close(fd);
+      return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ | (f->repair ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      perror(paths[i]);
+      return -1;
+    }
+    ctx->disk_mmaps[sb.disk_index] = map;
+    ctx->disk_sizes[sb.disk_index] = st.st_size;
+  }
+  memcpy(&ctx->sb, ctx->disk_mmaps[0], sizeof(struct wfs_sb));
+  grow_fixup_superblock(&ctx->sb);
+  intent_fixup_superblock(&ctx->sb);
+  //NULL for an unknown mode, which check_superblocks reports before anything uses it
+  ctx->layout = layout_select(&ctx->sb);
+  ctx->meta_copies = meta_copies_of(&ctx->sb, num_disks);
+  return 0;
+}
+
+static void close_images(struct fsck *f) {
+  struct wfs_ctx *ctx = &f->ctx;
+  for (int i = 0; ctx->disk_mmaps && i < ctx->num_disks; i++) {
+    if (ctx->disk_mmaps[i]) {
+      if (f->repair) {
+        msync(ctx->disk_mmaps[i], ctx->disk_sizes[i], MS_SYNC);
+      }
+      munmap(ctx->disk_mmaps[i], ctx->disk_sizes[i]);
+    }
+  }
+  free(ctx->disk_mmaps);
+  free(ctx->disk_sizes);
+}
+
+//Geometry must be identical on every disk and fit the images, or nothing else can be trusted
+static int check_superblocks(struct fsck *f) {
+  struct wfs_ctx *ctx = &f->ctx;
+  const struct wfs_sb *sb = &ctx->sb;
+  int ok = 1;
+
+  if (sb->total_disks != ctx->num_disks) {
+    report(f, P_SUPERBLOCK, 0, "filesystem has %d disks, %d given", sb->total_disks, ctx->num_disks);
+    ok = 0;
+  }
+  if (sb->raid_mode < RAID_0 || sb->raid_mode > RAID_10 || sb->i_bitmap_ptr < (off_t)offsetof(struct wfs_sb, write_intent) ||
+      sb->d_bitmap_ptr < sb->i_bitmap_ptr + (off_t)((sb->num_inodes + 7) / 8) ||
+      sb->i_blocks_ptr < sb->d_bitmap_ptr + (off_t)((sb->num_data_blocks + 7) / 8) ||
+      sb->d_blocks_ptr < sb->i_blocks_ptr + (off_t)(sb->num_inodes * BLOCK_SIZE) ||
+      (sb->chunk_blocks > 1 && (sb->raid_mode != RAID_0 || sb->num_data_blocks % sb->chunk_blocks)) ||
+      (sb->grow_from_disks && (sb->raid_mode != RAID_0 || (int)sb->grow_from_disks >= sb->total_disks ||
+                               sb->grow_cursor > sb->num_data_blocks * sb->grow_from_disks))) {
+    report(f, P_SUPERBLOCK, 0, "inconsistent layout or RAID mode on disk 0");
+    return 0;
+  }
+
+  //Disks written together are at most one generation apart (see intent.h)
+  uint64_t newest = 0;
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    struct wfs_sb other = *(const struct wfs_sb *)ctx->disk_mmaps[disk];
+    intent_fixup_superblock(&other);
+    newest = other.generation > newest ? other.generation : newest;
+  }
+
+  for (int disk = 0; disk < ctx->num_disks; disk++) {
+    const struct wfs_sb *other = (const struct wfs_sb *)ctx->disk_mmaps[disk];
+    struct wfs_sb other_gen = *other;
+    intent_fixup_superblock(&other_gen);
+    if (memcmp(other_gen.fs_uuid, sb->fs_uuid, WFS_UUID_BYTES) != 0) {
+      report(f, P_SUPERBLOCK, 0, "disk %d belongs to another filesystem", disk);
+      ok = 0;
+    }
+    if (other_gen.generation + 1 < newest) {
+      report(f, P_SUPERBLOCK, 0, "disk %d is stale: generation %llu, newest %llu", disk,
+             (unsigned long long)other_gen.generation, (unsigned long long)newest);
+    }
+    //A crash between two superblock updates of a grow's rebalance leaves the cursors apart; the
+    //next mount settles them, and either one maps every block correctly
+    struct wfs_sb other_grow = *other;
+    grow_fixup_superblock(&other_grow);
+    if (other->num_inodes != sb->num_inodes || other->num_data_blocks != sb->num_data_blocks ||
+        other->i_bitmap_ptr != sb->i_bitmap_ptr || other->d_bitmap_ptr != sb->d_bitmap_ptr ||
+        other->i_blocks_ptr != sb->i_blocks_ptr || other->d_blocks_ptr != sb->d_blocks_ptr ||
+        other->raid_mode != sb->raid_mode || other->total_disks != sb->total_disks ||
+        other->chunk_blocks != sb->chunk_blocks || other_grow.grow_from_disks != sb->grow_from_disks ||
+        (!sb->grow_from_disks && other_grow.grow_cursor != sb->grow_cursor)) {
+      report(f, P_SUPERBLOCK, 0, "disk %d geometry differs from disk 0", disk);
+      ok = 0;
+    }
+    if (ctx->disk_sizes[disk] < sb->d_blocks_ptr + sb->num_data_blocks * BLOCK_SIZE) {
+      report(f, P_SUPERBLOCK, 0, "disk %d is smaller than its data region", disk);
+      ok = 0;
+    }
+  }
+  return ok;
+}
+
+//A data bitmap mkfs deferred to the first mount holds nothing yet
+static void check_deferred_bitmap(struct fsck *f) {
+  struct wfs_ctx *ctx = &f->ctx;
+  if (!(ctx->sb.flags & WFS_SB_DBITMAP_UNINIT)) {
+    return;
+  }
+  if (f->repair) {
+    uint32_t flags = ctx->sb.flags & ~WFS_SB_DBITMAP_UNINIT;
+    for (int disk = 0; disk < ctx->num_disks; disk++) {
+      memset(data_bitmap(f, disk), 0, (ctx->sb.num_data_blocks + 7) / 8);
+      ((struct wfs_sb *)ctx->disk_mmaps[disk])->flags = flags;
+    }
+    ctx->sb.flags = flags;
+  }
+  printf("data bitmap not yet initialised by a mount%s\n", f->repair ? ", zeroed" : ", bitmap checks skipped");
+}
+
+//Regions an unclean shutdown left marked; the mirror and parity phases have checked them all,
+//so after a repair run the marks can go
+static void check_write_intent(struct fsck *f) {
+  struct wfs_ctx *ctx = &f->ctx;
+  if (ctx->sb.i_bitmap_ptr < (off_t)sizeof(struct wfs_sb)) {
+    return;
+  }
+  int marked = 0;
+  for (int i = 0; i < WFS_INTENT_BYTES; i++) {
+    uint8_t bits = 0;
+    for (int disk = 0; disk < ctx->num_disks; disk++) {
+      bits |= ((struct wfs_sb *)ctx->disk_mmaps[disk])->write_intent[i];
+    }
+    marked += __builtin_popcount(bits);
+  }
+  if (!marked) {
+    return;
+  }
+  if (f->repair) {
+    for (int disk = 0; disk < ctx->num_disks; disk++) {
+      memset(((struct wfs_sb *)ctx->disk_mmaps[disk])->write_intent, 0, WFS_INTENT_BYTES);
+    }
+  }
+  printf("write-intent: %d regions marked by an unclean shutdown%s\n", marked, f->repair ? ", cleared" : "");
+}
+
+int main(int argc, char *argv[]) {
+  struct fsck f = {0};
+  f.threads = sysconf(_SC_NPROCESSORS_ONLN);
+  char *paths[MAX_DISKS];
+  int num_disks = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-r") == 0) {
+      f.repair = 1;
+    } else if (strcmp(argv[i], "-v") == 0) {
+      f.verbose = 1;
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      f.threads = atoi(argv[++i]);
+    } else if (argv[i][0] != '-' && num_disks < MAX_DISKS) {
+      paths[num_disks++] = argv[i];
+    } else {
+      print_usage(argv[0]);
+      return EXIT_OPERATIONAL;
+    }
+  }
+  if (num_disks == 0 || f.threads <= 0) {
+    print_usage(argv[0]);
+    return EXIT_OPERATIONAL;
+  }
+
+  if (open_images(&f, paths, num_disks) != 0) {
+    close_images(&f);
+    return EXIT_OPERATIONAL;
+  }
+  if (!check_superblocks(&f)) {
+    close_images(&f);
+    return EXIT_UNCORRECTED;
+  }
+
+  struct wfs_ctx *ctx = &f.ctx;
+  size_t block_slots = ctx->sb.num_data_blocks * ctx->num_disks;
+  f.valid = calloc(ctx->sb.num_inodes, 1);
+  f.reachable = calloc(ctx->sb.num_inodes, 1);
+  f.block_seen = calloc((block_slots + 7) / 8, 1);
+  f.block_multi = calloc((block_slots + 7) / 8, 1);
+  f.edges = calloc(f.threads, sizeof(struct edge_list));
+  if (!f.valid || !f.reachable || !f.block_seen || !f.block_multi || !f.edges) {
+    perror("Error allocating checker state");
+    close_images(&f);
+    return EXIT_OPERATIONAL;
+  }
+
+  check_deferred_bitmap(&f);
+  check_mirrors(&f);
+  run_parallel(&f, ctx->sb.num_inodes, check_inodes);
+  if (!f.valid[0] || !S_ISDIR(inode_at(&f, 0)->mode)) {
+    report(&f, P_TREE, 0, "root inode is missing or not a directory");
+  } else {
+    run_parallel(&f, ctx->sb.num_inodes, check_directories);
+    if (f.edge_alloc_failed || check_tree(&f) != 0) {
+      perror("Error building the directory tree");
+      close_images(&f);
+      return EXIT_OPERATIONAL;
+    }
+    run_parallel(&f, ctx->sb.num_inodes, check_references);
+    if (!(ctx->sb.flags & WFS_SB_DBITMAP_UNINIT)) {
+      run_parallel(&f, ctx->sb.num_data_blocks, check_bitmaps);
+    }
+  }
+  if (ctx->sb.raid_mode == RAID_5 && !(ctx->sb.flags & WFS_SB_DBITMAP_UNINIT)) {
+    run_parallel(&f, ctx->sb.num_data_blocks, check_parity);
+  }
+  check_write_intent(&f);
+
+  uint64_t total = 0;
+  for (int kind = 0; kind < P_COUNT; kind++) {
+    total += f.found[kind];
+    if (f.found[kind] > MAX_REPORTS && !f.verbose) {
+      printf("%s: %lu problems in total\n", problem_names[kind], f.found[kind]);
+    }
+  }
+  size_t reachable = 0;
+  for (size_t i = 0; i < ctx->sb.num_inodes; i++) {
+    reachable += f.reachable[i];
+  }
+  printf("wfsck: %d disks, raid mode %d, %zu reachable inodes, %lu problems, %lu fixed\n",
+         ctx->num_disks, ctx->sb.raid_mode, reachable, total, f.fixed);
+
+  for (int t = 0; t < f.threads; t++) {
+    free(f.edges[t].edges);
+  }
+  free(f.edges);
+  free(f.valid);
+  free(f.reachable);
+  free(f.block_seen);
+  free(f.block_multi);
+  close_images(&f);
+
+  if (total == 0) {
+    return EXIT_CLEAN;
+  }
+  return total == f.fixed ? EXIT_FIXED : EXIT_UNCORRECTED;
+}
@@ -0,0 +1,82 @@
+#include "engine.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+  Offline rebuild of a lost mirror or parity disk. Opens the surviving
+  images of an unmounted RAID 1, 1v, 5 or 10 filesystem through the engine,
+  degraded, and copies or reconstructs what is in use onto the replacement
+  image (see rebuild.h), which then takes the lost disk's place on the next
+  mount.
+*/
+
+static void print_usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-j threads] -n new_disk disk1 [disk2...]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+  char *paths[MAX_DISKS];
+  int num_disks = 0;
+  const char *new_disk = NULL;
+  int threads = WFS_REBUILD_THREADS;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      new_disk = argv[++i];
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (argv[i][0] == '-' || num_disks == MAX_DISKS) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    } else {
+      paths[num_disks++] = argv[i];
+    }
+  }
+  if (num_disks == 0 || !new_disk || threads < 1) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  struct wfs_ctx ctx;
+  if (wfs_ctx_open(&ctx, paths, num_disks) != 0) {
+    return EXIT_FAILURE;
+  }
+  if (ctx.missing_disk < 0) {
+    fprintf(stderr, "No disk is missing: nothing to rebuild\n");
+    wfs_ctx_close(&ctx);
+    return EXIT_FAILURE;
+  }
+  int fd = open(new_disk, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    perror("Error opening the new disk");
+    wfs_ctx_close(&ctx);
+    return EXIT_FAILURE;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  size_t copied = 0;
+  pthread_mutex_lock(&ctx.lock);
+  int ret = rebuild_disk(&ctx, fd, threads, &copied);
+  mapping_release(&ctx);
+  pthread_mutex_unlock(&ctx.lock);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  close(fd);
+
+  if (ret == -EINVAL) {
+    fprintf(stderr, "Only a RAID 1, 1v, 5 or 10 disk can be rebuilt from the survivors\n");
+  } else if (ret == -EEXIST) {
+    fprintf(stderr, "%s is one of the surviving disks\n", new_disk);
+  } else if (ret != 0) {
+    fprintf(stderr, "Error rebuilding disk %d: %s\n", ctx.missing_disk, strerror(-ret));
+  } else {
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("wfsrebuild: disk %d rebuilt, %zu bytes copied in %.3f s\n", ctx.missing_disk, copied, seconds);
+  }
+  wfs_ctx_close(&ctx);
+  return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,394 @@
+#include "engine.h"
+#include "record.h"
+#include "stats.h"
+#include "utility.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+  Replays a workload recorded with `wfs --record=FILE` straight against
+  the engine, with no mount. The scratch images are formatted fresh with
+  the recorded geometry, or copied from images given after the record
+  file (a snapshot taken before recording). One thread replays the
+  records in file order; with -t each thread takes the records of the
+  recording threads assigned to it, in their order. -o paces every record
+  to its recorded start time; by default they run back to back.
+*/
+
+struct replay_op {
+  struct wfs_record rec;
+  char *path;
+  char *src_path;
+};
+
+struct replay_data {
+  struct wfs_record_header header;
+  struct replay_op *ops;
+  size_t count;
+  uint64_t max_io; //largest read or write, to size the buffers
+};
+
+struct replay_thread {
+  pthread_t thread;
+  int index;
+  int threads;
+  int paced;
+  struct wfs_ctx *ctx;
+  const struct replay_data *data;
+  const char *write_buf;
+  uint64_t start_ns;
+};
+
+//Latency of the recording and of the replay, per record op; updated atomically by the replay threads
+static struct wfs_op_stats recorded[RECORD_OP_COUNT];
+static struct wfs_op_stats replayed[RECORD_OP_COUNT];
+static uint64_t diverged[RECORD_OP_COUNT];
+
+static void print_usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-t threads] [-o] [-k] [-d scratch_dir] record_file [disk_image...]\n", name);
+}
+
+static const char *op_name(int op) {
+  return op == RECORD_OP_SET_COMPRESSION ? "set_compression" : stats_op_name(op);
+}
+
+static char *read_path(FILE *file, size_t len) {
+  char *path = malloc(len + 1);
+  if (path && fread(path, 1, len, file) != len) {
+    free(path);
+    return NULL;
+  }
+  if (path) {
+    path[len] = '\0';
+  }
+  return path;
+}
+
+static int load_records(const char *path, struct replay_data *data) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror("Error opening record file");
+    return -1;
+  }
+  if (fread(&data->header, sizeof(data->header), 1, file) != 1 ||
+      memcmp(data->header.magic, RECORD_MAGIC, sizeof(data->header.magic)) != 0 ||
+      data->header.version != RECORD_VERSION || data->header.num_disks < 1 ||
+      data->header.num_disks > MAX_DISKS) {
+    fprintf(stderr, "%s is not a wfs workload record\n", path);
+    fclose(file);
+    return -1;
+  }
+
+  size_t capacity = 0;
+  struct wfs_record rec;
+  while (fread(&rec, sizeof(rec), 1, file) == 1) {
+    if (rec.op >= RECORD_OP_COUNT || rec.path_len >= PATH_MAX || rec.src_path_len >= PATH_MAX) {
+      fprintf(stderr, "Corrupt record %zu in %s\n", data->count, path);
+      break;
+    }
+    if (data->count == capacity) {
+      capacity = capacity ? capacity * 2 : 4096;
+      struct replay_op *grown = realloc(data->ops, capacity * sizeof(struct replay_op));
+      if (!grown) {
+        perror("Error reading records");
+        break;
+      }
+      data->ops = grown;
+    }
+    struct replay_op *op = &data->ops[data->count];
+    op->rec = rec;
+    op->path = read_path(file, rec.path_len);
+    op->src_path = rec.src_path_len ? read_path(file, rec.src_path_len) : NULL;
+    if (!op->path || (rec.src_path_len && !op->src_path)) {
+      fprintf(stderr, "Truncated record %zu in %s\n", data->count, path);
+      free(op->path);
+      break;
+    }
+    if ((rec.op == WFS_OP_READ || rec.op == WFS_OP_WRITE) && rec.size > data->max_io) {
+      data->max_io = rec.size;
+    }
+    stats_record_latency(&recorded[rec.op], rec.duration_ns, rec.result);
+    data->count++;
+  }
+  fclose(file);
+  return 0;
+}
+
+//Copy a snapshot image so the replay never modifies it
+static int copy_image(const char *from, const char *to) {
+  int in = open(from, O_RDONLY);
+  int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  char buf[1 << 16];
+  ssize_t got = 0;
+  while (in >= 0 && out >= 0 && (got = read(in, buf, sizeof(buf))) > 0) {
+    if (write(out, buf, got) != got) {
+      got = -1;
+      break;
+    }
+  }
+  if (in >= 0) {
+    close(in);
+  }
+  if (out >= 0) {
+    close(out);
+  }
+  if (in < 0 || out < 0 || got < 0) {
+    perror("Error copying disk image");
+    return -1;
+  }
+  return 0;
+}
+
+static int prepare_images(const struct wfs_record_header *header, char **paths, char **images, int num_images) {
+  int num_disks = header->num_disks;
+  if (num_images && num_images != num_disks) {
+    fprintf(stderr, "The recording used %d disks, %d images given\n", num_disks, num_images);
+    return -1;
+  }
+  size_t required_size = calc_size(header->num_inodes, header->num_data_blocks);
+  uint8_t fs_uuid[WFS_UUID_BYTES];
+  generate_fs_uuid(fs_uuid);
+  for (int i = 0; i < num_disks; i++) {
+    if (num_images) {
+      if (copy_image(images[i], paths[i]) != 0) {
+        return -1;
+      }
+      continue;
+    }
+    int fd = open(paths[i], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, required_size) != 0) {
+      perror("Error creating scratch image");
+      if (fd >= 0) {
+        close(fd);
+      }
+      return -1;
+    }
+    close(fd);
+    if (disk_initialize(paths[i], header->num_inodes, header->num_data_blocks, required_size,
+                        header->raid_mode, i, num_disks, header->chunk_blocks,
+                        header->meta_copies, NULL, fs_uuid, 0) != 0) {
+      fprintf(stderr, "Error formatting %s\n", paths[i]);
+      return -1;
+    }
+  }
+  //Write the images back now so the first syncs of the replay do not pay for it
+  for (int i = 0; i < num_disks; i++) {
+    int fd = open(paths[i], O_RDWR);
+    if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+    }
+  }
+  return 0;
+}
+
+static int discard_entry(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+  (void)buf;
+  (void)name;
+  (void)stbuf;
+  (void)off;
+  return 0;
+}
+
+//Run one record the way its FUSE callback would, under the engine lock
+static int replay_one(struct wfs_ctx *ctx, const struct replay_op *op, char *read_buf, const char *write_buf) {
+  const struct wfs_record *rec = &op->rec;
+  struct stat st;
+  int ret = -ENOSYS;
+  pthread_mutex_lock(&ctx->lock);
+  switch (rec->op) {
+  case WFS_OP_GETATTR:
+    ret = engine_getattr(ctx, op->path, &st);
+    break;
+  case WFS_OP_MKNOD:
+    ret = engine_mknod(ctx, op->path, rec->mode);
+    break;
+  case WFS_OP_MKDIR:
+    ret = engine_mkdir(ctx, op->path, rec->mode);
+    break;
+  case WFS_OP_UNLINK:
+    ret = engine_unlink(ctx, op->path);
+    break;
+  case WFS_OP_RMDIR:
+    ret = engine_rmdir(ctx, op->path);
+    break;
+  case WFS_OP_READ:
+    ret = engine_read(ctx, op->path, read_buf, rec->size, rec->offset);
+    break;
+  case WFS_OP_WRITE:
+    ret = engine_write(ctx, op->path, write_buf, rec->size, rec->offset);
+    break;
+  case WFS_OP_READDIR:
+    ret = engine_readdir(ctx, op->path, NULL, discard_entry, rec->offset);
+    break;
+  case WFS_OP_COPY_RANGE:
+    ret = op->src_path ? engine_copy_file_range(ctx, op->src_path, rec->offset_in, op->path, rec->offset, rec->size)
+                       : -EINVAL;
+    break;
+  case RECORD_OP_SET_COMPRESSION:
+    ret = engine_set_compression(ctx, op->path, rec->size != 0);
+    break;
+  }
+  mapping_release(ctx);
+  pthread_mutex_unlock(&ctx->lock);
+  return ret;
+}
+
+static void wait_until(uint64_t target_ns) {
+  uint64_t now = stats_now_ns();
+  if (now < target_ns) {
+    struct timespec delay = {(target_ns - now) / 1000000000ULL, (target_ns - now) % 1000000000ULL};
+    nanosleep(&delay, NULL);
+  }
+}
+
+static void *replay_thread(void *arg) {
+  struct replay_thread *self = arg;
+  char *read_buf = malloc(self->data->max_io ? self->data->max_io : 1);
+  if (!read_buf) {
+    perror("Error allocating the read buffer");
+    return NULL;
+  }
+  for (size_t i = 0; i < self->data->count; i++) {
+    const struct replay_op *op = &self->data->ops[i];
+    if (op->rec.thread % self->threads != self->index) {
+      continue;
+    }
+    if (self->paced) {
+      wait_until(self->start_ns + op->rec.start_ns);
+    }
+    uint64_t start = stats_now_ns();
+    int ret = replay_one(self->ctx, op, read_buf, self->write_buf);
+    stats_record_latency(&replayed[op->rec.op], stats_now_ns() - start, ret);
+    if (ret != op->rec.result) {
+      __atomic_fetch_add(&diverged[op->rec.op], 1, __ATOMIC_RELAXED);
+    }
+  }
+  free(read_buf);
+  return NULL;
+}
+
+static void print_report(const struct replay_data *data, int threads, int paced, uint64_t elapsed_ns) {
+  uint64_t total_diverged = 0;
+  for (int op = 0; op < RECORD_OP_COUNT; op++) {
+    total_diverged += diverged[op];
+  }
+  printf("replayed %zu records in %.3f ms (threads=%d, %s), %lu results differed from the recording\n",
+         data->count, elapsed_ns / 1e6, threads, paced ? "paced" : "max speed", total_diverged);
+  printf("%-16s %8s %7s %8s %12s %12s %12s %12s %12s %12s\n", "op", "calls", "errors", "diverged",
+         "rec_avg_ns", "rec_p99_ns", "avg_ns", "p50_ns", "p99_ns", "max_ns");
+  for (int op = 0; op < RECORD_OP_COUNT; op++) {
+    const struct wfs_op_stats *rec = &recorded[op];
+    const struct wfs_op_stats *rep = &replayed[op];
+    if (!rep->calls) {
+      continue;
+    }
+    printf("%-16s %8lu %7lu %8lu %12lu %12lu %12lu %12lu %12lu %12lu\n", op_name(op), rep->calls,
+           rep->errors, diverged[op], rec->total_ns / rec->calls, stats_quantile_ns(rec, rec->calls, 990),
+           rep->total_ns / rep->calls, stats_quantile_ns(rep, rep->calls, 500),
+           stats_quantile_ns(rep, rep->calls, 990), rep->max_ns);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int threads = 1;
+  int paced = 0;
+  int keep = 0;
+  const char *dir = "/tmp";
+  const char *record_path = NULL;
+  char **images = NULL;
+  int num_images = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-o") == 0) {
+      paced = 1;
+    } else if (strcmp(argv[i], "-k") == 0) {
+      keep = 1;
+    } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      dir = argv[++i];
+    } else if (argv[i][0] != '-') {
+      record_path = argv[i];
+      images = argv + i + 1;
+      num_images = argc - i - 1;
+      break;
+    } else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!record_path || threads < 1) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  struct replay_data data = {0};
+  if (load_records(record_path, &data) != 0) {
+    return 1;
+  }
+
+  int num_disks = data.header.num_disks;
+  char *paths[MAX_DISKS];
+  for (int i = 0; i < num_disks; i++) {
+    paths[i] = malloc(PATH_MAX);
+    snprintf(paths[i], PATH_MAX, "%s/wfs-replay-disk%d.img", dir, i);
+  }
+
+  int ret = 1;
+  struct wfs_ctx ctx;
+  char *write_buf = malloc(data.max_io ? data.max_io : 1);
+  struct replay_thread *workers = calloc(threads, sizeof(struct replay_thread));
+  if (!write_buf || !workers || prepare_images(&data.header, paths, images, num_images) != 0 ||
+      wfs_ctx_open(&ctx, paths, num_disks) != 0) {
+    goto out;
+  }
+  ctx.compress_new_files = data.header.compress_new_files;
+  //Written data is not recorded; this pattern still compresses, like most real data
+  for (uint64_t i = 0; i < data.max_io; i++) {
+    write_buf[i] = 'a' + (i / 64) % 26;
+  }
+
+  uint64_t start = stats_now_ns();
+  int started = 0;
+  for (int i = 0; i < threads; i++) {
+    workers[i] = (struct replay_thread){.index = i, .threads = threads, .paced = paced, .ctx = &ctx,
+                                        .data = &data, .write_buf = write_buf, .start_ns = start};
+    if (pthread_create(&workers[i].thread, NULL, replay_thread, &workers[i]) != 0) {
+      perror("Error starting a replay thread");
+      break;
+    }
+    started++;
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  uint64_t elapsed = stats_now_ns() - start;
+  wfs_ctx_close(&ctx);
+  if (started == threads) {
+    print_report(&data, threads, paced, elapsed);
+    ret = 0;
+  }
+
+out:
+  free(workers);
+  free(write_buf);
+  for (int i = 0; i < num_disks; i++) {
+    if (!keep) {
+      unlink(paths[i]);
+    }
+    free(paths[i]);
+  }
+  for (size_t i = 0; i < data.count; i++) {
+    free(data.ops[i].path);
+    free(data.ops[i].src_path);
+  }
+  free(data.ops);
+  return ret;
+}
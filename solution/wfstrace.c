@@ -0,0 +1,290 @@
+#include "stats.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  Offline analysis of a block trace written by `wfs --trace=FILE`.
+  Prints a per-disk/per-region summary, a per-disk throughput timeline
+  and a block-address heatmap per disk (time on rows, address on columns).
+  With -c the timeline and heatmaps are emitted as CSV for graphing.
+*/
+
+#define REGION_COUNT 5
+static const char *region_names[REGION_COUNT] = {"superblock", "inode_bitmap", "data_bitmap", "inodes", "data"};
+
+#define ORIGIN_COUNT (WFS_OP_COUNT + 1)
+
+static const char heat_chars[] = " .:-=+*#%@";
+
+struct trace_data {
+  struct wfs_trace_header header;
+  struct wfs_trace_rec *recs;
+  size_t count;
+  uint64_t end_ns;
+  uint64_t max_block[256];
+};
+
+static void print_usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-i interval_ms] [-w columns] [-r rows] [-c] trace_file\n", name);
+}
+
+static int load_trace(const char *path, struct trace_data *data) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror("Error opening trace file");
+    return -1;
+  }
+  if (fread(&data->header, sizeof(data->header), 1, file) != 1 ||
+      memcmp(data->header.magic, TRACE_MAGIC, sizeof(data->header.magic)) != 0 ||
+      data->header.version != TRACE_VERSION || data->header.num_disks > 256) {
+    fprintf(stderr, "%s is not a wfs trace\n", path);
+    fclose(file);
+    return -1;
+  }
+
+  size_t capacity = 4096;
+  data->recs = malloc(capacity * sizeof(struct wfs_trace_rec));
+  data->count = 0;
+  while (data->recs) {
+    if (data->count == capacity) {
+      capacity *= 2;
+      data->recs = realloc(data->recs, capacity * sizeof(struct wfs_trace_rec));
+      if (!data->recs) {
+        break;
+      }
+    }
+    size_t got = fread(data->recs + data->count, sizeof(struct wfs_trace_rec), capacity - data->count, file);
+    if (got == 0) {
+      break;
+    }
+    data->count += got;
+  }
+  fclose(file);
+  if (!data->recs) {
+    perror("Error reading trace");
+    return -1;
+  }
+
+  for (size_t i = 0; i < data->count; i++) {
+    const struct wfs_trace_rec *rec = &data->recs[i];
+    if (rec->ts_ns > data->end_ns) {
+      data->end_ns = rec->ts_ns;
+    }
+    if (rec->offset / data->header.block_size > data->max_block[rec->disk]) {
+      data->max_block[rec->disk] = rec->offset / data->header.block_size;
+    }
+  }
+  return 0;
+}
+
+//Which on-disk region a byte offset falls in, from the layout in the header
+static int region_of(const struct wfs_trace_header *header, uint64_t offset) {
+  if (offset >= header->d_blocks_ptr) {
+    return 4;
+  }
+  if (offset >= header->i_blocks_ptr) {
+    return 3;
+  }
+  if (offset >= header->d_bitmap_ptr) {
+    return 2;
+  }
+  return offset >= header->i_bitmap_ptr ? 1 : 0;
+}
+
+static const char *origin_name(int origin) {
+  return origin < WFS_OP_COUNT ? stats_op_name(origin) : "internal";
+}
+
+static void print_summary(const struct trace_data *data) {
+  const struct wfs_trace_header *header = &data->header;
+  uint64_t bytes[256][REGION_COUNT][2] = {{{0}}};
+  uint64_t ops[256][REGION_COUNT][2] = {{{0}}};
+  uint64_t origin_bytes[ORIGIN_COUNT][2] = {{0}};
+
+  for (size_t i = 0; i < data->count; i++) {
+    const struct wfs_trace_rec *rec = &data->recs[i];
+    int origin = rec->origin < WFS_OP_COUNT ? rec->origin : WFS_OP_COUNT;
+    int region = region_of(header, rec->offset);
+    bytes[rec->disk][region][rec->op] += rec->size;
+    ops[rec->disk][region][rec->op]++;
+    origin_bytes[origin][rec->op] += rec->size;
+  }
+
+  printf("trace: %zu records, %lu dropped, %.3f s, %u disks, raid mode %u\n\n",
+         data->count, header->dropped, data->end_ns / 1e9, header->num_disks, header->raid_mode);
+
+  printf("%-6s %-13s %12s %14s %12s %14s\n", "disk", "region", "reads", "read_bytes", "writes", "write_bytes");
+  for (uint32_t disk = 0; disk < header->num_disks; disk++) {
+    for (int region = 0; region < REGION_COUNT; region++) {
+      printf("%-6u %-13s %12lu %14lu %12lu %14lu\n", disk, region_names[region],
+             ops[disk][region][TRACE_OP_READ], bytes[disk][region][TRACE_OP_READ],
+             ops[disk][region][TRACE_OP_WRITE], bytes[disk][region][TRACE_OP_WRITE]);
+    }
+  }
+  printf("\n");
+
+  printf("%-10s %14s %14s\n", "origin", "read_bytes", "write_bytes");
+  for (int origin = 0; origin < ORIGIN_COUNT; origin++) {
+    if (origin_bytes[origin][0] || origin_bytes[origin][1]) {
+      printf("%-10s %14lu %14lu\n", origin_name(origin), origin_bytes[origin][TRACE_OP_READ],
+             origin_bytes[origin][TRACE_OP_WRITE]);
+    }
+  }
+  printf("\n");
+}
+
+static void print_timeline(const struct trace_data *data, uint64_t interval_ns, int csv) {
+  uint32_t num_disks = data->header.num_disks;
+  size_t intervals = data->end_ns / interval_ns + 1;
+  uint64_t *bytes = calloc(intervals * num_disks * 2, sizeof(uint64_t));
+  if (!bytes) {
+    return;
+  }
+
+  for (size_t i = 0; i < data->count; i++) {
+    const struct wfs_trace_rec *rec = &data->recs[i];
+    if (rec->disk < num_disks) {
+      bytes[((rec->ts_ns / interval_ns) * num_disks + rec->disk) * 2 + rec->op] += rec->size;
+    }
+  }
+
+  double seconds = interval_ns / 1e9;
+  if (csv) {
+    printf("time_ms,disk,read_bytes,write_bytes\n");
+  } else {
+    printf("throughput per %.0f ms interval (MiB/s read/write)\n%10s", interval_ns / 1e6, "time_ms");
+    for (uint32_t disk = 0; disk < num_disks; disk++) {
+      printf("   disk%-2u r/w      ", disk);
+    }
+    printf("\n");
+  }
+  for (size_t t = 0; t < intervals; t++) {
+    if (!csv) {
+      printf("%10.0f", t * interval_ns / 1e6);
+    }
+    for (uint32_t disk = 0; disk < num_disks; disk++) {
+      uint64_t read = bytes[(t * num_disks + disk) * 2 + TRACE_OP_READ];
+      uint64_t written = bytes[(t * num_disks + disk) * 2 + TRACE_OP_WRITE];
+      if (csv) {
+        printf("%.0f,%u,%lu,%lu\n", t * interval_ns / 1e6, disk, read, written);
+      } else {
+        printf("  %8.2f/%-8.2f", read / seconds / (1 << 20), written / seconds / (1 << 20));
+      }
+    }
+    if (!csv) {
+      printf("\n");
+    }
+  }
+  printf("\n");
+  free(bytes);
+}
+
+//Access counts binned by time (rows) and block address (columns), log-scaled to characters
+static void print_heatmaps(const struct trace_data *data, int rows, int columns, int csv) {
+  uint32_t num_disks = data->header.num_disks;
+  uint64_t *counts = calloc((size_t)rows * columns, sizeof(uint64_t));
+  if (!counts) {
+    return;
+  }
+  if (csv) {
+    printf("disk,time_bin,address_bin,first_block,accesses\n");
+  }
+
+  for (uint32_t disk = 0; disk < num_disks; disk++) {
+    memset(counts, 0, (size_t)rows * columns * sizeof(uint64_t));
+    uint64_t blocks = data->max_block[disk] + 1;
+    uint64_t max_count = 0;
+    for (size_t i = 0; i < data->count; i++) {
+      const struct wfs_trace_rec *rec = &data->recs[i];
+      if (rec->disk != disk) {
+        continue;
+      }
+      size_t row = data->end_ns ? rec->ts_ns * (rows - 1) / data->end_ns : 0;
+      size_t column = rec->offset / data->header.block_size * columns / blocks;
+      uint64_t count = ++counts[row * columns + column];
+      if (count > max_count) {
+        max_count = count;
+      }
+    }
+
+    if (!csv) {
+      printf("disk %u heatmap: %d time rows x %d address columns, blocks 0..%lu, max %lu accesses/cell\n",
+             disk, rows, columns, blocks - 1, max_count);
+    }
+    for (int row = 0; row < rows; row++) {
+      if (!csv) {
+        printf("|");
+      }
+      for (int column = 0; column < columns; column++) {
+        uint64_t count = counts[row * columns + column];
+        if (csv) {
+          if (count) {
+            printf("%u,%d,%d,%lu,%lu\n", disk, row, column, column * blocks / columns, count);
+          }
+          continue;
+        }
+        int level = 0;
+        if (count && max_count > 1) {
+          //log scale so a few hot metadata blocks do not wash out the data region
+          level = 1 + (int)((sizeof(heat_chars) - 3) * (63 - __builtin_clzll(count)) /
+                            (63 - __builtin_clzll(max_count)));
+        } else if (count) {
+          level = sizeof(heat_chars) - 2;
+        }
+        putchar(heat_chars[level]);
+      }
+      if (!csv) {
+        printf("|\n");
+      }
+    }
+    if (!csv) {
+      printf("\n");
+    }
+  }
+  free(counts);
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t interval_ms = 100;
+  int columns = 64;
+  int rows = 20;
+  int csv = 0;
+  const char *path = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+      interval_ms = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      columns = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      rows = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-c") == 0) {
+      csv = 1;
+    } else if (!path && argv[i][0] != '-') {
+      path = argv[i];
+    } else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!path || interval_ms == 0 || columns <= 0 || rows <= 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  struct trace_data data = {0};
+  if (load_trace(path, &data) != 0) {
+    return 1;
+  }
+
+  if (!csv) {
+    print_summary(&data);
+  }
+  print_timeline(&data, interval_ms * 1000000ULL, csv);
+  print_heatmaps(&data, rows, columns, csv);
+
+  free(data.recs);
+  return 0;
+}
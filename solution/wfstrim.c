@@ -0,0 +1,53 @@
+#include "engine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  Offline fstrim. Opens unmounted images through the engine and punches
+  a hole for every page-aligned run of free data blocks, so images used
+  without `wfs --discard`, or written before it existed, hand their dead
+  space back to the host.
+*/
+
+static void print_usage(const char *name) {
+  fprintf(stderr, "Usage: %s disk1 [disk2...]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+  char *paths[MAX_DISKS];
+  int num_disks = 0;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' || num_disks == MAX_DISKS) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    paths[num_disks++] = argv[i];
+  }
+  if (num_disks == 0) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  struct wfs_ctx ctx;
+  if (wfs_ctx_open(&ctx, paths, num_disks) != 0) {
+    return EXIT_FAILURE;
+  }
+  //A RAID 5 row can only be trimmed once every bitmap in it is readable
+  if (ctx.missing_disk >= 0) {
+    fprintf(stderr, "Cannot trim with disk %d missing\n", ctx.missing_disk);
+    wfs_ctx_close(&ctx);
+    return EXIT_FAILURE;
+  }
+
+  ctx.discard.enabled = 1;
+  pthread_mutex_lock(&ctx.lock);
+  size_t punched = discard_trim(&ctx);
+  mapping_release(&ctx);
+  pthread_mutex_unlock(&ctx.lock);
+  int supported = ctx.discard.enabled;
+  printf("wfstrim: %d disks, %lu holes punched, %zu bytes trimmed\n", ctx.num_disks,
+         ctx.stats.discard_punches, punched);
+  wfs_ctx_close(&ctx);
+  return supported ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -3,17 +3,22 @@
 import argparse
 import wfsverify
 
-def corrupt_disk(disks):
+def corrupt_disk(disks, bitmap):
     filesystems = [wfsverify.WfsState(disk) for disk in disks]
 
     for fs in filesystems:
-        fs.clear_datablock_region()
+        if bitmap:
+            fs.fill_datablock_bitmap()
+        else:
+            fs.clear_datablock_region()
 
 if __name__ == '__main__':
     parser = argparse.ArgumentParser()
     parser.add_argument("--disks", nargs="+", help="list of disks")
+    parser.add_argument("--bitmap", action="store_true",
+                        help="mark every data block used instead of clearing the data")
 
     args = parser.parse_args()
 
-    corrupt_disk(args.disks)
+    corrupt_disk(args.disks, args.bitmap)
 
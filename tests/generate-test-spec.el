@@ -241,12 +241,38 @@ DIR the mount directory"
    (string-join (gen-disks numdisks) " ")
    dir))
 
+(defun mount-opts-cmd (numdisks dir opts)
+  "Mount wfs like `mount-cmd', passing the wfs options OPTS as well.
+
+NUMDISKS the number of disks used for testing
+DIR the mount directory
+OPTS options such as --compress, as one string"
+  (format
+   "../solution/wfs %s %s -s %s"
+   (string-join (gen-disks numdisks) " ")
+   opts dir))
+
 (defun umount-cmd (dir)
   "Un-mount DIR with fusermount.
 
 DIR a directory mounted with FUSE."
   (format "fusermount -u %s" dir))
 
+(defun disk-args (disknums)
+  "Generate string with the test disks numbered DISKNUMS, in that order."
+  (mapconcat (lambda (n) (disk-path (format "test-disk%d" n)))
+	     disknums " "))
+
+(defun wfsck-cmd (flags numdisks)
+  "Run wfsck with FLAGS on the NUMDISKS test disks, keeping only its exit status."
+  (format "../solution/wfsck %s%s > /dev/null"
+	  flags (disk-args (number-sequence 1 numdisks))))
+
+(defun disk-usage-cmd (numdisks)
+  "Print the KiB the NUMDISKS sparse test disks take up on the host."
+  (format "du -k -c %s | tail -n 1 | cut -f 1"
+	  (disk-args (number-sequence 1 numdisks))))
+
 (defun mkfs-test (desc raid numdisks inodes blocks output pre-rc run-rc)
   "Test template for mfks.
 
@@ -273,6 +299,119 @@ RUN-RC return code of run command (metadata verifier)"
 	   (string-join (gen-disks numdisks) " "))
    output pre-rc run-rc ""))
 
+(defun large-image-test (desc raid numdisks size inodes blocks setup warmup op output)
+  "Test template for very large, sparse disk images.
+
+The images are far too large for the metadata verifier to walk, so OP
+checks the filesystem itself, e.g. by reading back what it wrote.  Their
+metadata is too large to pin or prefault as well, so every mount is made
+with --meta=none.  SETUP and WARMUP are part of the untimed pre command.
+
+DESC description of the test
+RAID raid mode as string (0, 1, 1v, 5 or 10)
+NUMDISKS number of disks in the filesystem
+SIZE size of each disk image, as passed to truncate
+INODES number of inodes passed to mkfs
+BLOCKS number of blocks passed to mkfs
+SETUP list of commands run on the images after mkfs
+WARMUP list of commands run on the mounted filesystem before OP
+OP commands run on the mounted filesystem
+OUTPUT expected output"
+  (define-test
+   (concat "large image: " desc)
+   (string-join
+    (append
+     (list
+      "mkdir -p mnt; mkdir -p /tmp/$(whoami)"
+      (create-disk-cmd numdisks size)
+      (concat "../solution/mkfs " (make-mkfs-args raid numdisks inodes blocks)))
+     setup
+     (list (mount-opts-cmd numdisks "mnt" "--meta=none"))
+     warmup)
+    " && ")
+   (teardown-cmd)
+   op
+   output "0" "0" ""))
+
+(defun workload-test (desc raid numdisks inodes blocks op output)
+  "Test template for workloads that check their own results.
+
+The metadata verifier only knows RAID 0, 1 and 1v and a filesystem left
+as the workload made it, so OP prints Correct for each step that worked.
+
+DESC description of the test
+RAID raid mode as string (0, 1, 1v, 5 or 10)
+NUMDISKS number of disks in the filesystem
+INODES number of inodes passed to mkfs
+BLOCKS number of blocks passed to mkfs
+OP commands run on the mounted filesystem
+OUTPUT expected output"
+  (define-test
+   desc
+   (string-join
+    (list
+     "mkdir -p mnt; mkdir -p /tmp/$(whoami)"
+     (create-disk-cmd numdisks "1M")
+     (concat "../solution/mkfs " (make-mkfs-args raid numdisks inodes blocks))
+     (mount-cmd numdisks "mnt"))
+    " && ")
+   (teardown-cmd)
+   op
+   output "0" "0" ""))
+
+(defun wfsck-repair-op (numdisks)
+  "Corrupt the data bitmap of disk 1 and have wfsck find and repair it.
+
+wfsck exits 0 when clean, 4 while problems remain and 1 once all were fixed."
+  (string-join
+   (list "./read-write.py 2 80"
+	 "cat mnt/file1 > file1.test"
+	 (umount-cmd "mnt")
+	 (wfsck-cmd "" numdisks)
+	 (format "./corrupt-disk.py --bitmap --disks %s" (disk-path "test-disk1"))
+	 (format "{ %s; [ $? -eq 4 ]; }" (wfsck-cmd "" numdisks))
+	 (format "{ %s; [ $? -eq 1 ]; }" (wfsck-cmd "-r " numdisks))
+	 (wfsck-cmd "" numdisks)
+	 (mount-cmd numdisks "mnt")
+	 "diff mnt/file1 file1.test && echo Correct")
+   " && "))
+
+(defun degraded-read-op (numdisks missing)
+  "Write files, then remount without disk MISSING and read them back.
+
+Every mode but RAID 0 mounts degraded and read-only with one disk missing,
+so creating a file has to fail."
+  (string-join
+   (list "./read-write.py 2 80"
+	 "cat mnt/file1 > file1.test"
+	 (umount-cmd "mnt")
+	 (format "../solution/wfs %s -s mnt 2> /dev/null"
+		 (disk-args (remove missing (number-sequence 1 numdisks))))
+	 "diff mnt/file1 file1.test"
+	 "! touch mnt/file3 2> /dev/null"
+	 "echo Correct")
+   " && "))
+
+(defun rebuild-op (numdisks lost lose-fmt)
+  "Write files, destroy disk LOST and rebuild it with wfsrebuild.
+
+LOSE-FMT is a command that destroys the image whose path fills its %s,
+e.g. removing it or overwriting it with noise.  The rebuilt image has to
+pass wfsck and serve the files again."
+  (let ((lost-disk (disk-path (format "test-disk%d" lost))))
+    (string-join
+     (list "./read-write.py 2 80"
+	   "cat mnt/file1 > file1.test"
+	   (umount-cmd "mnt")
+	   (format lose-fmt lost-disk)
+	   (format "../solution/wfsrebuild -n %s %s > /dev/null 2> /dev/null"
+		   lost-disk
+		   (disk-args (remove lost (number-sequence 1 numdisks))))
+	   (wfsck-cmd "" numdisks)
+	   (mount-cmd numdisks "mnt")
+	   "diff mnt/file1 file1.test && echo Correct")
+     " && ")))
+
 (defun verify-metadata-cmd (fs-state extra-blocks numdisks)
   (let ((metadata (count-metadata fs-state numdisks)))
       (format
@@ -503,4 +642,236 @@ POST-BLOCKS additional blocks we should expect (e.g. no cleaning dir blocks)"
 			  (mount-cmd 3 "mnt")
 			  "diff mnt/file1 file1.test")
 		    "; ")
-		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0))))))
+		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0))))
+   ((testcase . ,#'large-image-test)
+    ; desc raid numdisks size inodes blocks op output
+    ;; 2^31 + 2^20 blocks on each of two disks give block ids past 32 bits,
+    ;; and the inode bitmap alone is larger than a default thread stack.
+    ;; Marking the first 2^31 blocks of each disk in use leaves only ids of
+    ;; 2^32 and up free; the first allocation after a mount scans up to
+    ;; them, so the warm-up file takes that scan outside the timed run.
+    (configs . (("raid0 -- 64-bit block ids" "0" 2 "1100G" 134217728 2148532224
+		 (,(format "./wfs-block-ids.py fill 2147483648 --disks %s"
+			   (string-join (gen-disks 2) " ")))
+		 ("echo warm > mnt/warm")
+		 ,(string-join
+		   (list "./read-write.py 4 80"
+			 "cat mnt/file4 > file1.test"
+			 "rm mnt/file3"
+			 "./read-write.py 3 80" ; reuses what file3 freed
+			 (umount-cmd "mnt")
+			 (format "./wfs-block-ids.py check 4294967296 --disk %s"
+				 (disk-path "test-disk1"))
+			 (mount-opts-cmd 2 "mnt" "--meta=none")
+			 "diff mnt/file4 file1.test && echo Correct")
+		   " && ")
+		 "Correct\nCorrect\nCorrect"))))
+   ((testcase . ,#'workload-test)
+    ; desc raid numdisks inodes blocks op output
+    (configs . (("raid1 -- wfsck repairs a corrupted data bitmap" "1" 2 32 200
+		 ,(wfsck-repair-op 2) "Correct\nCorrect")
+		("raid0 -- wfsck repairs a corrupted data bitmap" "0" 3 32 200
+		 ,(wfsck-repair-op 3) "Correct\nCorrect"))))
+   ((testcase . ,#'workload-test)
+    ; desc raid numdisks inodes blocks op output
+    ;; 100-byte writes update parity by read-modify-write; cp writes whole
+    ;; pages, which fill rows and take the full-stripe path
+    (configs . (("raid5 -- small writes and readback after remount" "5" 3 32 200
+		 ,(string-join
+		   (list "./read-write.py 3 80"
+			 "grep -q \"rmw_writes=[1-9]\" mnt/.wfs/stats"
+			 "cat mnt/file2 > file1.test"
+			 (umount-cmd "mnt")
+			 (wfsck-cmd "" 3) ; parity matches every row in use
+			 (mount-cmd 3 "mnt")
+			 "diff mnt/file2 file1.test && echo Correct")
+		   " && ")
+		 "Correct\nCorrect")
+		("raid5 -- full-stripe writes" "5" 3 32 200
+		 ,(string-join
+		   (list "head -c 24576 /dev/urandom > file1.test"
+			 "cp file1.test mnt/file1"
+			 "grep -q \"full_stripe_writes=[1-9]\" mnt/.wfs/stats"
+			 (umount-cmd "mnt")
+			 (wfsck-cmd "" 3)
+			 (mount-cmd 3 "mnt")
+			 "diff mnt/file1 file1.test && echo Correct")
+		   " && ")
+		 "Correct")
+		("raid5 -- degraded read with disk 1 missing" "5" 3 32 200
+		 ,(degraded-read-op 3 1) "Correct\nCorrect")
+		("raid5 -- degraded read with disk 3 missing" "5" 3 32 200
+		 ,(degraded-read-op 3 3) "Correct\nCorrect"))))
+   ((testcase . ,#'workload-test)
+    ; desc raid numdisks inodes blocks op output
+    ;; disks 1 and 2 are one mirror pair, 3 and 4 the other
+    (configs . (("raid10 -- pair mirroring and readback after remount" "10" 4 32 200
+		 ,(string-join
+		   (list "./read-write.py 4 80"
+			 "cat mnt/file1 > file1.test"
+			 (umount-cmd "mnt")
+			 (wfsck-cmd "" 4) ; both members of each pair agree
+			 (mount-cmd 4 "mnt")
+			 "diff mnt/file1 file1.test && echo Correct")
+		   " && ")
+		 "Correct\nCorrect")
+		("raid10 -- read with disk 1 missing" "10" 4 32 200
+		 ,(degraded-read-op 4 1) "Correct\nCorrect")
+		("raid10 -- read with disk 4 missing" "10" 4 32 200
+		 ,(degraded-read-op 4 4) "Correct\nCorrect"))))
+   ((testcase . ,#'workload-test)
+    ; desc raid numdisks inodes blocks op output
+    ;; repeated text, so every 2 KiB cluster saves at least one block
+    (configs . (("compress -- files written under --compress read back after remount" "1" 2 32 200
+		 ,(string-join
+		   (list (umount-cmd "mnt")
+			 (mount-opts-cmd 2 "mnt" "--compress")
+			 "yes abcdefgh | head -c 30000 > file1.test"
+			 "cp file1.test mnt/file1"
+			 "grep -q \"clusters_compressed=[1-9]\" mnt/.wfs/stats"
+			 (umount-cmd "mnt")
+			 (wfsck-cmd "" 2)
+			 (mount-cmd 2 "mnt")
+			 "diff mnt/file1 file1.test && echo Correct")
+		   " && ")
+		 "Correct")
+		("compress -- set-compression ioctl on and off keeps the data" "1" 2 32 200
+		 ,(string-join
+		   (list "yes abcdefgh | head -c 30000 > file1.test"
+			 "cp file1.test mnt/file1"
+			 "./wfs-ioctl.py compress mnt/file1 1"
+			 "grep -q \"clusters_compressed=[1-9]\" mnt/.wfs/stats"
+			 "diff mnt/file1 file1.test"
+			 "./wfs-ioctl.py compress mnt/file1 0"
+			 "diff mnt/file1 file1.test"
+			 (umount-cmd "mnt")
+			 (wfsck-cmd "" 2)
+			 (mount-cmd 2 "mnt")
+			 "diff mnt/file1 file1.test && echo Correct")
+		   " && ")
+		 "Correct"))))
+   ((testcase . ,#'workload-test)
+    ; desc raid numdisks inodes blocks op output
+    ;; 120 long names take two readdir replies of a page each
+    (configs . (("readdir -- listing resumes after an unlink between calls" "1" 2 128 200
+		 "./readdir-unlink.py 120" "Correct"))))
+   ((testcase . ,#'workload-test)
+    ; desc raid numdisks inodes blocks op output
+    ;; a 16 KiB file spans whole pages, so freeing it punches holes; the
+    ;; sleep lets the once a second flush punch them before the unmount
+    (configs . (("discard -- images shrink after rm under --discard" "1" 2 32 200
+		 ,(string-join
+		   (list (umount-cmd "mnt")
+			 (mount-opts-cmd 2 "mnt" "--discard")
+			 "head -c 16384 /dev/urandom > file1.test"
+			 "cp file1.test mnt/file1"
+			 "head -c 16384 /dev/urandom > mnt/file2"
+			 (umount-cmd "mnt")
+			 (format "used=$(%s)" (disk-usage-cmd 2))
+			 (mount-opts-cmd 2 "mnt" "--discard")
+			 "rm mnt/file2"
+			 "sleep 2"
+			 (umount-cmd "mnt")
+			 (format "[ $(%s) -lt $used ]" (disk-usage-cmd 2))
+			 (mount-cmd 2 "mnt")
+			 "diff mnt/file1 file1.test && echo Correct")
+		   " && ")
+		 "Correct")
+		("discard -- wfstrim shrinks unmounted images" "1" 2 32 200
+		 ,(string-join
+		   (list "head -c 16384 /dev/urandom > file1.test"
+			 "cp file1.test mnt/file1"
+			 "head -c 16384 /dev/urandom > mnt/file2"
+			 "rm mnt/file2"
+			 (umount-cmd "mnt")
+			 (format "used=$(%s)" (disk-usage-cmd 2))
+			 (format "../solution/wfstrim %s > /dev/null"
+				 (disk-args (number-sequence 1 2)))
+			 (format "[ $(%s) -lt $used ]" (disk-usage-cmd 2))
+			 (mount-cmd 2 "mnt")
+			 "diff mnt/file1 file1.test && echo Correct")
+		   " && ")
+		 "Correct"))))
+   ((testcase . ,#'workload-test)
+    ; desc raid numdisks inodes blocks op output
+    ;; rebalance_from drops to 0 on the stats grow line once the rebalance is done
+    (configs . (("grow -- add a disk to a mounted raid0, rebalance and remount" "0" 2 32 200
+		 ,(string-join
+		   (list "./read-write.py 2 80"
+			 "cat mnt/file1 > file1.test"
+			 (format "truncate -s 1M %s" (disk-path "test-disk3"))
+			 (format "../solution/mkfs -r 0 -g -d %s -i 32 -b 200"
+				 (disk-path "test-disk3"))
+			 (format "./wfs-ioctl.py add-disk mnt/.wfs/stats %s"
+				 (disk-path "test-disk3"))
+			 "until grep -q \"rebalance_from=0\" mnt/.wfs/stats; do sleep 0.1; done"
+			 (umount-cmd "mnt")
+			 (wfsck-cmd "" 3)
+			 (mount-cmd 3 "mnt")
+			 "diff mnt/file1 file1.test && echo Correct")
+		   " && ")
+		 "Correct\nCorrect"))))
+   ((testcase . ,#'workload-test)
+    ; desc raid numdisks inodes blocks op output
+    (configs . (("wfsrebuild -- rebuild a removed raid1 mirror" "1" 3 32 200
+		 ,(rebuild-op 3 2 "rm -f %s") "Correct\nCorrect")
+		("wfsrebuild -- rebuild a removed raid10 pair member" "10" 4 32 200
+		 ,(rebuild-op 4 2 "rm -f %s") "Correct\nCorrect")
+		("wfsrebuild -- rebuild an overwritten raid5 disk from parity" "5" 3 32 200
+		 ,(rebuild-op 3 2 "head -c 1M /dev/urandom > %s") "Correct\nCorrect"))))
+   ((testcase . ,#'workload-test)
+    ; desc raid numdisks inodes blocks op output
+    ;; a disk put back after a mount, a write and an unmount without it is
+    ;; more than one generation behind
+    (configs . (("uuid -- a disk of another filesystem is refused" "1" 2 32 200
+		 ,(string-join
+		   (list "./read-write.py 2 80"
+			 "cat mnt/file1 > file1.test"
+			 (umount-cmd "mnt")
+			 (format "truncate -s 1M %s" (disk-args '(3 4)))
+			 (format "../solution/mkfs -r 1 -d %s -d %s -i 32 -b 200"
+				 (disk-path "test-disk3") (disk-path "test-disk4"))
+			 (format "! ../solution/wfs %s -s mnt 2> /dev/null"
+				 (disk-args '(1 4)))
+			 (mount-cmd 2 "mnt")
+			 "diff mnt/file1 file1.test && echo Correct")
+		   " && ")
+		 "Correct\nCorrect")
+		("generation -- a stale raid1 mirror is resynced" "1" 2 32 200
+		 ,(string-join
+		   (list "./read-write.py 2 80"
+			 (umount-cmd "mnt")
+			 (format "cp %s %s" (disk-path "test-disk2")
+				 (disk-path "test-disk2-stale"))
+			 (mount-cmd 2 "mnt")
+			 "./read-write.py 2 80"
+			 "cat mnt/file1 > file1.test"
+			 (umount-cmd "mnt")
+			 (format "mv %s %s" (disk-path "test-disk2-stale")
+				 (disk-path "test-disk2"))
+			 (format "%s 2> /dev/null" (mount-cmd 2 "mnt"))
+			 "diff mnt/file1 file1.test"
+			 (umount-cmd "mnt")
+			 (wfsck-cmd "" 2)
+			 "echo Correct")
+		   " && ")
+		 "Correct\nCorrect\nCorrect")
+		("generation -- a stale raid5 disk runs as missing" "5" 3 32 200
+		 ,(string-join
+		   (list "./read-write.py 2 80"
+			 "cat mnt/file1 > file1.test"
+			 (umount-cmd "mnt")
+			 (format "cp %s %s" (disk-path "test-disk3")
+				 (disk-path "test-disk3-stale"))
+			 (mount-cmd 3 "mnt")
+			 "touch mnt/file3"
+			 (umount-cmd "mnt")
+			 (format "mv %s %s" (disk-path "test-disk3-stale")
+				 (disk-path "test-disk3"))
+			 (format "%s 2> /dev/null" (mount-cmd 3 "mnt"))
+			 "diff mnt/file1 file1.test"
+			 "[ -e mnt/file3 ]"
+			 "! touch mnt/file4 2> /dev/null"
+			 "echo Correct")
+		   " && ")
+		 "Correct\nCorrect"))))))
@@ -0,0 +1,27 @@
+#!/usr/bin/python3
+
+# list a directory too large for one readdir reply and unlink an entry
+# already returned before the next reply; every other entry is listed once
+
+import os
+import sys
+
+numfiles = int(sys.argv[1])
+# names of 27 characters, the most a dentry holds, to fill the replies fast
+filelist = ["file%023d" % n for n in range(numfiles)]
+
+os.chdir("mnt")
+for name in filelist:
+    open(name, "w").close()
+
+entries = os.scandir(".")
+first = next(entries).name
+os.unlink(first)
+found = [first] + [entry.name for entry in entries]
+
+if len(found) == len(set(found)) and sorted(found) == sorted(filelist):
+    print("Correct")
+    exit(0)
+else:
+    print("readdir lost or repeated entries across an unlink")
+    exit(1)
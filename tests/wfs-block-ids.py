@@ -0,0 +1,44 @@
+#!/usr/bin/python3
+
+# push the data block allocator of a large image past a block id, and
+# check that the regular files got only block ids at or above it
+
+import argparse
+import wfsverify
+from stat import S_ISREG
+
+WFS_BLOCK_COMPRESSED = 1 << 62
+
+def fill(disks, blocks):
+    """Mark the first BLOCKS data blocks of every disk in use."""
+    for disk in disks:
+        wfsverify.WfsState(disk).fill_datablock_bitmap(blocks)
+
+def check(disk, minimum):
+    """Exit 1 unless every block pointer of a regular file is at least MINIMUM."""
+    fs = wfsverify.WfsState(disk)
+    for inodep in fs.list_allocated_inodes():
+        inode = fs.read_inode(inodep)
+        if not S_ISREG(inode['mode']):
+            continue
+        for ptr in fs.inode_block_ptrs(inode):
+            if ptr != -1 and ptr & ~WFS_BLOCK_COMPRESSED < minimum:
+                print(f"inode {inodep}: block id {ptr} is below {minimum}")
+                exit(1)
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    fill_parser = sub.add_parser("fill", help="mark low data blocks in use")
+    fill_parser.add_argument("blocks", type=int, help="blocks per disk, a multiple of 8")
+    fill_parser.add_argument("--disks", nargs="+", help="list of disks")
+    check_parser = sub.add_parser("check", help="check file block ids")
+    check_parser.add_argument("minimum", type=int)
+    check_parser.add_argument("--disk", help="any disk of the filesystem")
+
+    args = parser.parse_args()
+
+    if args.cmd == "fill":
+        fill(args.disks, args.blocks)
+    else:
+        check(args.disk, args.minimum)
@@ -0,0 +1,51 @@
+#!/usr/bin/python3
+
+# issue the wfs ioctls from solution/wfs.h on a mounted filesystem
+
+import argparse
+import fcntl
+import os
+import struct
+
+PATH_MAX = 4096
+
+def iow(nr, size):
+    """Return the request number of _IOW('W', NR, a SIZE byte argument)."""
+    return (1 << 30) | (size << 16) | (ord('W') << 8) | nr
+
+WFS_IOC_SET_COMPRESSION = iow(2, 4)
+WFS_IOC_ADD_DISK = iow(3, PATH_MAX + 4)
+
+def ioctl(path, request, arg):
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        # a mutable buffer is passed through as is, with no 1024 byte limit
+        fcntl.ioctl(fd, request, bytearray(arg))
+    finally:
+        os.close(fd)
+
+def set_compression(path, on):
+    ioctl(path, WFS_IOC_SET_COMPRESSION, struct.pack("i", on))
+
+def add_disk(path, image, tier):
+    image = os.path.abspath(image).encode()
+    ioctl(path, WFS_IOC_ADD_DISK,
+          struct.pack("%dsi" % PATH_MAX, image, tier))
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    compress = sub.add_parser("compress", help="switch one file's compression")
+    compress.add_argument("file")
+    compress.add_argument("on", type=int, choices=[0, 1])
+    grow = sub.add_parser("add-disk", help="add a formatted image (mkfs -g)")
+    grow.add_argument("file", help="any file on the filesystem")
+    grow.add_argument("image")
+    grow.add_argument("--tier", type=int, default=0)
+
+    args = parser.parse_args()
+
+    if args.cmd == "compress":
+        set_compression(args.file, args.on)
+    else:
+        add_disk(args.file, args.image, args.tier)
@@ -1,3 +1,4 @@
+import struct
 import sys
 
 class WfsState:
@@ -28,7 +29,8 @@ class WfsState:
 
     def list_allocations(self, bitmap):
         """Return a list of all the allocated positions in a bitmap."""
-        return [bytep * 8 + bitp for bytep, byte in enumerate(bitmap)
+        # allocations start from the front, so a huge bitmap is mostly a zero tail
+        return [bytep * 8 + bitp for bytep, byte in enumerate(bitmap.rstrip(b'\x00'))
                 for bitp in range(8) if byte & (1 << bitp)]
 
     def list_allocated_inodes(self):
@@ -50,6 +52,10 @@ class WfsState:
         pos = self.get_iblock_region() + (inodep * self.blksize)
         return self.read_struct(pos, self.inode)
 
+    def inode_block_ptrs(self, inode):
+        """Return the block pointers of an inode read by read_inode, -1 if unused."""
+        return list(struct.unpack("8q", inode['blocks'].to_bytes(64, sys.byteorder)))
+
     def read_superblock(self):
         """Read a superblock from disk and return a dict of its fields."""
         return self.read_struct(0, self.superblock)
@@ -72,6 +78,16 @@ class WfsState:
             diskf.seek(self.get_dblock_region() + self.blksize)
             diskf.write(b'\x00' * ((self.get_sb_datablocks() - 1) * self.blksize))
 
+    def fill_datablock_bitmap(self, blocks=None):
+        """Mark the first BLOCKS data blocks, or every one, allocated in the data bitmap."""
+        if blocks is None:
+            blocks = self.get_sb_datablocks()
+        chunk = b'\xff' * (1 << 20)
+        with open(self.disk, "r+b") as diskf:
+            diskf.seek(self.get_dbit())
+            for start in range(0, int(blocks / 8), len(chunk)):
+                diskf.write(chunk[:int(blocks / 8) - start])
+
     def get_sb_inodes(self):
         """Return the total number of inodes in the filesystem."""
         return self.sb['inodes']